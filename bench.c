@@ -0,0 +1,404 @@
+/*
+  Benchmarks
+
+  Each workload runs in its own child process so peak RSS is its own.
+  Results are printed as tab-separated columns, one workload per line:
+
+    workload  ops  ns_per_op  allocs_per_op  peak_rss_kb
+
+  Given the output of an earlier run as an argument, two more columns
+  compare against it: the old ns_per_op and new/old time.
+
+  Allocations are malloc, calloc and realloc calls made by the
+  interpreter, counted by linking with --wrap (see the Makefile).
+*/
+
+#define _DEFAULT_SOURCE // wait4
+
+#include "lval.h"
+#include "list.h"
+#include "map.h"
+#include "environment.h"
+#include "builtin.h"
+#include "read.h"
+#include "port.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define MAXWORKLOAD 64 // Max workloads in a baseline file
+
+// ALLOCATION COUNTING
+
+long allocs = 0;
+
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t n);
+
+void *__wrap_malloc(size_t n) { allocs++; return __real_malloc(n); }
+void *__wrap_calloc(size_t n, size_t size) { allocs++; return __real_calloc(n, size); }
+void *__wrap_realloc(void *p, size_t n) { allocs++; return __real_realloc(p, n); }
+
+// TIMING
+
+typedef struct result {
+  long ops;
+  double ns;
+  long allocs;
+} result;
+
+struct timespec start_time;
+long start_allocs;
+
+/* Called by a workload once its setup is done */
+void
+bench_begin(void)
+{
+  start_allocs = allocs;
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+result
+bench_end(long ops)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double ns = (now.tv_sec - start_time.tv_sec) * 1e9 + (now.tv_nsec - start_time.tv_nsec);
+  return (result){ops, ns, allocs - start_allocs};
+}
+
+lenv *
+bench_env(void)
+{
+  lenv *e = lenv_new(NULL);
+  env_add_builtins(e);
+  return e;
+}
+
+lval *eval(lenv *e, char *s) { return lval_eval(e, read_line(s)); }
+
+// WORKLOADS
+
+result
+bench_fact(void)
+{
+  lenv *e = bench_env();
+  eval(e, "(def fact (\\ (n) (if (= n 0) 1 (* n (fact (- n 1))))))");
+  lval *call = read_line("(fact 20)");
+  long n = 5000;
+  bench_begin();
+  for (long i = 0; i < n; i++) { lval_eval(e, call); }
+  return bench_end(n);
+}
+
+result
+bench_fib(void)
+{
+  lenv *e = bench_env();
+  eval(e, "(def fib (\\ (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))");
+  lval *call = read_line("(fib 15)");
+  long n = 100;
+  bench_begin();
+  for (long i = 0; i < n; i++) { lval_eval(e, call); }
+  return bench_end(n);
+}
+
+result
+bench_list_cons(void) // One op is one element
+{
+  long n = 0;
+  bench_begin();
+  for (int round = 0; round < 20; round++) {
+    lval *l = lval_sexp();
+    for (long i = 0; i < 100000; i++, n++) { lval_cons(l, lval_num(i)); }
+  }
+  return bench_end(n);
+}
+
+result
+bench_list_nth(void) // One op is one `lval_nth` on a 1000 element list
+{
+  lval *l = lval_sexp();
+  for (long i = 0; i < 1000; i++) { lval_cons(l, lval_num(i)); }
+  long n = 0;
+  bench_begin();
+  for (int round = 0; round < 10; round++) {
+    for (int i = 0; i < 1000; i++, n++) { lval_nth(l, i); }
+  }
+  return bench_end(n);
+}
+
+#define NKEYS 200000
+
+lval **
+bench_keys(void)
+{
+  lval **keys = malloc(NKEYS * sizeof(lval *));
+  char name[32];
+  for (long i = 0; i < NKEYS; i++) {
+    if (i % 2) {
+      keys[i] = lval_num(i);
+    } else {
+      snprintf(name, sizeof(name), "key-%ld", i);
+      keys[i] = lval_sym(name);
+    }
+  }
+  return keys;
+}
+
+result
+bench_dict_insert(void) // One op is one new key
+{
+  lval **keys = bench_keys();
+  bench_begin();
+  map *m = map_new();
+  for (long i = 0; i < NKEYS; i++) { map_add(m, keys[i], keys[i]); }
+  return bench_end(NKEYS);
+}
+
+result
+bench_dict_lookup(void)
+{
+  lval **keys = bench_keys();
+  map *m = map_new();
+  for (long i = 0; i < NKEYS; i++) { map_add(m, keys[i], keys[i]); }
+  long found = 0;
+  bench_begin();
+  for (int round = 0; round < 5; round++) {
+    for (long i = 0; i < NKEYS; i++) { found += map_get(m, keys[i]) != NULL; }
+  }
+  result r = bench_end(5 * NKEYS);
+  if (found != 5 * NKEYS) { fprintf(stderr, "bench: dict lookup failed\n"); }
+  return r;
+}
+
+result
+bench_dict_copy(void) // One op is one key copied
+{
+  lval **keys = bench_keys();
+  map *m = map_new();
+  for (long i = 0; i < NKEYS; i++) { map_add(m, keys[i], keys[i]); }
+  bench_begin();
+  for (int round = 0; round < 5; round++) { map_copy(m); }
+  return bench_end(5 * NKEYS);
+}
+
+result
+bench_parse(void) // One op is one top-level form
+{
+  char fname[] = "/tmp/byol-bench-XXXXXX";
+  int fd = mkstemp(fname);
+  FILE *f = fdopen(fd, "w");
+  long n = 50000;
+  for (long i = 0; i < n; i++) {
+    fprintf(f, "(def f%ld (\\ (x y) (+ x (* y %ld) (list \"str %ld\" true -%ld))))\n",
+	    i, i, i, i);
+  }
+  fclose(f);
+
+  bench_begin();
+  reader *r = reader_open(fname);
+  long forms = 0;
+  while (read_next(r)) { forms++; }
+  reader_close(r);
+  result res = bench_end(forms);
+  remove(fname);
+  return res;
+}
+
+result
+bench_curry(void) // One op is one fully applied, curried call
+{
+  lenv *e = bench_env();
+  eval(e, "(def add3 (\\ (a b c) (+ a (+ b c))))");
+  lval *call = read_line("(((add3 1) 2) 3)");
+  long n = 100000;
+  bench_begin();
+  for (long i = 0; i < n; i++) { lval_eval(e, call); }
+  return bench_end(n);
+}
+
+result
+bench_print(void) // One op is one element of a mixed list printed
+{
+  lval *l = lval_sexp();
+  for (long i = 0; i < 1000; i++) {
+    switch (i % 4) {
+    case 0: lval_cons(l, lval_num(i * 7919)); break;
+    case 1: lval_cons(l, lval_string("a printed string")); break;
+    case 2: lval_cons(l, read_line("(nested (list of) 3 symbols)")); break;
+    case 3: lval_cons(l, lval_bool(i % 8 == 3)); break;
+    }
+  }
+  port *p = port_string();
+  bench_begin();
+  for (int round = 0; round < 200; round++) {
+    lval_write(p, l);
+    port_clear(p);
+  }
+  return bench_end(200 * 1000);
+}
+
+/* `e` with `l` bound to a list of 1000 numbers */
+lenv *
+bench_list_env(void)
+{
+  lenv *e = bench_env();
+  lval *l = lval_sexp();
+  for (long i = 0; i < 1000; i++) { lval_cons(l, lval_num(i)); }
+  lenv_set(e, lval_sym("l"), l);
+  return e;
+}
+
+result
+bench_map(void) // One op is one element mapped by the builtin
+{
+  lenv *e = bench_list_env();
+  lval *call = read_line("(map (\\ (x) (+ x 1)) l)");
+  bench_begin();
+  for (int round = 0; round < 200; round++) { lval_eval(e, call); }
+  return bench_end(200 * 1000);
+}
+
+result
+bench_map_lisp(void) // One op is one element mapped by a map written in Lisp
+{
+  lenv *e = bench_list_env();
+  eval(e, "(def lmap (\\ (f l) (if (= l ()) () (cons (f (head l)) (lmap f (tail l))))))");
+  lval *call = read_line("(lmap (\\ (x) (+ x 1)) l)");
+  bench_begin();
+  for (int round = 0; round < 200; round++) { lval_eval(e, call); }
+  return bench_end(200 * 1000);
+}
+
+result
+bench_forms(void) // One op is one small top-level form read and evaluated
+{
+  char fname[] = "/tmp/byol-bench-XXXXXX";
+  int fd = mkstemp(fname);
+  FILE *f = fdopen(fd, "w");
+  long n = 200000;
+  for (long i = 0; i < n; i++) {
+    if (i % 100 == 0) { fprintf(f, "(def last (list %ld))\n", i); } // A few escape
+    else { fprintf(f, "(foldl + 0 (map (\\ (x) (* x %ld)) (list 1 2 3 4 5 6 7 8)))\n", i); }
+  }
+  fclose(f);
+
+  lenv *e = bench_env();
+  bench_begin();
+  reader *r = reader_open(fname);
+  eval_reader(e, r);
+  reader_close(r);
+  result res = bench_end(n);
+  remove(fname);
+  return res;
+}
+
+struct workload {
+  char *name;
+  result (*run)(void);
+};
+
+struct workload workloads[] = {
+  {"fact", bench_fact},
+  {"fib", bench_fib},
+  {"list-cons", bench_list_cons},
+  {"list-nth", bench_list_nth},
+  {"dict-insert", bench_dict_insert},
+  {"dict-lookup", bench_dict_lookup},
+  {"dict-copy", bench_dict_copy},
+  {"parse", bench_parse},
+  {"curry", bench_curry},
+  {"print", bench_print},
+  {"map", bench_map},
+  {"map-lisp", bench_map_lisp},
+  {"forms", bench_forms},
+  {NULL, NULL}
+};
+
+// BASELINE
+
+struct baseline {
+  char name[64];
+  double ns_per_op;
+};
+
+struct baseline baseline[MAXWORKLOAD];
+int nbaseline = 0;
+
+/* Read the ns_per_op column of an earlier run */
+void
+load_baseline(char *fname)
+{
+  FILE *f = fopen(fname, "r");
+  if (!f) {
+    fprintf(stderr, "bench: cannot read baseline `%s`\n", fname);
+    exit(1);
+  }
+  char line[256];
+  while (nbaseline < MAXWORKLOAD && fgets(line, sizeof(line), f)) {
+    struct baseline *b = &baseline[nbaseline];
+    long ops;
+    if (sscanf(line, "%63s %ld %lf", b->name, &ops, &b->ns_per_op) == 3) { nbaseline++; }
+  }
+  fclose(f);
+}
+
+double
+baseline_ns(char *name)
+{
+  for (int i = 0; i < nbaseline; i++) {
+    if (strcmp(baseline[i].name, name) == 0) { return baseline[i].ns_per_op; }
+  }
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc > 1) { load_baseline(argv[1]); }
+  printf("workload\tops\tns_per_op\tallocs_per_op\tpeak_rss_kb%s\n",
+	 nbaseline ? "\told_ns_per_op\tratio" : "");
+  fflush(stdout);
+
+  for (struct workload *w = workloads; w->name; w++) {
+    int fds[2];
+    if (pipe(fds) < 0) { perror("bench: pipe"); return 1; }
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      result r = w->run();
+      if (write(fds[1], &r, sizeof(r)) != sizeof(r)) { _exit(1); }
+      _exit(0);
+    }
+    close(fds[1]);
+    result r;
+    ssize_t got = read(fds[0], &r, sizeof(r));
+    close(fds[0]);
+    int status;
+    struct rusage ru;
+    wait4(pid, &status, 0, &ru);
+    if (got != sizeof(r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "bench: workload `%s` failed\n", w->name);
+      continue;
+    }
+
+    double ns_per_op = r.ns / r.ops;
+    printf("%s\t%ld\t%.1f\t%.2f\t%ld", w->name, r.ops, ns_per_op,
+	   (double)r.allocs / r.ops, ru.ru_maxrss);
+    double old = baseline_ns(w->name);
+    if (old > 0) { printf("\t%.1f\t%.3f", old, ns_per_op / old); }
+    else if (nbaseline) { printf("\t-\t-"); }
+    putchar('\n');
+    fflush(stdout);
+  }
+  return 0;
+}
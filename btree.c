@@ -0,0 +1,291 @@
+/*
+  B+ tree of lvals, ordered by lval_compare
+
+  Every key and value lives in the leaves, which are chained left to
+  right so ordered scans never climb back up the tree. Inner nodes
+  only route: child i holds the keys k with keys[i-1] <= k < keys[i].
+  Nodes hold up to ORDER keys so a lookup touches few cache lines.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "btree.h"
+#include "lval.h"
+#include "image.h"
+
+#define ORDER 32 // Max keys per node; a node is split when it fills
+
+struct bnode {
+  bool leaf;
+  int n;
+  lval *keys[ORDER];
+  union {
+    lval *vals[ORDER]; // Leaves
+    bnode *kids[ORDER + 1]; // Inner nodes
+  };
+  bnode *next; // Next leaf
+};
+
+struct btree {
+  bnode *root;
+  size_t count;
+};
+
+bnode *
+bnode_new(bool leaf)
+{
+  bnode *n = calloc(1, sizeof(bnode));
+  n->leaf = leaf;
+  return n;
+}
+
+btree *
+btree_new(void)
+{
+  btree *t = calloc(1, sizeof(btree));
+  t->root = bnode_new(true);
+  return t;
+}
+
+void
+bnode_delete(bnode *n)
+{
+  if (!n->leaf) {
+    for (int i = 0; i <= n->n; i++) { bnode_delete(n->kids[i]); }
+  }
+  image_free(n);
+}
+
+/* Free the tree itself. Keys and values may be shared, so they are kept */
+void
+btree_delete(btree *t)
+{
+  bnode_delete(t->root);
+  image_free(t);
+}
+
+bnode *
+bnode_copy(bnode *n, bnode **last_leaf)
+{
+  bnode *x = malloc(sizeof(bnode));
+  memcpy(x, n, sizeof(bnode));
+  if (n->leaf) {
+    x->next = NULL;
+    if (*last_leaf) { (*last_leaf)->next = x; }
+    *last_leaf = x;
+  } else {
+    for (int i = 0; i <= n->n; i++) { x->kids[i] = bnode_copy(n->kids[i], last_leaf); }
+  }
+  return x;
+}
+
+btree * /* Copies the nodes; keys and values are shared */
+btree_copy(btree *t)
+{
+  btree *x = malloc(sizeof(btree));
+  bnode *last_leaf = NULL;
+  x->root = bnode_copy(t->root, &last_leaf);
+  x->count = t->count;
+  return x;
+}
+
+size_t btree_count(btree *t) { return t->count; }
+
+/* Number of keys in `n` less than `k` */
+int
+lower_bound(bnode *n, lval *k)
+{
+  int lo = 0, hi = n->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (lval_compare(n->keys[mid], k) < 0) { lo = mid + 1; } else { hi = mid; }
+  }
+  return lo;
+}
+
+/* Number of keys in `n` less than or equal to `k` */
+int
+upper_bound(bnode *n, lval *k)
+{
+  int lo = 0, hi = n->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (lval_compare(n->keys[mid], k) <= 0) { lo = mid + 1; } else { hi = mid; }
+  }
+  return lo;
+}
+
+bnode *
+find_leaf(btree *t, lval *k)
+{
+  bnode *n = t->root;
+  while (!n->leaf) { n = n->kids[upper_bound(n, k)]; }
+  return n;
+}
+
+/*
+   Insert into the subtree at `n`. When `n` splits, the new right half
+   is returned and its lowest key stored in `*sep`.
+*/
+bnode *
+bnode_insert(btree *t, bnode *n, lval *k, lval *v, lval **sep)
+{
+  if (n->leaf) {
+    int i = lower_bound(n, k);
+    if (i < n->n && lval_compare(n->keys[i], k) == 0) {
+      n->vals[i] = v;
+      return NULL;
+    }
+    memmove(&n->keys[i + 1], &n->keys[i], (n->n - i) * sizeof(lval *));
+    memmove(&n->vals[i + 1], &n->vals[i], (n->n - i) * sizeof(lval *));
+    n->keys[i] = k;
+    n->vals[i] = v;
+    n->n++;
+    t->count++;
+    if (n->n < ORDER) { return NULL; }
+
+    bnode *right = bnode_new(true);
+    int half = ORDER / 2;
+    right->n = ORDER - half;
+    memcpy(right->keys, &n->keys[half], right->n * sizeof(lval *));
+    memcpy(right->vals, &n->vals[half], right->n * sizeof(lval *));
+    n->n = half;
+    right->next = n->next;
+    n->next = right;
+    *sep = right->keys[0];
+    return right;
+  }
+
+  int i = upper_bound(n, k);
+  lval *child_sep;
+  bnode *split = bnode_insert(t, n->kids[i], k, v, &child_sep);
+  if (!split) { return NULL; }
+  memmove(&n->keys[i + 1], &n->keys[i], (n->n - i) * sizeof(lval *));
+  memmove(&n->kids[i + 2], &n->kids[i + 1], (n->n - i) * sizeof(bnode *));
+  n->keys[i] = child_sep;
+  n->kids[i + 1] = split;
+  n->n++;
+  if (n->n < ORDER) { return NULL; }
+
+  // The middle key moves up; it isn't kept in either half
+  bnode *right = bnode_new(false);
+  int mid = ORDER / 2;
+  right->n = ORDER - mid - 1;
+  memcpy(right->keys, &n->keys[mid + 1], right->n * sizeof(lval *));
+  memcpy(right->kids, &n->kids[mid + 1], (right->n + 1) * sizeof(bnode *));
+  *sep = n->keys[mid];
+  n->n = mid;
+  return right;
+}
+
+/* Add a key:value pair, overwriting the value if `k` is already present */
+void
+btree_put(btree *t, lval *k, lval *v)
+{
+  lval *sep;
+  bnode *right = bnode_insert(t, t->root, k, v, &sep);
+  if (right) {
+    bnode *root = bnode_new(false);
+    root->n = 1;
+    root->keys[0] = sep;
+    root->kids[0] = t->root;
+    root->kids[1] = right;
+    t->root = root;
+  }
+}
+
+lval *
+btree_get(btree *t, lval *k)
+{
+  bnode *n = find_leaf(t, k);
+  int i = lower_bound(n, k);
+  if (i < n->n && lval_compare(n->keys[i], k) == 0) { return n->vals[i]; }
+  return NULL;
+}
+
+/* Cursor at the lowest key */
+bcursor
+btree_first(btree *t)
+{
+  bnode *n = t->root;
+  while (!n->leaf) { n = n->kids[0]; }
+  return (bcursor){n, 0};
+}
+
+/* Cursor at the lowest key >= `k` */
+bcursor
+btree_seek(btree *t, lval *k)
+{
+  bnode *n = find_leaf(t, k);
+  return (bcursor){n, lower_bound(n, k)};
+}
+
+/* Store the pair under the cursor and advance, or return false at the end */
+bool
+btree_next(bcursor *c, lval **k, lval **v)
+{
+  while (c->leaf && c->pos >= c->leaf->n) {
+    c->leaf = c->leaf->next;
+    c->pos = 0;
+  }
+  if (!c->leaf) { return false; }
+  *k = c->leaf->keys[c->pos];
+  *v = c->leaf->vals[c->pos++];
+  return true;
+}
+
+/* The pair with the greatest key <= `k`. Returns false if there is none */
+bool
+btree_floor(btree *t, lval *k, lval **key, lval **val)
+{
+  bnode *n = find_leaf(t, k);
+  // A leaf's lowest key is the separator that routed us here, so it is <= k
+  int i = upper_bound(n, k);
+  if (i == 0) { return false; }
+  *key = n->keys[i - 1];
+  *val = n->vals[i - 1];
+  return true;
+}
+
+/* The pair with the least key >= `k`. Returns false if there is none */
+bool
+btree_ceiling(btree *t, lval *k, lval **key, lval **val)
+{
+  bcursor c = btree_seek(t, k);
+  return btree_next(&c, key, val);
+}
+
+size_t
+bnode_image_dump(image *im, bnode *n)
+{
+  size_t off;
+  if (!n) { return 0; }
+  if (image_seen(im, n, &off)) { return off; }
+  off = image_alloc(im, n, sizeof(bnode));
+  for (int i = 0; i < n->n; i++) {
+    image_ptr(im, off + offsetof(bnode, keys) + i * sizeof(lval *), lval_image_dump(im, n->keys[i]));
+    if (n->leaf) {
+      image_ptr(im, off + offsetof(bnode, vals) + i * sizeof(lval *), lval_image_dump(im, n->vals[i]));
+    }
+  }
+  if (!n->leaf) {
+    for (int i = 0; i <= n->n; i++) {
+      image_ptr(im, off + offsetof(bnode, kids) + i * sizeof(bnode *), bnode_image_dump(im, n->kids[i]));
+    }
+  }
+  image_ptr(im, off + offsetof(bnode, next), bnode_image_dump(im, n->next));
+  return off;
+}
+
+/* Copy `t` and its nodes into an image */
+size_t
+btree_image_dump(image *im, btree *t)
+{
+  size_t off;
+  if (image_seen(im, t, &off)) { return off; }
+  off = image_alloc(im, t, sizeof(btree));
+  image_ptr(im, off + offsetof(btree, root), bnode_image_dump(im, t->root));
+  return off;
+}
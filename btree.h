@@ -0,0 +1,32 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "structs.h"
+
+typedef struct bnode bnode;
+
+typedef struct bcursor { // Position in a tree's leaves
+  bnode *leaf;
+  int pos;
+} bcursor;
+
+btree *btree_new(void);
+void btree_delete(btree *t);
+btree *btree_copy(btree *t);
+
+void btree_put(btree *t, lval *k, lval *v);
+lval *btree_get(btree *t, lval *k);
+size_t btree_count(btree *t);
+bool btree_floor(btree *t, lval *k, lval **key, lval **val);
+bool btree_ceiling(btree *t, lval *k, lval **key, lval **val);
+
+bcursor btree_first(btree *t);
+bcursor btree_seek(btree *t, lval *k);
+bool btree_next(bcursor *c, lval **k, lval **v);
+
+size_t btree_image_dump(image *im, btree *t);
+
+#endif
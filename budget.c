@@ -0,0 +1,117 @@
+/*
+  Evaluation budgets
+
+  lval_eval_sexp counts down `budget_ticks` and calls budget_tick when
+  it goes negative. Without a budget the count starts so high it never
+  does. With one, ticks are handed out in slices of at most SLICE
+  steps, so the clock and the heap are only looked at once a slice.
+
+  After an abort every step fails at once, so the error reaches the
+  top even through code that would carry on after an error.
+*/
+
+#include "budget.h"
+#include "lval.h"
+#include "memstats.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+
+#define SLICE 1024 // Steps between checks of the clock and heap
+
+__thread long budget_ticks = LONG_MAX;
+__thread budget *active = NULL;
+__thread long granted = 0; // Size of the current slice
+
+long
+now_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Name the limit `b` has run out of, or return NULL */
+char *
+over_limit(budget *b)
+{
+  if (b->steps && b->used >= b->steps) { return "steps"; }
+  if (b->ms && now_ms() - b->start >= b->ms) { return "time"; }
+  if (b->bytes && mem_heap_bytes() - b->heap >= b->bytes) { return "memory"; }
+  return NULL;
+}
+
+void
+grant(budget *b)
+{
+  granted = SLICE;
+  if (b->steps && b->steps - b->used < granted) { granted = b->steps - b->used; }
+  budget_ticks = granted;
+}
+
+/* Called when a slice runs out. Returns NULL to go on, or the error to stop with */
+lval *
+budget_tick(void)
+{
+  budget *b = active;
+  if (!b) {
+    budget_ticks = LONG_MAX;
+    return NULL;
+  }
+  if (!b->aborted) {
+    b->used += granted - (budget_ticks + 1); // The count went to -1
+    char *why;
+    while ((why = over_limit(b))) {
+      b->why = why;
+      if (!b->exhausted || !b->exhausted(b, b->data)) {
+	b->aborted = true;
+	break;
+      }
+    }
+  }
+  if (b->aborted) {
+    budget_ticks = 0;
+    granted = 0;
+    return lval_err("ERROR: Evaluation budget exhausted (%s)", b->why);
+  }
+  grant(b);
+  budget_ticks--; // This step
+  b->used++;
+  granted--;
+  return NULL;
+}
+
+/* Run evaluations under `b` until budget_stop. Returns the budget it replaces */
+budget *
+budget_start(budget *b)
+{
+  budget *prev = active;
+  if (prev && !prev->aborted) { prev->used += granted - budget_ticks; }
+  active = b;
+  b->why = NULL;
+  b->used = 0;
+  b->aborted = false;
+  b->start = now_ms();
+  b->heap = mem_heap_bytes();
+  grant(b);
+  return prev;
+}
+
+/* Stop the running budget and go back to `prev`, which may be NULL */
+void
+budget_stop(budget *prev)
+{
+  if (active && !active->aborted) { active->used += granted - budget_ticks; }
+  active = prev;
+  if (prev && !prev->aborted) { grant(prev); }
+  else if (prev) { budget_ticks = 0; }
+  else { budget_ticks = LONG_MAX; }
+}
+
+/* Steps taken so far under `b` */
+long
+budget_used(budget *b)
+{
+  return b == active && !b->aborted ? b->used + granted - budget_ticks : b->used;
+}
@@ -0,0 +1,45 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdbool.h>
+
+#include "structs.h"
+
+/*
+   A limit on one evaluation: steps (sexps evaluated), wall-clock time
+   and heap growth. A limit of 0 is no limit. When one runs out,
+   `exhausted` is called, if set, with `why` naming the limit. It may
+   raise the limits and return true to resume the evaluation where it
+   stopped; otherwise the evaluation unwinds with an error, and nothing
+   else is evaluated until the budget is stopped.
+
+   Heap growth is measured with the heap statistics, so it is not
+   limited in builds with -DNMEMSTATS.
+*/
+
+typedef struct budget budget;
+
+struct budget {
+  long steps;
+  long ms;
+  long bytes;
+  bool (*exhausted)(budget *b, void *data);
+  void *data;
+
+  // Kept while the budget runs
+  char *why;
+  long used; // Steps taken
+  long start; // Monotonic clock, in ms
+  long heap; // Heap size when it started
+  bool aborted;
+};
+
+/* Steps left before budget_tick must be called. Never runs out without a budget */
+extern __thread long budget_ticks;
+
+budget *budget_start(budget *b);
+void budget_stop(budget *prev);
+lval *budget_tick(void);
+long budget_used(budget *b);
+
+#endif
@@ -8,9 +8,23 @@
 #include "builtin.h"
 #include "structs.h"
 #include "environment.h"
+#include "fasl.h"
+#include "json.h"
+#include "port.h"
+#include "btree.h"
+#include "vector.h"
+#include "memstats.h"
+#include "profile.h"
+#include "native.h"
+#include "memo.h"
+#include "record.h"
+#include "cell.h"
+#include "region.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
 
 enum { FUNCTION, MACRO };
 
@@ -18,7 +32,7 @@ enum { FUNCTION, MACRO };
 void
 env_add_builtin(lenv *e, char *name, lbuiltin fn, int type)
 {
-  lval *v;
+  lval *v = NULL;
   switch (type) {
   case FUNCTION:
     v = lval_builtin_function(e, fn);
@@ -30,30 +44,154 @@ env_add_builtin(lenv *e, char *name, lbuiltin fn, int type)
   lenv_set(e, lval_sym(name), v);
 }
 
+struct builtin_entry {
+  char *name;
+  lbuiltin fn;
+  int type;
+};
+
+/* Every builtin, by name. Heap images re-link function pointers through this */
+struct builtin_entry builtins[] = {
+  {"\\", builtin_lambda, MACRO},
+  {"macro", builtin_macro, MACRO},
+  {"if", builtin_if, MACRO},
+  {"def", builtin_def, MACRO},
+  {"progn", builtin_progn, MACRO},
+  {"with-profiling", builtin_with_profiling, MACRO},
+  {"defstruct", builtin_defstruct, MACRO},
+  {"defcell", builtin_defcell, MACRO},
+  {"set-cell!", builtin_set_cell, MACRO},
+  {"cell-batch", builtin_cell_batch, MACRO},
+
+  {"list", builtin_list, FUNCTION},
+  {"head", builtin_head, FUNCTION},
+  {"tail", builtin_tail, FUNCTION},
+  {"eval", builtin_eval, FUNCTION},
+  {"read", builtin_read, FUNCTION},
+  {"load", builtin_load, FUNCTION},
+  {"serialize", builtin_serialize, FUNCTION},
+  {"deserialize", builtin_deserialize, FUNCTION},
+  {"serialize-file", builtin_serialize_file, FUNCTION},
+  {"deserialize-file", builtin_deserialize_file, FUNCTION},
+  {"read-json", builtin_read_json, FUNCTION},
+  {"read-json-file", builtin_read_json_file, FUNCTION},
+  {"write-json", builtin_write_json, FUNCTION},
+  {"write-json-file", builtin_write_json_file, FUNCTION},
+  {"to-string", builtin_to_string, FUNCTION},
+  {"mem-stats", builtin_mem_stats, FUNCTION},
+  {"profile-start", builtin_profile_start, FUNCTION},
+  {"profile-stop", builtin_profile_stop, FUNCTION},
+  {"load-native", builtin_load_native, FUNCTION},
+  {"native-call", builtin_native_call, FUNCTION},
+  {"memo", builtin_memo, FUNCTION},
+  {"memo-call", builtin_memo_call, FUNCTION},
+  {"memo-stats", builtin_memo_stats, FUNCTION},
+  {"record-new", builtin_record_new, FUNCTION},
+  {"record-is", builtin_record_is, FUNCTION},
+  {"record-get", builtin_record_get, FUNCTION},
+  {"cell-stats", builtin_cell_stats, FUNCTION},
+  {"cons", builtin_cons, FUNCTION},
+  {"map", builtin_map, FUNCTION},
+  {"filter", builtin_filter, FUNCTION},
+  {"foldl", builtin_foldl, FUNCTION},
+  {"foldr", builtin_foldr, FUNCTION},
+  {"length", builtin_length, FUNCTION},
+  {"reverse", builtin_reverse, FUNCTION},
+  {"append", builtin_append, FUNCTION},
+  {"sorted-map", builtin_sorted_map, FUNCTION},
+  {"sorted-put", builtin_sorted_put, FUNCTION},
+  {"sorted-get", builtin_sorted_get, FUNCTION},
+  {"sorted-keys", builtin_sorted_keys, FUNCTION},
+  {"sorted-entries", builtin_sorted_entries, FUNCTION},
+  {"range", builtin_range, FUNCTION},
+  {"floor", builtin_floor, FUNCTION},
+  {"ceiling", builtin_ceiling, FUNCTION},
+  {"vec", builtin_vec, FUNCTION},
+  {"vec-count", builtin_vec_count, FUNCTION},
+  {"vec-nth", builtin_vec_nth, FUNCTION},
+  {"vec-assoc", builtin_vec_assoc, FUNCTION},
+  {"vec-conj", builtin_vec_conj, FUNCTION},
+  {"vec-concat", builtin_vec_concat, FUNCTION},
+  {"vec-slice", builtin_vec_slice, FUNCTION},
+  {"vec-list", builtin_vec_list, FUNCTION},
+  {"vec-transient", builtin_vec_transient, FUNCTION},
+  {"vec-conj!", builtin_vec_conj_in_place, FUNCTION},
+  {"vec-assoc!", builtin_vec_assoc_in_place, FUNCTION},
+  {"vec-persistent!", builtin_vec_persistent, FUNCTION},
+  {"=", builtin_equal, FUNCTION},
+
+  {"+", builtin_add, FUNCTION},
+  {"-", builtin_sub, FUNCTION},
+  {"*", builtin_multiply, FUNCTION},
+  {"/", builtin_divide, FUNCTION},
+  {">", builtin_greaterthan, FUNCTION},
+  {"<", builtin_lessthan, FUNCTION},
+  {NULL, NULL, 0}
+};
+
 void
 env_add_builtins(lenv *e)
 {
-  env_add_builtin(e, "\\", builtin_lambda, MACRO);
-  env_add_builtin(e, "macro", builtin_macro, MACRO);
-  env_add_builtin(e, "if", builtin_if, MACRO);
-  env_add_builtin(e, "def", builtin_def, MACRO);
-  env_add_builtin(e, "progn", builtin_progn, MACRO);
-
-  env_add_builtin(e, "list", builtin_list, FUNCTION);
-  env_add_builtin(e, "head", builtin_head, FUNCTION);
-  env_add_builtin(e, "tail", builtin_tail, FUNCTION);
-  env_add_builtin(e, "eval", builtin_eval, FUNCTION);
-  env_add_builtin(e, "read", builtin_read, FUNCTION);
-  env_add_builtin(e, "load", builtin_load, FUNCTION);
-  env_add_builtin(e, "cons", builtin_cons, FUNCTION);
-  env_add_builtin(e, "=", builtin_equal, FUNCTION);
-
-  env_add_builtin(e, "+", builtin_add, FUNCTION);
-  env_add_builtin(e, "-", builtin_sub, FUNCTION);
-  env_add_builtin(e, "*", builtin_multiply, FUNCTION);
-  env_add_builtin(e, "/", builtin_divide, FUNCTION);
-  env_add_builtin(e, ">", builtin_greaterthan, FUNCTION);
-  env_add_builtin(e, "<", builtin_lessthan, FUNCTION);
+  for (struct builtin_entry *b = builtins; b->name; b++) {
+    env_add_builtin(e, b->name, b->fn, b->type);
+  }
+}
+
+/* Builtins added at run time by native libraries, shared by every thread */
+struct builtin_entry *registered = NULL;
+int nregistered = 0;
+pthread_mutex_t registered_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The builtin in `builtins` or `registered` called `name`, or NULL. Hold the lock */
+lbuiltin
+find_builtin(char *name)
+{
+  for (struct builtin_entry *b = builtins; b->name; b++) {
+    if (strcmp(b->name, name) == 0) { return b->fn; }
+  }
+  for (int i = 0; i < nregistered; i++) {
+    if (strcmp(registered[i].name, name) == 0) { return registered[i].fn; }
+  }
+  return NULL;
+}
+
+/* Adds `fn` to the environment and lets images and fasl find it by name */
+void
+builtin_register(lenv *e, char *name, lbuiltin fn)
+{
+  pthread_mutex_lock(&registered_lock);
+  if (!find_builtin(name)) {
+    registered = realloc(registered, (nregistered + 1) * sizeof(struct builtin_entry));
+    registered[nregistered++] = (struct builtin_entry){strdup(name), fn, FUNCTION};
+  }
+  pthread_mutex_unlock(&registered_lock);
+  env_add_builtin(e, name, fn, FUNCTION);
+}
+
+/* Returns the name `fn` is registered under, or NULL */
+char *
+builtin_name(lbuiltin fn)
+{
+  for (struct builtin_entry *b = builtins; b->name; b++) {
+    if (b->fn == fn) { return b->name; }
+  }
+  char *name = NULL;
+  pthread_mutex_lock(&registered_lock);
+  for (int i = 0; i < nregistered && !name; i++) {
+    if (registered[i].fn == fn) { name = registered[i].name; }
+  }
+  pthread_mutex_unlock(&registered_lock);
+  return name;
+}
+
+/* Returns the builtin registered under `name`, or NULL */
+lbuiltin
+builtin_lookup(char *name)
+{
+  pthread_mutex_lock(&registered_lock);
+  lbuiltin fn = find_builtin(name);
+  pthread_mutex_unlock(&registered_lock);
+  return fn;
 }
 
 /* Given args (formals, body), returns a function or macro */
@@ -82,10 +220,9 @@ lval *builtin_lambda(lenv *e, lval *a) {return builtin_func(e, a, "lambda");}
 
 lval *
 builtin_add(lenv *e, lval *args) {
-  if (is_empty(args)) { return lval_num(0); }
-  long x = get_num(lval_first(args));
-  long y = get_num(builtin_add(e, lval_rest(args)));
-  return lval_num(x + y);
+  long sum = 0;
+  for (list *l = get_cell(args); l; l = list_rest(l)) { sum += get_num(list_first(l)); }
+  return lval_num(sum);
 }
 
 
@@ -100,10 +237,9 @@ builtin_sub(lenv *e, lval *args) {
 
 lval *
 builtin_multiply(lenv *e, lval *args) {
-  if (is_empty(args)) { return lval_num(1); }
-  long x = get_num(lval_first(args));
-  long y = get_num(builtin_multiply(e, lval_rest(args)));
-  return lval_num(x * y);
+  long product = 1;
+  for (list *l = get_cell(args); l; l = list_rest(l)) { product *= get_num(list_first(l)); }
+  return lval_num(product);
 }
 
 
@@ -122,20 +258,15 @@ builtin_greaterthan(lenv *e, lval *args)
   ARGNUM(args, 2, ">"); /* Make sure we have 2 args */
   lval *l = lval_first(args);
   lval *r = lval_first(lval_rest(args));
-  lval *result = lval_bool(get_num(l) > get_num(r));
-  lval_del(args);
-  return result;
+  return lval_bool(get_num(l) > get_num(r));
 }
 
 lval *builtin_lessthan(lenv *e, lval *args)
 {
-  print_lval(args);
   ARGNUM(args, 2, "<");
   lval *l = lval_first(args);
   lval *r = lval_first(lval_rest(args));
-  lval *result = lval_bool(get_num(l) < get_num(r));
-  lval_del(args);
-  return result;
+  return lval_bool(get_num(l) < get_num(r));
 }
 
 lval *builtin_equal(lenv *e, lval *args) {
@@ -195,10 +326,8 @@ builtin_cons(lenv *e, lval *args)
   ARGNUM(args, 2, "cons");
   LASSERT(args, get_type(lval_first(lval_rest(args))) == LVAL_SEXP,
 	  "ERROR: Cons function requires a SEXP as a second argument");
-  lval *x = lval_first(args);
-  lval *l = lval_nth(args, 1);
-  lval_cons(l, x);
-  return l;
+  // A new list sharing the old one's nodes; the old one may be a literal
+  return lval_sexp_of(list_cons(lval_first(args), get_cell(lval_nth(args, 1))));
 }
 
 lval *
@@ -219,15 +348,785 @@ builtin_read(lenv *e, lval *args)
   return l;
 }
 
-/* Read in and evaluate a file */
+/*
+   Read in and evaluate a file ("-" for stdin), one top-level form at a
+   time. Only the form being read is held in the reader's buffer.
+*/
 lval *
 builtin_load(lenv *e, lval *args)
 {
-  ARGNUM(args, 1, "read");
-  lval *first = lval_first(args);
-  char *fname = get_string(first);
-  lval *l = read_file(fname);
-  return lval_eval(e, l);
+  ARGNUM(args, 1, "load");
+  char *fname = get_string(lval_first(args));
+  reader *r = reader_open(fname);
+  if (!r) { return lval_err("ERROR: Could not open file `%s`!", fname); }
+  lval *result = eval_reader(e, r);
+  reader_close(r);
+  return result;
+}
+
+/*
+   Evaluate each form `r` reads in turn, returning the last result. Each
+   form gets a region, inside the caller's if it has one, released once
+   it is done. Only the last result is kept past it.
+*/
+lval *
+eval_reader(lenv *e, reader *r)
+{
+  lval *result = lval_sexp();
+  for (bool done = false; !done;) {
+    bool top = region_begin();
+    lval *form = read_next(r);
+    done = !form || get_type(form) == LVAL_ERR; // Syntax errors stop the load
+    if (form) { result = done ? form : lval_eval(e, form); }
+    if (top) { result = region_end(done || read_done(r) ? result : NULL); }
+  }
+  return result ? result : lval_sexp();
+}
+
+/* Encode a value as a fasl string */
+lval *
+builtin_serialize(lenv *e, lval *args)
+{
+  ARGNUM(args, 1, "serialize");
+  size_t len;
+  char *buf = fasl_encode(lval_first(args), &len);
+  char *str = fasl_to_string(buf, len);
+  lval *result = lval_string(str);
+  free(buf);
+  free(str);
+  return result;
+}
+
+/* Decode a string made by `serialize` */
+lval *
+builtin_deserialize(lenv *e, lval *args)
+{
+  ARGNUM(args, 1, "deserialize");
+  TYPEASSERT(args, get_type(lval_first(args)), LVAL_STRING, "deserialize");
+  size_t len;
+  char *buf = fasl_from_string(get_string(lval_first(args)), &len);
+  lval *result = fasl_decode(e, buf, len);
+  free(buf);
+  return result;
+}
+
+/* Write a value to a file in fasl format */
+lval *
+builtin_serialize_file(lenv *e, lval *args)
+{
+  ARGNUM(args, 2, "serialize-file");
+  TYPEASSERT(args, get_type(lval_nth(args, 1)), LVAL_STRING, "serialize-file");
+  char *fname = get_string(lval_nth(args, 1));
+  size_t len;
+  char *buf = fasl_encode(lval_first(args), &len);
+  FILE *f = fopen(fname, "wb");
+  bool ok = f && fwrite(buf, 1, len, f) == len;
+  if (f && fclose(f) != 0) { ok = false; }
+  free(buf);
+  if (!ok) { return lval_err("ERROR: Could not write file `%s`!", fname); }
+  return lval_bool(true);
+}
+
+/* Read a value from a file written by `serialize-file` */
+lval *
+builtin_deserialize_file(lenv *e, lval *args)
+{
+  ARGNUM(args, 1, "deserialize-file");
+  TYPEASSERT(args, get_type(lval_first(args)), LVAL_STRING, "deserialize-file");
+  char *fname = get_string(lval_first(args));
+  FILE *f = fopen(fname, "rb");
+  if (!f) { return lval_err("ERROR: Could not open file `%s`!", fname); }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *buf = malloc(size > 0 ? size : 1);
+  size_t len = fread(buf, 1, size, f);
+  fclose(f);
+  lval *result = fasl_decode(e, buf, len);
+  free(buf);
+  return result;
+}
+
+/* Returns the printed form of a value as a string */
+lval *
+builtin_to_string(lenv *e, lval *args)
+{
+  ARGNUM(args, 1, "to-string");
+  port *p = port_string();
+  lval_write(p, lval_first(args));
+  lval *result = lval_string(port_contents(p, NULL));
+  port_delete(p);
+  return result;
+}
+
+/* Live, peak and total counts of heap objects, by kind */
+lval *
+builtin_mem_stats(lenv *e, lval *args)
+{
+  ARGNUM(args, 0, "mem-stats");
+  return mem_stats();
+}
+
+#define PROFILE_HZ 1000 // Default samples per second of CPU time
+
+/* Start the sampling profiler, optionally at a given rate */
+lval *
+builtin_profile_start(lenv *e, lval *args)
+{
+  int hz = PROFILE_HZ;
+  if (get_count(args) == 1) {
+    TYPEASSERT(args, get_type(lval_first(args)), LVAL_NUM, "profile-start");
+    hz = get_num(lval_first(args));
+    LASSERT(args, hz > 0 && hz <= 1000000,
+	    "ERROR: Function `profile-start` requires a rate from 1 to 1000000!");
+  } else {
+    ARGNUM(args, 0, "profile-start");
+  }
+  if (profile_start(hz) != 0) { return lval_err("ERROR: A profile is already running"); }
+  return lval_bool(true);
+}
+
+/* Stop the profiler and write collapsed stacks to a file */
+lval *
+builtin_profile_stop(lenv *e, lval *args)
+{
+  ARGNUM(args, 1, "profile-stop");
+  TYPEASSERT(args, get_type(lval_first(args)), LVAL_STRING, "profile-stop");
+  long n = profile_stop(get_string(lval_first(args)));
+  if (n < 0) {
+    return lval_err("ERROR: No profile running, or could not write `%s`",
+		    get_string(lval_first(args)));
+  }
+  return lval_num(n);
+}
+
+/* Macro: evaluate an expression, then print how often and how long each function ran */
+lval *
+builtin_with_profiling(lenv *e, lval *args)
+{
+  ARGNUM(args, 1, "with-profiling");
+  if (trace_start() != 0) { return lval_err("ERROR: `with-profiling` is already running"); }
+  lval *result = lval_eval(e, lval_first(args));
+  trace_stop(port_stdout());
+  port_flush(port_stdout());
+  return result;
+}
+
+/*
+   (load-native "lib.so") opens a library so it can register builtins.
+   (load-native "lib.so" "name" "signature") returns a function calling `name`
+*/
+lval *
+builtin_load_native(lenv *e, lval *args)
+{
+  LASSERT(args, get_count(args) == 1 || get_count(args) == 3,
+	  "ERROR: Function `load-native` requires 1 or 3 argument(s) (passed %d)!",
+	  get_count(args));
+  for (lval *a = args; !is_empty(a); a = lval_rest(a)) {
+    TYPEASSERT(args, get_type(lval_first(a)), LVAL_STRING, "load-native");
+  }
+  char *path = get_string(lval_first(args));
+  if (get_count(args) == 1) { return native_open(e, path); }
+  return native_function(e, path, get_string(lval_nth(args, 1)), get_string(lval_nth(args, 2)));
+}
+
+/* (native-call "lib.so" "name" "signature" args...) */
+lval *
+builtin_native_call(lenv *e, lval *args)
+{
+  LASSERT(args, get_count(args) >= 3,
+	  "ERROR: Function `native-call` requires at least 3 argument(s) (passed %d)!",
+	  get_count(args));
+  for (int i = 0; i < 3; i++) {
+    TYPEASSERT(args, get_type(lval_nth(args, i)), LVAL_STRING, "native-call");
+  }
+  lval *rest = lval_rest(lval_rest(lval_rest(args)));
+  return native_call(lval_first(args), lval_nth(args, 1), lval_nth(args, 2), rest);
+}
+
+/* (memo f [size]) returns `f`, remembering its last `size` distinct results */
+lval *
+builtin_memo(lenv *e, lval *args)
+{
+  LASSERT(args, get_count(args) == 1 || get_count(args) == 2,
+	  "ERROR: Function `memo` requires 1 or 2 argument(s) (passed %d)!",
+	  get_count(args));
+  long size = MEMO_SIZE;
+  if (get_count(args) == 2) {
+    TYPEASSERT(args, get_type(lval_nth(args, 1)), LVAL_NUM, "memo");
+    size = get_num(lval_nth(args, 1));
+  }
+  return memo_wrap(e, lval_first(args), size);
+}
+
+/* (memo-call size f args...), the body of a memoized function */
+lval *
+builtin_memo_call(lenv *e, lval *args)
+{
+  LASSERT(args, get_count(args) >= 2,
+	  "ERROR: Function `memo-call` requires at least 2 argument(s) (passed %d)!",
+	  get_count(args));
+  TYPEASSERT(args, get_type(lval_first(args)), LVAL_NUM, "memo-call");
+  TYPEASSERT(args, get_type(lval_nth(args, 1)), LVAL_FN, "memo-call");
+  return memo_call(e, lval_nth(args, 1), get_num(lval_first(args)), lval_rest(lval_rest(args)));
+}
+
+lval *
+builtin_memo_stats(lenv *e, lval *args)
+{
+  ARGNUM(args, 1, "memo-stats");
+  return memo_stats(lval_first(args));
+}
+
+/* (defstruct name field...) defines make-name, name? and name-field */
+lval *
+builtin_defstruct(lenv *e, lval *args)
+{
+  LASSERT(args, get_count(args) >= 1,
+	  "ERROR: Function `defstruct` requires at least 1 argument(s) (passed %d)!",
+	  get_count(args));
+  LASSERT(args, get_type(lval_first(args)) == LVAL_SYM,
+	  "ERROR: Function `%s` not passed a SYMBOL as argument 1!", "defstruct");
+  return record_define(e, lval_first(args), lval_rest(args));
+}
+
+bool
+is_struct(lval *v)
+{
+  return get_type(v) == LVAL_RECORD && !get_struct(v);
+}
+
+/* (record-new type fields...), the body of a struct's constructor */
+lval *
+builtin_record_new(lenv *e, lval *args)
+{
+  LASSERT(args, get_count(args) >= 1 && is_struct(lval_first(args)),
+	  "ERROR: Function `%s` requires a struct type", "record-new");
+  return record_new(lval_first(args), lval_rest(args));
+}
+
+/* (record-is type v), the body of a struct's predicate */
+lval *
+builtin_record_is(lenv *e, lval *args)
+{
+  ARGNUM(args, 2, "record-is");
+  LASSERT(args, is_struct(lval_first(args)),
+	  "ERROR: Function `%s` requires a struct type", "record-is");
+  return record_is(lval_first(args), lval_nth(args, 1));
+}
+
+/* (record-get type i r), the body of a field accessor */
+lval *
+builtin_record_get(lenv *e, lval *args)
+{
+  ARGNUM(args, 3, "record-get");
+  list *l = get_cell(args); // Called for every field read, so no lval_nth
+  lval *type = list_first(l), *i = list_first(list_rest(l));
+  LASSERT(args, is_struct(type),
+	  "ERROR: Function `%s` requires a struct type", "record-get");
+  TYPEASSERT(args, get_type(i), LVAL_NUM, "record-get");
+  LASSERT(args, get_num(i) >= 0 && get_num(i) < get_num(type),
+	  "ERROR: Struct `%s` has no field %ld", get_name(type), get_num(i));
+  return record_get(type, get_num(i), list_first(list_rest(list_rest(l))));
+}
+
+/* (defcell name formula) is def, recomputed when cells `formula` reads change */
+lval *
+builtin_defcell(lenv *e, lval *args)
+{
+  ARGNUM(args, 2, "defcell");
+  LASSERT(args, get_type(lval_first(args)) == LVAL_SYM,
+	  "ERROR: Function `%s` not passed a SYMBOL as argument 1!", "defcell");
+  return cell_define(e, lval_first(args), lval_nth(args, 1));
+}
+
+/* (set-cell! name value) */
+lval *
+builtin_set_cell(lenv *e, lval *args)
+{
+  ARGNUM(args, 2, "set-cell!");
+  LASSERT(args, get_type(lval_first(args)) == LVAL_SYM,
+	  "ERROR: Function `%s` not passed a SYMBOL as argument 1!", "set-cell!");
+  lval *value = lval_eval(e, lval_nth(args, 1));
+  if (get_type(value) == LVAL_ERR) { return value; }
+  return cell_set(e, lval_first(args), value);
+}
+
+/* (cell-batch body...) updates cells once, after all of `body` */
+lval *
+builtin_cell_batch(lenv *e, lval *args)
+{
+  return cell_batch(e, args);
+}
+
+lval *
+builtin_cell_stats(lenv *e, lval *args)
+{
+  ARGNUM(args, 0, "cell-stats");
+  return cell_stats();
+}
+
+/* Parse a string of JSON */
+lval *
+builtin_read_json(lenv *e, lval *args)
+{
+  ARGNUM(args, 1, "read-json");
+  TYPEASSERT(args, get_type(lval_first(args)), LVAL_STRING, "read-json");
+  char *str = get_string(lval_first(args));
+  return json_read(str, strlen(str));
+}
+
+lval *
+builtin_read_json_file(lenv *e, lval *args)
+{
+  ARGNUM(args, 1, "read-json-file");
+  TYPEASSERT(args, get_type(lval_first(args)), LVAL_STRING, "read-json-file");
+  return json_read_file(get_string(lval_first(args)));
+}
+
+/* Encode a value as a string of JSON */
+lval *
+builtin_write_json(lenv *e, lval *args)
+{
+  ARGNUM(args, 1, "write-json");
+  return json_write(lval_first(args));
+}
+
+lval *
+builtin_write_json_file(lenv *e, lval *args)
+{
+  ARGNUM(args, 2, "write-json-file");
+  TYPEASSERT(args, get_type(lval_nth(args, 1)), LVAL_STRING, "write-json-file");
+  return json_write_file(lval_first(args), get_string(lval_nth(args, 1)));
+}
+
+// SORTED MAPS
+
+/* `x`, promoted out of the open region unless `holder`, changed in place, is in it */
+lval *
+kept_by(lval *holder, lval *x)
+{
+  return region_contains(holder) ? x : region_promote(x);
+}
+
+lval * // The list (key value)
+sorted_pair(lval *key, lval *val)
+{
+  return lval_cons(lval_cons(lval_sexp(), val), key);
+}
+
+/* Make a sorted map from alternating keys and values */
+lval *
+builtin_sorted_map(lenv *e, lval *args)
+{
+  LASSERT(args, get_count(args) % 2 == 0,
+	  "ERROR: Function `sorted-map` requires keys and values in pairs!");
+  lval *m = lval_sorted();
+  for (list *l = get_cell(args); l; l = list_rest(list_rest(l))) {
+    btree_put(get_tree(m), list_first(l), list_first(list_rest(l)));
+  }
+  return m;
+}
+
+/* Add a key and value to a sorted map, returning the map */
+lval *
+builtin_sorted_put(lenv *e, lval *args)
+{
+  ARGNUM(args, 3, "sorted-put");
+  lval *m = lval_first(args);
+  TYPEASSERT(args, get_type(m), LVAL_SORTED, "sorted-put");
+  btree_put(get_tree(m), kept_by(m, lval_nth(args, 1)), kept_by(m, lval_nth(args, 2)));
+  return m;
+}
+
+lval *
+builtin_sorted_get(lenv *e, lval *args)
+{
+  ARGNUM(args, 2, "sorted-get");
+  lval *m = lval_first(args);
+  TYPEASSERT(args, get_type(m), LVAL_SORTED, "sorted-get");
+  lval *v = btree_get(get_tree(m), lval_nth(args, 1));
+  return v ? v : lval_err("ERROR: Key not found in sorted map");
+}
+
+/* The keys of a sorted map, in order */
+lval *
+builtin_sorted_keys(lenv *e, lval *args)
+{
+  ARGNUM(args, 1, "sorted-keys");
+  lval *m = lval_first(args);
+  TYPEASSERT(args, get_type(m), LVAL_SORTED, "sorted-keys");
+  bcursor c = btree_first(get_tree(m));
+  lval *key, *val;
+  list *keys = NULL;
+  while (btree_next(&c, &key, &val)) { keys = list_cons(key, keys); }
+  return lval_sexp_of(list_reverse(keys));
+}
+
+/* The (key value) pairs of a sorted map, in order */
+lval *
+builtin_sorted_entries(lenv *e, lval *args)
+{
+  ARGNUM(args, 1, "sorted-entries");
+  lval *m = lval_first(args);
+  TYPEASSERT(args, get_type(m), LVAL_SORTED, "sorted-entries");
+  bcursor c = btree_first(get_tree(m));
+  lval *key, *val;
+  list *pairs = NULL;
+  while (btree_next(&c, &key, &val)) { pairs = list_cons(sorted_pair(key, val), pairs); }
+  return lval_sexp_of(list_reverse(pairs));
+}
+
+/* The (key value) pairs with lo <= key <= hi, in order */
+lval *
+builtin_range(lenv *e, lval *args)
+{
+  ARGNUM(args, 3, "range");
+  lval *m = lval_first(args);
+  TYPEASSERT(args, get_type(m), LVAL_SORTED, "range");
+  lval *hi = lval_nth(args, 2);
+  bcursor c = btree_seek(get_tree(m), lval_nth(args, 1));
+  lval *key, *val;
+  list *pairs = NULL;
+  while (btree_next(&c, &key, &val) && lval_compare(key, hi) <= 0) {
+    pairs = list_cons(sorted_pair(key, val), pairs);
+  }
+  return lval_sexp_of(list_reverse(pairs));
+}
+
+/* The pair with the greatest key <= the one given, or () */
+lval *
+builtin_floor(lenv *e, lval *args)
+{
+  ARGNUM(args, 2, "floor");
+  lval *m = lval_first(args);
+  TYPEASSERT(args, get_type(m), LVAL_SORTED, "floor");
+  lval *key, *val;
+  if (!btree_floor(get_tree(m), lval_nth(args, 1), &key, &val)) { return lval_sexp(); }
+  return sorted_pair(key, val);
+}
+
+/* The pair with the least key >= the one given, or () */
+lval *
+builtin_ceiling(lenv *e, lval *args)
+{
+  ARGNUM(args, 2, "ceiling");
+  lval *m = lval_first(args);
+  TYPEASSERT(args, get_type(m), LVAL_SORTED, "ceiling");
+  lval *key, *val;
+  if (!btree_ceiling(get_tree(m), lval_nth(args, 1), &key, &val)) { return lval_sexp(); }
+  return sorted_pair(key, val);
+}
+
+// HIGHER-ORDER LISTS
+
+/*
+   These walk their lists in place, build their results front to back
+   and call the function through lval_call_n, which binds a lambda's
+   arguments without building a list of them. Unlike ARGNUM and
+   TYPEASSERT, their checks leave the arguments alone: deleting a
+   lambda would delete the environment it closes over.
+*/
+
+#define ARGCOUNT(args, n, funcname)					\
+  if (get_count(args) != (n)) {						\
+    return lval_err("ERROR: Function `%s` requires %d argument(s) (passed %d)!", \
+		    funcname, n, get_count(args));			\
+  }
+
+/* Argument `n` must be of type `type` */
+#define ARGTYPE(args, n, type, funcname)				\
+  if (get_type(lval_nth(args, n)) != (type)) {				\
+    return lval_err("ERROR: Function `%s` requires argument(s) of type %s (passed %s)!", \
+		    funcname, ltype_name(type), ltype_name(get_type(lval_nth(args, n)))); \
+  }
+
+/* (map f l) is the list of `f` applied to each element of `l` */
+lval *
+builtin_map(lenv *e, lval *args)
+{
+  ARGCOUNT(args, 2, "map");
+  ARGTYPE(args, 0, LVAL_FN, "map");
+  ARGTYPE(args, 1, LVAL_SEXP, "map");
+  lval *fn = lval_first(args);
+  list *out = NULL, **tail = &out;
+  for (list *l = get_cell(lval_nth(args, 1)); l; l = list_rest(l)) {
+    lval *x = list_first(l);
+    lval *v = lval_call_n(e, fn, 1, &x);
+    if (get_type(v) == LVAL_ERR) {
+      list_free(out);
+      return v;
+    }
+    tail = list_snoc(tail, v);
+  }
+  return lval_sexp_of(out);
+}
+
+/* (filter f l) is the elements of `l` for which `f` is true */
+lval *
+builtin_filter(lenv *e, lval *args)
+{
+  ARGCOUNT(args, 2, "filter");
+  ARGTYPE(args, 0, LVAL_FN, "filter");
+  ARGTYPE(args, 1, LVAL_SEXP, "filter");
+  lval *fn = lval_first(args);
+  list *out = NULL, **tail = &out;
+  for (list *l = get_cell(lval_nth(args, 1)); l; l = list_rest(l)) {
+    lval *x = list_first(l);
+    lval *keep = lval_call_n(e, fn, 1, &x);
+    if (get_type(keep) != LVAL_BOOL) {
+      list_free(out);
+      return get_type(keep) == LVAL_ERR ? keep
+	: lval_err("ERROR: Function `filter` requires a function returning a BOOL, recieved `%s`.",
+		   ltype_name(get_type(keep)));
+    }
+    if (get_bool(keep)) { tail = list_snoc(tail, x); }
+  }
+  return lval_sexp_of(out);
+}
+
+/* (foldl f init l) is (f (... (f (f init x0) x1) ...) xn) */
+lval *
+builtin_foldl(lenv *e, lval *args)
+{
+  ARGCOUNT(args, 3, "foldl");
+  ARGTYPE(args, 0, LVAL_FN, "foldl");
+  ARGTYPE(args, 2, LVAL_SEXP, "foldl");
+  lval *fn = lval_first(args), *acc = lval_nth(args, 1);
+  for (list *l = get_cell(lval_nth(args, 2)); l; l = list_rest(l)) {
+    lval *argv[2] = {acc, list_first(l)};
+    acc = lval_call_n(e, fn, 2, argv);
+    if (get_type(acc) == LVAL_ERR) { break; }
+  }
+  return acc;
+}
+
+/* (foldr f init l) is (f x0 (f x1 (... (f xn init)))) */
+lval *
+builtin_foldr(lenv *e, lval *args)
+{
+  ARGCOUNT(args, 3, "foldr");
+  ARGTYPE(args, 0, LVAL_FN, "foldr");
+  ARGTYPE(args, 2, LVAL_SEXP, "foldr");
+  lval *fn = lval_first(args), *acc = lval_nth(args, 1);
+  list *rev = NULL;
+  for (list *l = get_cell(lval_nth(args, 2)); l; l = list_rest(l)) { rev = list_cons(list_first(l), rev); }
+  for (list *l = rev; l; l = list_rest(l)) {
+    lval *argv[2] = {list_first(l), acc};
+    acc = lval_call_n(e, fn, 2, argv);
+    if (get_type(acc) == LVAL_ERR) { break; }
+  }
+  list_free(rev);
+  return acc;
+}
+
+lval *
+builtin_length(lenv *e, lval *args)
+{
+  ARGCOUNT(args, 1, "length");
+  ARGTYPE(args, 0, LVAL_SEXP, "length");
+  return lval_num(get_count(lval_first(args)));
+}
+
+lval *
+builtin_reverse(lenv *e, lval *args)
+{
+  ARGCOUNT(args, 1, "reverse");
+  ARGTYPE(args, 0, LVAL_SEXP, "reverse");
+  list *out = NULL;
+  for (list *l = get_cell(lval_first(args)); l; l = list_rest(l)) { out = list_cons(list_first(l), out); }
+  return lval_sexp_of(out);
+}
+
+/* (append l0 l1 ... ln) copies the nodes of all but `ln`, which it shares */
+lval *
+builtin_append(lenv *e, lval *args)
+{
+  list *out = NULL, **tail = &out;
+  for (list *a = get_cell(args); a; a = list_rest(a)) {
+    if (get_type(list_first(a)) != LVAL_SEXP) {
+      list_free(out);
+      return lval_err("ERROR: Function `append` requires argument(s) of type %s (passed %s)!",
+		      ltype_name(LVAL_SEXP), ltype_name(get_type(list_first(a))));
+    }
+    if (!list_rest(a)) {
+      *tail = get_cell(list_first(a));
+      break;
+    }
+    for (list *l = get_cell(list_first(a)); l; l = list_rest(l)) { tail = list_snoc(tail, list_first(l)); }
+  }
+  return lval_sexp_of(out);
+}
+
+// VECTORS
+
+/*
+   Argument checks for vectors. Unlike LASSERT these don't delete the
+   arguments, since a vector passed in is usually bound somewhere too,
+   so the vector builtins use ARGCOUNT and ARGTYPE for the rest.
+*/
+
+/* Argument `n` must be a vector, transient or not as `transient` says */
+#define VECASSERT(args, n, transient, funcname)				\
+  if (get_type(lval_nth(args, n)) != LVAL_VECTOR) {			\
+    return lval_err("ERROR: Function `%s` requires argument(s) of type %s (passed %s)!", \
+		    funcname, ltype_name(LVAL_VECTOR),			\
+		    ltype_name(get_type(lval_nth(args, n))));		\
+  }									\
+  if (vec_is_transient(get_vec(lval_nth(args, n))) != transient) {	\
+    return lval_err("ERROR: Function `%s` requires a %s vector", funcname, \
+		    transient ? "transient" : "persistent");		\
+  }
+
+/* Argument `n` must index into `v`, or be just past its end if `end` */
+#define INDEXASSERT(args, n, v, end, funcname)				\
+  if (get_type(lval_nth(args, n)) != LVAL_NUM				\
+      || get_num(lval_nth(args, n)) < 0					\
+      || get_num(lval_nth(args, n)) >= (long)vec_count(v) + (end)) {	\
+    return lval_err("ERROR: Function `%s` requires an index below %zu", \
+		    funcname, vec_count(v) + (end));			\
+  }
+
+/* A vector of the arguments */
+lval *
+builtin_vec(lenv *e, lval *args)
+{
+  vec *t = vec_transient(vec_new());
+  for (list *l = get_cell(args); l; l = list_rest(l)) { vec_conj(t, list_first(l)); }
+  return lval_vector(vec_persistent(t));
+}
+
+lval *
+builtin_vec_count(lenv *e, lval *args)
+{
+  ARGCOUNT(args, 1, "vec-count");
+  ARGTYPE(args, 0, LVAL_VECTOR, "vec-count");
+  return lval_num(vec_count(get_vec(lval_first(args))));
+}
+
+lval *
+builtin_vec_nth(lenv *e, lval *args)
+{
+  ARGCOUNT(args, 2, "vec-nth");
+  ARGTYPE(args, 0, LVAL_VECTOR, "vec-nth");
+  vec *v = get_vec(lval_first(args));
+  INDEXASSERT(args, 1, v, 0, "vec-nth");
+  return vec_nth(v, get_num(lval_nth(args, 1)));
+}
+
+/* (vec-assoc v i x) is `v` with item `i` set to `x`; `v` is unchanged */
+lval *
+builtin_vec_assoc(lenv *e, lval *args)
+{
+  ARGCOUNT(args, 3, "vec-assoc");
+  VECASSERT(args, 0, false, "vec-assoc");
+  vec *v = get_vec(lval_first(args));
+  INDEXASSERT(args, 1, v, 1, "vec-assoc");
+  return lval_vector(vec_assoc(v, get_num(lval_nth(args, 1)), lval_nth(args, 2)));
+}
+
+/* (vec-conj v x...) is `v` with the items `x` added at the end */
+lval *
+builtin_vec_conj(lenv *e, lval *args)
+{
+  if (get_count(args) < 1) {
+    return lval_err("ERROR: Function `vec-conj` requires at least 1 argument(s) (passed %d)!",
+		    get_count(args));
+  }
+  VECASSERT(args, 0, false, "vec-conj");
+  vec *v = get_vec(lval_first(args));
+  for (list *l = list_rest(get_cell(args)); l; l = list_rest(l)) { v = vec_conj(v, list_first(l)); }
+  return lval_vector(v);
+}
+
+lval *
+builtin_vec_concat(lenv *e, lval *args)
+{
+  vec *v = vec_new();
+  for (int i = 0; i < get_count(args); i++) {
+    VECASSERT(args, i, false, "vec-concat");
+    v = vec_concat(v, get_vec(lval_nth(args, i)));
+  }
+  return lval_vector(v);
+}
+
+/* (vec-slice v start [end]) shares its nodes with `v` */
+lval *
+builtin_vec_slice(lenv *e, lval *args)
+{
+  if (get_count(args) != 2 && get_count(args) != 3) {
+    return lval_err("ERROR: Function `vec-slice` requires 2 or 3 argument(s) (passed %d)!",
+		    get_count(args));
+  }
+  VECASSERT(args, 0, false, "vec-slice");
+  vec *v = get_vec(lval_first(args));
+  size_t end = vec_count(v);
+  if (get_count(args) == 3) {
+    INDEXASSERT(args, 2, v, 1, "vec-slice");
+    end = get_num(lval_nth(args, 2));
+  }
+  INDEXASSERT(args, 1, v, 1, "vec-slice");
+  size_t start = get_num(lval_nth(args, 1));
+  if (start > end) { return lval_err("ERROR: Slice starts at %zu, after its end at %zu", start, end); }
+  return lval_vector(vec_slice(v, start, end));
+}
+
+/* The items of a vector as a list */
+lval *
+builtin_vec_list(lenv *e, lval *args)
+{
+  ARGCOUNT(args, 1, "vec-list");
+  ARGTYPE(args, 0, LVAL_VECTOR, "vec-list");
+  vec *v = get_vec(lval_first(args));
+  lval *l = lval_sexp();
+  for (size_t i = vec_count(v); i > 0; i--) { lval_cons(l, vec_nth(v, i - 1)); }
+  return l;
+}
+
+/* A transient copy of a vector, for vec-conj! and vec-assoc! */
+lval *
+builtin_vec_transient(lenv *e, lval *args)
+{
+  ARGCOUNT(args, 1, "vec-transient");
+  VECASSERT(args, 0, false, "vec-transient");
+  return lval_vector(vec_transient(get_vec(lval_first(args))));
+}
+
+/* (vec-conj! t x...) adds to the transient `t` in place, and returns it */
+lval *
+builtin_vec_conj_in_place(lenv *e, lval *args)
+{
+  if (get_count(args) < 1) {
+    return lval_err("ERROR: Function `vec-conj!` requires at least 1 argument(s) (passed %d)!",
+		    get_count(args));
+  }
+  VECASSERT(args, 0, true, "vec-conj!");
+  vec *t = get_vec(lval_first(args));
+  for (list *l = list_rest(get_cell(args)); l; l = list_rest(l)) {
+    vec_conj(t, kept_by(lval_first(args), list_first(l)));
+  }
+  return lval_first(args);
+}
+
+lval *
+builtin_vec_assoc_in_place(lenv *e, lval *args)
+{
+  ARGCOUNT(args, 3, "vec-assoc!");
+  VECASSERT(args, 0, true, "vec-assoc!");
+  vec *t = get_vec(lval_first(args));
+  INDEXASSERT(args, 1, t, 1, "vec-assoc!");
+  vec_assoc(t, get_num(lval_nth(args, 1)), kept_by(lval_first(args), lval_nth(args, 2)));
+  return lval_first(args);
+}
+
+/* Freeze a transient, which can't be changed again */
+lval *
+builtin_vec_persistent(lenv *e, lval *args)
+{
+  ARGCOUNT(args, 1, "vec-persistent!");
+  VECASSERT(args, 0, true, "vec-persistent!");
+  vec_persistent(get_vec(lval_first(args)));
+  return lval_first(args);
 }
 
 /* Macro: if cond body else-body */
@@ -237,6 +1136,7 @@ builtin_if(lenv *e, lval *args)
   ARGNUM(args, 3, "if");
 
   lval *cond = lval_eval(e, lval_first(args));
+  if (get_type(cond) == LVAL_ERR) { return cond; }
   if (get_type(cond) != LVAL_BOOL) {
     return lval_err("ERROR: First argument to `if` must be a BOOL, recieved `%s`.",
 		    ltype_name(get_type(cond)));
@@ -265,6 +1165,10 @@ builtin_def(lenv *e, lval *a)
   lval *value = lval_eval(e, lval_nth(a, 1));
   if (get_type(value) == LVAL_ERR) { return value; }
 
+  if ((get_type(value) == LVAL_FN || get_type(value) == LVAL_MACRO)
+      && !get_builtin(value) && !get_name(value)) {
+    lval_set_name(value, get_sym(name));
+  }
   //list *parent = list_first(list_rest(e));
   lenv_set(e, name, value);
   return lval_bool(true);
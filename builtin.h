@@ -6,9 +6,39 @@
 lval *builtin_eval(lenv *e, lval *args);
 lval *builtin_read(lenv *e, lval *args);
 lval *builtin_load(lenv *e, lval *args);
+lval *eval_reader(lenv *e, reader *r);
+lval *builtin_serialize(lenv *e, lval *args);
+lval *builtin_deserialize(lenv *e, lval *args);
+lval *builtin_serialize_file(lenv *e, lval *args);
+lval *builtin_deserialize_file(lenv *e, lval *args);
+lval *builtin_read_json(lenv *e, lval *args);
+lval *builtin_read_json_file(lenv *e, lval *args);
+lval *builtin_write_json(lenv *e, lval *args);
+lval *builtin_write_json_file(lenv *e, lval *args);
+lval *builtin_to_string(lenv *e, lval *args);
+lval *builtin_mem_stats(lenv *e, lval *args);
+lval *builtin_profile_start(lenv *e, lval *args);
+lval *builtin_profile_stop(lenv *e, lval *args);
+lval *builtin_with_profiling(lenv *e, lval *args);
+lval *builtin_load_native(lenv *e, lval *args);
+lval *builtin_native_call(lenv *e, lval *args);
+lval *builtin_memo(lenv *e, lval *args);
+lval *builtin_memo_call(lenv *e, lval *args);
+lval *builtin_memo_stats(lenv *e, lval *args);
+lval *builtin_defstruct(lenv *e, lval *args);
+lval *builtin_record_new(lenv *e, lval *args);
+lval *builtin_record_is(lenv *e, lval *args);
+lval *builtin_record_get(lenv *e, lval *args);
+lval *builtin_defcell(lenv *e, lval *args);
+lval *builtin_set_cell(lenv *e, lval *args);
+lval *builtin_cell_batch(lenv *e, lval *args);
+lval *builtin_cell_stats(lenv *e, lval *args);
 
 lval *builtin_def(lenv *e, lval *args);
 void env_add_builtins(lenv *e);
+char *builtin_name(lbuiltin fn);
+lbuiltin builtin_lookup(char *name);
+void builtin_register(lenv *e, char *name, lbuiltin fn);
 
 lval *builtin_equal(lenv *e, lval *args);
 lval *builtin_progn(lenv *e, lval *args);
@@ -17,6 +47,35 @@ lval *builtin_list(lenv *e, lval *args);
 lval *builtin_head(lenv *e, lval *args);
 lval *builtin_tail(lenv *e, lval *args);
 lval *builtin_cons(lenv *e, lval *args);
+lval *builtin_map(lenv *e, lval *args);
+lval *builtin_filter(lenv *e, lval *args);
+lval *builtin_foldl(lenv *e, lval *args);
+lval *builtin_foldr(lenv *e, lval *args);
+lval *builtin_length(lenv *e, lval *args);
+lval *builtin_reverse(lenv *e, lval *args);
+lval *builtin_append(lenv *e, lval *args);
+
+lval *builtin_sorted_map(lenv *e, lval *args);
+lval *builtin_sorted_put(lenv *e, lval *args);
+lval *builtin_sorted_get(lenv *e, lval *args);
+lval *builtin_sorted_keys(lenv *e, lval *args);
+lval *builtin_sorted_entries(lenv *e, lval *args);
+lval *builtin_range(lenv *e, lval *args);
+lval *builtin_floor(lenv *e, lval *args);
+lval *builtin_ceiling(lenv *e, lval *args);
+
+lval *builtin_vec(lenv *e, lval *args);
+lval *builtin_vec_count(lenv *e, lval *args);
+lval *builtin_vec_nth(lenv *e, lval *args);
+lval *builtin_vec_assoc(lenv *e, lval *args);
+lval *builtin_vec_conj(lenv *e, lval *args);
+lval *builtin_vec_concat(lenv *e, lval *args);
+lval *builtin_vec_slice(lenv *e, lval *args);
+lval *builtin_vec_list(lenv *e, lval *args);
+lval *builtin_vec_transient(lenv *e, lval *args);
+lval *builtin_vec_conj_in_place(lenv *e, lval *args);
+lval *builtin_vec_assoc_in_place(lenv *e, lval *args);
+lval *builtin_vec_persistent(lenv *e, lval *args);
 
 lval *builtin_lambda(lenv *e, lval *args);
 lval *builtin_macro(lenv *e, lval *args);
@@ -0,0 +1,398 @@
+/*
+  Reactive cells
+
+  (defcell total (+ price tax)) binds `total` like def, and remembers
+  the formula it came from. While a formula is evaluated, lenv_get
+  reports each variable it finds, and reading another cell records an
+  edge from that cell to this one. After (set-cell! price 12), only the
+  cells downstream of `price` are recomputed.
+
+  Every cell sits higher than the cells it reads. Changed cells are
+  recomputed from a heap, lowest first, so a cell runs once all its
+  inputs are up to date and never sees some of them changed and others
+  not, however many paths lead to it. A cell whose new value is
+  lval_equal to its old one stops the change there. Edges are found
+  afresh on each recomputation, so a formula may read different cells
+  each time.
+
+  (cell-batch body...) holds propagation until `body` is done, so a
+  cell that reads several changed inputs is recomputed once.
+
+  Cells are kept per thread, by the frame they are bound in. Images and
+  fasl keep only their values. What cells hold outlives the region of
+  the form that set it, so it is promoted when the region ends.
+*/
+
+#include "cell.h"
+#include "lval.h"
+#include "list.h"
+#include "map.h"
+#include "environment.h"
+#include "region.h"
+
+#include <stdlib.h>
+
+typedef struct cell cell;
+typedef struct frame_cells frame_cells;
+
+struct cell {
+  lval *name;
+  lenv *env; // Bound in the first frame; the formula is evaluated here
+  lval *formula; // NULL once set-cell! has given it a value
+  lval *value;
+  cell **deps; // Cells the formula read
+  int ndeps, depcap;
+  cell **users; // Cells whose formulas read this one
+  int nusers, usercap;
+  int height;
+  bool queued;
+  bool dirty; // Set while the region is open, so what it holds may be in it
+};
+
+struct frame_cells { // The cells bound in one frame
+  lval *frame;
+  map *index; // Name to position in `cells`
+  cell **cells;
+  int count, cap;
+  frame_cells *next;
+};
+
+typedef struct {
+  int height; // The cell's height when it was queued
+  cell *c;
+} pending;
+
+__thread bool cell_tracking = false;
+__thread frame_cells *cell_frames = NULL;
+__thread cell *computing = NULL;
+__thread bool cycle = false; // The formula being evaluated reads its own cell
+__thread pending *heap = NULL;
+__thread int nheap = 0, heapcap = 0;
+__thread int batching = 0;
+__thread bool propagating = false;
+__thread long ncells = 0, recomputed = 0, last = 0;
+__thread cell **dirty = NULL; // Cells to promote when the region ends
+__thread int ndirty = 0, dirtycap = 0;
+
+void
+append(cell ***a, int *n, int *cap, cell *c)
+{
+  if (*n == *cap) {
+    *cap = *cap ? 2 * *cap : 4;
+    *a = realloc(*a, *cap * sizeof(cell *));
+  }
+  (*a)[(*n)++] = c;
+}
+
+void
+remove_from(cell **a, int *n, cell *c)
+{
+  for (int i = 0; i < *n; i++) {
+    if (a[i] == c) {
+      a[i] = a[--*n];
+      return;
+    }
+  }
+}
+
+frame_cells *
+frame_find(lval *frame)
+{
+  for (frame_cells *f = cell_frames; f; f = f->next) {
+    if (f->frame == frame) { return f; }
+  }
+  return NULL;
+}
+
+/* The cell bound to `name` in `frame`, or NULL */
+cell *
+cell_in(lval *frame, lval *name)
+{
+  frame_cells *f = frame_find(frame);
+  lval *i = f ? map_get(f->index, name) : NULL;
+  return i ? f->cells[get_num(i)] : NULL;
+}
+
+/* The cell `name` refers to in `e`, or NULL if it is something else */
+cell *
+cell_find(lenv *e, lval *name)
+{
+  for (; e; e = list_rest(e)) {
+    if (map_get(get_dict(list_first(e)), name)) { return cell_in(list_first(e), name); }
+  }
+  return NULL;
+}
+
+void
+touch(cell *c)
+{
+  if (!region_open || c->dirty) { return; }
+  c->dirty = true;
+  append(&dirty, &ndirty, &dirtycap, c);
+}
+
+cell *
+cell_new(lenv *e, lval *name)
+{
+  region_pause(); // The index is kept on the heap
+  name = region_promote(name);
+  frame_cells *f = frame_find(list_first(e));
+  if (!f) {
+    f = calloc(1, sizeof(frame_cells));
+    f->frame = list_first(e);
+    f->index = map_new();
+    f->next = cell_frames;
+    cell_frames = f;
+  }
+  cell *c = calloc(1, sizeof(cell));
+  c->name = name;
+  c->env = e;
+  append(&f->cells, &f->count, &f->cap, c);
+  map_add(f->index, name, lval_num(f->count - 1));
+  region_resume();
+  ncells++;
+  touch(c);
+  return c;
+}
+
+void
+heap_push(cell *c)
+{
+  if (nheap == heapcap) {
+    heapcap = heapcap ? 2 * heapcap : 64;
+    heap = realloc(heap, heapcap * sizeof(pending));
+  }
+  int i = nheap++;
+  while (i > 0 && heap[(i - 1) / 2].height > c->height) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = (pending){c->height, c};
+}
+
+pending
+heap_pop(void)
+{
+  pending top = heap[0], end = heap[--nheap];
+  int i = 0;
+  for (int child; (child = 2 * i + 1) < nheap; i = child) {
+    if (child + 1 < nheap && heap[child + 1].height < heap[child].height) { child++; }
+    if (heap[child].height >= end.height) { break; }
+    heap[i] = heap[child];
+  }
+  heap[i] = end;
+  return top;
+}
+
+void
+enqueue_users(cell *c)
+{
+  for (int i = 0; i < c->nusers; i++) {
+    cell *u = c->users[i];
+    if (!u->queued) {
+      u->queued = true;
+      heap_push(u);
+    }
+  }
+}
+
+/* Lift `c` above height `h`, and its users above it. False if that reaches `from` */
+bool
+raise_height(cell *c, int h, cell *from)
+{
+  if (c == from) { return false; }
+  if (c->height > h) { return true; }
+  c->height = h + 1;
+  for (int i = 0; i < c->nusers; i++) {
+    if (!raise_height(c->users[i], c->height, from)) { return false; }
+  }
+  return true;
+}
+
+/* Called by lenv_get for each variable it finds while a formula runs */
+void
+cell_read(lval *frame, lval *name)
+{
+  cell *c = computing, *d = cell_in(frame, name);
+  if (!d || !c) { return; }
+  for (int i = 0; i < c->ndeps; i++) {
+    if (c->deps[i] == d) { return; }
+  }
+  if (!raise_height(c, d->height, d)) { // `d` already depends on `c`
+    cycle = true;
+    return;
+  }
+  append(&c->deps, &c->ndeps, &c->depcap, d);
+  append(&d->users, &d->nusers, &d->usercap, c);
+}
+
+void
+drop_deps(cell *c)
+{
+  for (int i = 0; i < c->ndeps; i++) { remove_from(c->deps[i]->users, &c->deps[i]->nusers, c); }
+  c->ndeps = 0;
+}
+
+/* Give `c` the value `v`, returning whether it changed */
+bool
+update(cell *c, lval *v)
+{
+  bool changed = !c->value || !lval_equal(v, c->value);
+  c->value = v;
+  touch(c);
+  lenv_set(c->env, c->name, v);
+  return changed;
+}
+
+/* Evaluate the formula of `c`, finding its edges again */
+bool
+compute(cell *c)
+{
+  drop_deps(c);
+  cell *outer = computing;
+  bool outer_cycle = cycle;
+  computing = c;
+  cell_tracking = true;
+  cycle = false;
+  lval *v = lval_eval(c->env, c->formula);
+  if (cycle) { v = lval_err("ERROR: Cell `%s` depends on itself", get_sym(c->name)); }
+  computing = outer;
+  cell_tracking = outer != NULL;
+  cycle = outer_cycle;
+  recomputed++;
+  return update(c, v);
+}
+
+/* Recompute the queued cells, lowest first, until nothing else changes */
+void
+propagate(void)
+{
+  if (propagating) { return; } // A cell set from a formula; the outer loop gets to it
+  propagating = true;
+  long before = recomputed;
+  while (nheap) {
+    pending p = heap_pop();
+    cell *c = p.c;
+    if (p.height != c->height) { // Raised while it waited
+      heap_push(c);
+      continue;
+    }
+    c->queued = false;
+    if (c->formula && compute(c)) { enqueue_users(c); }
+  }
+  last = recomputed - before;
+  propagating = false;
+}
+
+/* Bind `name` in `e` to the value of `formula`, and keep it up to date */
+lval *
+cell_define(lenv *e, lval *name, lval *formula)
+{
+  cell *c = cell_in(list_first(e), name);
+  if (!c) { c = cell_new(e, name); }
+  c->formula = formula;
+  if (compute(c)) { enqueue_users(c); }
+  if (!batching) { propagate(); }
+  return c->value;
+}
+
+/* Set the cell `name` to `value`, making it an input, and update its users */
+lval *
+cell_set(lenv *e, lval *name, lval *value)
+{
+  cell *c = cell_find(e, name);
+  if (!c) { return lval_err("ERROR: Variable `%s` is not a cell", get_sym(name)); }
+  drop_deps(c);
+  c->formula = NULL;
+  if (update(c, value)) { enqueue_users(c); }
+  if (!batching) { propagate(); }
+  return value;
+}
+
+/* Evaluate each form in `body`, then propagate every change at once */
+lval *
+cell_batch(lenv *e, lval *body)
+{
+  lval *result = lval_sexp();
+  batching++;
+  for (list *l = get_cell(body); l; l = list_rest(l)) {
+    result = lval_eval(e, list_first(l));
+    if (get_type(result) == LVAL_ERR) { break; }
+  }
+  if (--batching == 0) { propagate(); }
+  return result;
+}
+
+/* {cells, recomputed, last}: live cells, recomputations, and those in the last update */
+lval *
+cell_stats(void)
+{
+  lval *d = lval_dict_sized(3);
+  lval_put(d, lval_sym("cells"), lval_num(ncells));
+  lval_put(d, lval_sym("recomputed"), lval_num(recomputed));
+  lval_put(d, lval_sym("last"), lval_num(last));
+  return d;
+}
+
+/* Pass each lval held by a cell to `mark` */
+void
+cell_mark(void (*mark)(lval *))
+{
+  for (frame_cells *f = cell_frames; f; f = f->next) {
+    for (int i = 0; i < f->count; i++) {
+      mark(f->cells[i]->name);
+      if (f->cells[i]->formula) { mark(f->cells[i]->formula); }
+      if (f->cells[i]->value) { mark(f->cells[i]->value); }
+    }
+  }
+}
+
+/*
+   Move what the cells hold out of the innermost region, before it is
+   released. Unless it is the `last`, they stay dirty, since what they
+   hold may have moved into the region outside it.
+*/
+void
+cell_promote(bool last)
+{
+  if (!ndirty) { return; }
+  for (frame_cells *f = cell_frames; f; f = f->next) { f->frame = lval_promote(f->frame); }
+  for (int i = 0; i < ndirty; i++) {
+    cell *c = dirty[i];
+    c->env = list_promote(c->env);
+    c->formula = lval_promote(c->formula);
+    c->value = lval_promote(c->value);
+    c->dirty = !last;
+  }
+  if (last) { ndirty = 0; }
+}
+
+/* Drop the cells bound in the cell_frames of `e`, which is going away */
+void
+cell_forget(lenv *e)
+{
+  for (; e; e = list_rest(e)) {
+    for (frame_cells **p = &cell_frames; *p; p = &(*p)->next) {
+      frame_cells *f = *p;
+      if (f->frame != list_first(e)) { continue; }
+      for (int i = 0; i < f->count; i++) {
+	cell *c = f->cells[i];
+	drop_deps(c);
+	for (int j = 0; j < c->nusers; j++) { remove_from(c->users[j]->deps, &c->users[j]->ndeps, c); }
+	c->nusers = 0;
+      }
+      for (int i = 0; i < f->count; i++) {
+	if (f->cells[i]->dirty) { remove_from(dirty, &ndirty, f->cells[i]); }
+	free(f->cells[i]->deps);
+	free(f->cells[i]->users);
+	free(f->cells[i]);
+      }
+      ncells -= f->count;
+      map_delete(f->index);
+      free(f->cells);
+      *p = f->next;
+      free(f);
+      break;
+    }
+  }
+}
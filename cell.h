@@ -0,0 +1,19 @@
+#ifndef CELL_H
+#define CELL_H
+
+#include <stdbool.h>
+
+#include "structs.h"
+
+extern __thread bool cell_tracking; // A cell's formula is being evaluated
+
+lval *cell_define(lenv *e, lval *name, lval *formula);
+lval *cell_set(lenv *e, lval *name, lval *value);
+lval *cell_batch(lenv *e, lval *body);
+lval *cell_stats(void);
+void cell_read(lval *frame, lval *name);
+void cell_mark(void (*mark)(lval *));
+void cell_forget(lenv *e);
+void cell_promote(bool last);
+
+#endif
@@ -5,6 +5,8 @@
 #include "map.h"
 #include "list.h"
 #include "lval.h"
+#include "cell.h"
+#include "region.h"
 
 
 lenv *lenv_new(lenv *parent) { return list_new(lval_dict(), parent); }
@@ -24,14 +26,20 @@ lenv_print(lenv *e)
 lval *
 lenv_get(lenv *e, lval *k)
 {
-  if (!e) { return lval_err("ERROR: Variable `%s` not found!", get_sym(k)); }
-  lval *v = lval_get(list_first(e), k);
-  if (get_type(v) != LVAL_ERR) {
-    return v;
-  } else {
-    return lenv_get(list_rest(e), k);
+  for (; e; e = list_rest(e)) {
+    lval *v = map_get(get_dict(list_first(e)), k);
+    if (v) {
+      if (cell_tracking) { cell_read(list_first(e), k); }
+      return v;
+    }
   }
+  return lval_err("ERROR: Variable `%s` not found!", get_sym(k));
 }
 
 /* Set K equal to V in E */
-void lenv_set(lenv *e, lval *k, lval *v) { lval_put(list_first(e), k, v); }
+void
+lenv_set(lenv *e, lval *k, lval *v)
+{
+  if (region_open) { region_remember(list_first(e), k); }
+  lval_put(list_first(e), k, v);
+}
@@ -0,0 +1,595 @@
+/*
+  Fasl: a compact binary encoding of lvals
+
+  Layout:
+
+    "BYOLFASL" version
+    string-count (length bytes)*     every sym, string and error text
+    value
+
+  Numbers (counts, lengths, string indices, lval nums) are varints,
+  with lval nums zigzag-encoded first. A value is a tag byte followed
+  by its fields. Every lval is numbered in the order it is first
+  written, and writing the same pointer again emits FASL_REF and that
+  number, so shared substructure (and cycles through closures) stays
+  shared when read back.
+
+  User functions keep their formals, body and every environment frame
+  except the global one. When read back they are re-attached to the
+  reader's global environment.
+*/
+
+#include "fasl.h"
+#include "lval.h"
+#include "list.h"
+#include "map.h"
+#include "btree.h"
+#include "vector.h"
+#include "builtin.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define FASL_MAGIC "BYOLFASL"
+#define FASL_VERSION 1
+
+enum { FASL_NUM, FASL_TRUE, FASL_FALSE, FASL_ERR, FASL_SYM, FASL_STRING,
+       FASL_SEXP, FASL_DICT, FASL_FN, FASL_MACRO, FASL_BUILTIN_FN,
+       FASL_BUILTIN_MACRO, FASL_REF, FASL_SORTED, FASL_STRUCT, FASL_RECORD,
+       FASL_VECTOR };
+
+typedef struct buffer buffer;
+typedef struct table table;
+typedef struct fasl_writer fasl_writer;
+typedef struct fasl_reader fasl_reader;
+
+struct buffer {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+struct table { // Open addressing, keyed by pointer or by string contents
+  void **keys;
+  size_t *vals;
+  size_t cap;
+  size_t count;
+  bool by_string;
+};
+
+struct fasl_writer {
+  buffer body;
+  buffer strings;
+  table ids; // lval pointer -> number
+  table string_ids; // text -> string table index
+};
+
+struct fasl_reader {
+  unsigned char *buf;
+  size_t len;
+  size_t pos;
+  lenv *global;
+  char **strings; // Point into `buf`
+  size_t *string_lens;
+  size_t nstrings;
+  lval **objs; // Indexed by number
+  size_t nobjs;
+  size_t obj_cap;
+  bool failed; // Set by the first error; every caller unwinds
+};
+
+// Buffers and varints
+
+void
+buffer_reserve(buffer *b, size_t n)
+{
+  if (b->len + n <= b->cap) { return; }
+  while (b->len + n > b->cap) { b->cap = b->cap ? 2 * b->cap : 256; }
+  b->data = realloc(b->data, b->cap);
+}
+
+void
+buffer_write(buffer *b, void *p, size_t n)
+{
+  if (n == 0) { return; } // `p` may be NULL, which memcpy doesn't allow
+  buffer_reserve(b, n);
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
+}
+
+void
+buffer_byte(buffer *b, int c)
+{
+  buffer_reserve(b, 1);
+  b->data[b->len++] = c;
+}
+
+void
+buffer_varint(buffer *b, uint64_t x)
+{
+  buffer_reserve(b, 10);
+  while (x >= 0x80) {
+    b->data[b->len++] = (x & 0x7f) | 0x80;
+    x >>= 7;
+  }
+  b->data[b->len++] = x;
+}
+
+// Tables
+
+uint64_t
+hash_bytes(char *s)
+{
+  uint64_t h = 14695981039346656037ull; // FNV-1a
+  for (; *s; s++) { h = (h ^ (unsigned char)*s) * 1099511628211ull; }
+  return h;
+}
+
+size_t
+table_slot(table *t, void *k)
+{
+  uint64_t h = t->by_string ? hash_bytes(k) : ((uintptr_t)k >> 3) * 11400714819323198485ull;
+  size_t i = h & (t->cap - 1);
+  while (t->keys[i]) {
+    if (t->by_string ? strcmp(t->keys[i], k) == 0 : t->keys[i] == k) { break; }
+    i = (i + 1) & (t->cap - 1);
+  }
+  return i;
+}
+
+bool
+table_get(table *t, void *k, size_t *v)
+{
+  if (!t->cap) { return false; }
+  size_t i = table_slot(t, k);
+  if (!t->keys[i]) { return false; }
+  *v = t->vals[i];
+  return true;
+}
+
+void
+table_put(table *t, void *k, size_t v)
+{
+  if (2 * (t->count + 1) > t->cap) {
+    table old = *t;
+    t->cap = t->cap ? 2 * t->cap : 256;
+    t->keys = calloc(t->cap, sizeof(void *));
+    t->vals = calloc(t->cap, sizeof(size_t));
+    for (size_t i = 0; i < old.cap; i++) {
+      if (old.keys[i]) {
+	size_t j = table_slot(t, old.keys[i]);
+	t->keys[j] = old.keys[i];
+	t->vals[j] = old.vals[i];
+      }
+    }
+    free(old.keys);
+    free(old.vals);
+  }
+  size_t i = table_slot(t, k);
+  t->keys[i] = k;
+  t->vals[i] = v;
+  t->count++;
+}
+
+// Writing
+
+void
+write_text(fasl_writer *w, char *s)
+{
+  size_t id;
+  if (!table_get(&w->string_ids, s, &id)) {
+    id = w->string_ids.count;
+    table_put(&w->string_ids, s, id);
+    size_t n = strlen(s);
+    buffer_varint(&w->strings, n);
+    buffer_write(&w->strings, s, n);
+  }
+  buffer_varint(&w->body, id);
+}
+
+void write_lval(fasl_writer *w, lval *v);
+
+void
+write_list(fasl_writer *w, list *l)
+{
+  buffer_varint(&w->body, list_count(l));
+  for (; l; l = list_rest(l)) { write_lval(w, list_first(l)); }
+}
+
+void
+write_lval(fasl_writer *w, lval *v)
+{
+  size_t id;
+  if (table_get(&w->ids, v, &id)) {
+    buffer_byte(&w->body, FASL_REF);
+    buffer_varint(&w->body, id);
+    return;
+  }
+  table_put(&w->ids, v, w->ids.count);
+
+  switch (get_type(v)) {
+  case LVAL_NUM: {
+    long x = get_num(v);
+    buffer_byte(&w->body, FASL_NUM);
+    buffer_varint(&w->body, ((uint64_t)x << 1) ^ (uint64_t)(x >> 63));
+    break;
+  }
+  case LVAL_BOOL:
+    buffer_byte(&w->body, get_bool(v) ? FASL_TRUE : FASL_FALSE);
+    break;
+  case LVAL_ERR:
+    buffer_byte(&w->body, FASL_ERR);
+    write_text(w, get_err(v));
+    break;
+  case LVAL_SYM:
+    buffer_byte(&w->body, FASL_SYM);
+    write_text(w, get_sym(v));
+    break;
+  case LVAL_STRING:
+    buffer_byte(&w->body, FASL_STRING);
+    write_text(w, get_string(v));
+    break;
+  case LVAL_SEXP:
+    buffer_byte(&w->body, FASL_SEXP);
+    write_list(w, get_cell(v));
+    break;
+  case LVAL_DICT: {
+    size_t i = 0;
+    lval *key, *val;
+    buffer_byte(&w->body, FASL_DICT);
+    buffer_varint(&w->body, map_count(get_dict(v)));
+    while (map_next(get_dict(v), &i, &key, &val)) {
+      write_lval(w, key);
+      write_lval(w, val);
+    }
+    break;
+  }
+  case LVAL_SORTED: {
+    bcursor c = btree_first(get_tree(v));
+    lval *key, *val;
+    buffer_byte(&w->body, FASL_SORTED);
+    buffer_varint(&w->body, btree_count(get_tree(v)));
+    while (btree_next(&c, &key, &val)) {
+      write_lval(w, key);
+      write_lval(w, val);
+    }
+    break;
+  }
+  case LVAL_VECTOR: // Items only; structure shared with other versions is not kept
+    buffer_byte(&w->body, FASL_VECTOR);
+    buffer_varint(&w->body, vec_count(get_vec(v)));
+    for (size_t i = 0; i < vec_count(get_vec(v)); i++) { write_lval(w, vec_nth(get_vec(v), i)); }
+    break;
+  case LVAL_RECORD:
+    if (get_struct(v)) {
+      buffer_byte(&w->body, FASL_RECORD);
+      buffer_varint(&w->body, get_num(v));
+      write_lval(w, get_struct(v));
+    } else {
+      buffer_byte(&w->body, FASL_STRUCT);
+      write_text(w, get_name(v));
+      buffer_varint(&w->body, get_num(v));
+    }
+    for (long i = 0; i < get_num(v); i++) { write_lval(w, get_fields(v)[i]); }
+    break;
+  case LVAL_FN:
+  case LVAL_MACRO:
+    if (get_builtin(v)) {
+      buffer_byte(&w->body, get_type(v) == LVAL_FN ? FASL_BUILTIN_FN : FASL_BUILTIN_MACRO);
+      write_text(w, builtin_name(get_builtin(v)));
+    } else {
+      buffer_byte(&w->body, get_type(v) == LVAL_FN ? FASL_FN : FASL_MACRO);
+      write_lval(w, get_formals(v));
+      write_lval(w, get_body(v));
+      // Local frames only; the global frame is the last one
+      int frames = 0;
+      for (lenv *e = get_env(v); e && list_rest(e); e = list_rest(e)) { frames++; }
+      buffer_varint(&w->body, frames);
+      for (lenv *e = get_env(v); e && list_rest(e); e = list_rest(e)) {
+	write_lval(w, list_first(e));
+      }
+    }
+    break;
+  }
+}
+
+/* Encode `v`, returning a malloc'd buffer of `*len` bytes */
+char *
+fasl_encode(lval *v, size_t *len)
+{
+  fasl_writer w = {0};
+  w.string_ids.by_string = true;
+  write_lval(&w, v);
+
+  buffer out = {0};
+  buffer_reserve(&out, 20 + w.strings.len + w.body.len);
+  buffer_write(&out, FASL_MAGIC, 8);
+  buffer_varint(&out, FASL_VERSION);
+  buffer_varint(&out, w.string_ids.count);
+  buffer_write(&out, w.strings.data, w.strings.len);
+  buffer_write(&out, w.body.data, w.body.len);
+
+  free(w.body.data);
+  free(w.strings.data);
+  free(w.ids.keys);
+  free(w.ids.vals);
+  free(w.string_ids.keys);
+  free(w.string_ids.vals);
+  *len = out.len;
+  return out.data;
+}
+
+// Reading
+
+bool
+read_varint(fasl_reader *r, uint64_t *x)
+{
+  *x = 0;
+  for (int shift = 0; shift < 64 && r->pos < r->len; shift += 7) {
+    unsigned char c = r->buf[r->pos++];
+    *x |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) { return true; }
+  }
+  return false;
+}
+
+void
+add_obj(fasl_reader *r, lval *v)
+{
+  if (r->nobjs == r->obj_cap) {
+    r->obj_cap = r->obj_cap ? 2 * r->obj_cap : 256;
+    r->objs = realloc(r->objs, r->obj_cap * sizeof(lval *));
+  }
+  r->objs[r->nobjs++] = v;
+}
+
+lval *
+fasl_error(fasl_reader *r, char *msg)
+{
+  r->failed = true;
+  return lval_err("ERROR: Corrupt fasl data at byte %lu: %s", (unsigned long)r->pos, msg);
+}
+
+lval *read_lval(fasl_reader *r);
+
+/* Reads a string table index into `*s` and `*n`. */
+bool
+read_text(fasl_reader *r, char **s, size_t *n)
+{
+  uint64_t i;
+  if (!read_varint(r, &i) || i >= r->nstrings) { return false; }
+  *s = r->strings[i];
+  *n = r->string_lens[i];
+  return true;
+}
+
+/* Read `count` values into a malloc'd array, or return an error */
+lval *
+read_many(fasl_reader *r, uint64_t count, lval ***out)
+{
+  if (count > r->len - r->pos) { return fasl_error(r, "bad count"); } // Each value takes >= 1 byte
+  lval **items = malloc((count ? count : 1) * sizeof(lval *));
+  for (uint64_t i = 0; i < count; i++) {
+    items[i] = read_lval(r);
+    if (r->failed) {
+      lval *err = items[i];
+      free(items);
+      return err;
+    }
+  }
+  *out = items;
+  return NULL;
+}
+
+lval *
+read_lval(fasl_reader *r)
+{
+  if (r->pos >= r->len) { return fasl_error(r, "truncated"); }
+  int tag = r->buf[r->pos++];
+  uint64_t x;
+  char *s;
+  size_t n;
+  lval *v, *err;
+  lval **items;
+
+  switch (tag) {
+  case FASL_REF:
+    if (!read_varint(r, &x) || x >= r->nobjs) { break; }
+    return r->objs[x];
+  case FASL_NUM:
+    if (!read_varint(r, &x)) { break; }
+    v = lval_num((long)((x >> 1) ^ -(x & 1)));
+    add_obj(r, v);
+    return v;
+  case FASL_TRUE:
+  case FASL_FALSE:
+    v = lval_bool(tag == FASL_TRUE);
+    add_obj(r, v);
+    return v;
+  case FASL_ERR:
+    if (!read_text(r, &s, &n)) { break; }
+    v = lval_err("%.*s", (int)n, s);
+    add_obj(r, v);
+    return v;
+  case FASL_SYM:
+    if (!read_text(r, &s, &n)) { break; }
+    v = lval_symn(s, n);
+    add_obj(r, v);
+    return v;
+  case FASL_STRING:
+    if (!read_text(r, &s, &n)) { break; }
+    v = lval_stringn(s, n);
+    add_obj(r, v);
+    return v;
+  case FASL_SEXP:
+    if (!read_varint(r, &x)) { break; }
+    v = lval_sexp(); // Numbered before its children so they can refer back to it
+    add_obj(r, v);
+    if ((err = read_many(r, x, &items))) { return err; }
+    for (uint64_t i = x; i > 0; i--) { lval_cons(v, items[i - 1]); }
+    free(items);
+    return v;
+  case FASL_DICT:
+    if (!read_varint(r, &x) || x > (r->len - r->pos) / 2) { break; }
+    v = lval_dict_sized(x);
+    add_obj(r, v);
+    if ((err = read_many(r, 2 * x, &items))) { return err; }
+    for (uint64_t i = 0; i < x; i++) { lval_put(v, items[2 * i], items[2 * i + 1]); }
+    free(items);
+    return v;
+  case FASL_SORTED:
+    if (!read_varint(r, &x) || x > (r->len - r->pos) / 2) { break; }
+    v = lval_sorted();
+    add_obj(r, v);
+    if ((err = read_many(r, 2 * x, &items))) { return err; }
+    for (uint64_t i = 0; i < x; i++) { btree_put(get_tree(v), items[2 * i], items[2 * i + 1]); }
+    free(items);
+    return v;
+  case FASL_VECTOR: {
+    if (!read_varint(r, &x)) { break; }
+    v = lval_vector(vec_new());
+    add_obj(r, v);
+    if ((err = read_many(r, x, &items))) { return err; }
+    vec *t = vec_transient(vec_new());
+    for (uint64_t i = 0; i < x; i++) { vec_conj(t, items[i]); }
+    free(items);
+    lval_set_vec(v, vec_persistent(t));
+    return v;
+  }
+  case FASL_STRUCT: {
+    if (!read_text(r, &s, &n) || !read_varint(r, &x) || x > r->len - r->pos) { break; }
+    char *name = strndup(s, n);
+    v = lval_struct(name, x);
+    free(name);
+    add_obj(r, v);
+    if ((err = read_many(r, x, &items))) { return err; }
+    memcpy(get_fields(v), items, x * sizeof(lval *));
+    free(items);
+    return v;
+  }
+  case FASL_RECORD: {
+    if (!read_varint(r, &x) || x > r->len - r->pos) { break; }
+    v = lval_record(NULL, x);
+    add_obj(r, v);
+    lval *type = read_lval(r);
+    if (r->failed) { return type; }
+    if (get_type(type) != LVAL_RECORD || get_struct(type) || get_num(type) != x) {
+      return fasl_error(r, "bad record type");
+    }
+    if ((err = read_many(r, x, &items))) { return err; }
+    lval_set_struct(v, type);
+    memcpy(get_fields(v), items, x * sizeof(lval *));
+    free(items);
+    return v;
+  }
+  case FASL_BUILTIN_FN:
+  case FASL_BUILTIN_MACRO: {
+    if (!read_text(r, &s, &n)) { break; }
+    char *name = strndup(s, n);
+    lbuiltin fn = builtin_lookup(name);
+    free(name);
+    if (!fn) { return fasl_error(r, "unknown builtin"); }
+    v = tag == FASL_BUILTIN_FN
+      ? lval_builtin_function(r->global, fn) : lval_builtin_macro(r->global, fn);
+    add_obj(r, v);
+    return v;
+  }
+  case FASL_FN:
+  case FASL_MACRO: {
+    v = tag == FASL_FN ? lval_lambda(NULL, NULL, NULL) : lval_macro(NULL, NULL, NULL);
+    add_obj(r, v);
+    lval *formals = read_lval(r);
+    lval *body = read_lval(r);
+    if (r->failed) { return get_type(body) == LVAL_ERR ? body : formals; }
+    if (!read_varint(r, &x)) { break; }
+    if ((err = read_many(r, x, &items))) { return err; }
+    lenv *e = r->global;
+    for (uint64_t i = x; i > 0; i--) { e = list_new(items[i - 1], e); }
+    free(items);
+    lval_set_fn(v, e, formals, body);
+    return v;
+  }
+  default:
+    return fasl_error(r, "unknown tag");
+  }
+  return fasl_error(r, "bad field");
+}
+
+/*
+   Decode `len` bytes of fasl data. Functions are attached to the
+   global frame of `e`.
+*/
+lval *
+fasl_decode(lenv *e, char *buf, size_t len)
+{
+  fasl_reader r = {0};
+  r.buf = (unsigned char *)buf;
+  r.len = len;
+  r.global = e;
+  while (r.global && list_rest(r.global)) { r.global = list_rest(r.global); }
+
+  uint64_t version, count;
+  if (len < 8 || memcmp(buf, FASL_MAGIC, 8) != 0) {
+    return lval_err("ERROR: Not fasl data!");
+  }
+  r.pos = 8;
+  if (!read_varint(&r, &version) || version != FASL_VERSION) {
+    return lval_err("ERROR: Unsupported fasl version!");
+  }
+  if (!read_varint(&r, &count) || count > len) { return fasl_error(&r, "bad string table"); }
+  r.strings = malloc((count ? count : 1) * sizeof(char *));
+  r.string_lens = malloc((count ? count : 1) * sizeof(size_t));
+  for (r.nstrings = 0; r.nstrings < count; r.nstrings++) {
+    uint64_t n;
+    if (!read_varint(&r, &n) || n > r.len - r.pos) { break; }
+    r.strings[r.nstrings] = buf + r.pos;
+    r.string_lens[r.nstrings] = n;
+    r.pos += n;
+  }
+
+  lval *v = r.nstrings == count ? read_lval(&r) : fasl_error(&r, "bad string table");
+  free(r.strings);
+  free(r.string_lens);
+  free(r.objs);
+  return v;
+}
+
+/*
+   Fasl bytes can't live in a NUL-terminated lval string as they are,
+   so in memory 0x00 is stored as 0x01 0x01 and 0x01 as 0x01 0x02.
+*/
+char *
+fasl_to_string(char *buf, size_t len)
+{
+  char *s = malloc(2 * len + 1);
+  size_t j = 0;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = buf[i];
+    if (c <= 1) {
+      s[j++] = 1;
+      s[j++] = c + 1;
+    } else {
+      s[j++] = c;
+    }
+  }
+  s[j] = '\0';
+  return s;
+}
+
+char *
+fasl_from_string(char *s, size_t *len)
+{
+  size_t n = strlen(s);
+  char *buf = malloc(n ? n : 1);
+  size_t j = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (s[i] == 1 && i + 1 < n) {
+      buf[j++] = s[++i] - 1;
+    } else {
+      buf[j++] = s[i];
+    }
+  }
+  *len = j;
+  return buf;
+}
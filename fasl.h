@@ -0,0 +1,14 @@
+#ifndef FASL_H
+#define FASL_H
+
+#include <stddef.h>
+
+#include "structs.h"
+
+char *fasl_encode(lval *v, size_t *len);
+lval *fasl_decode(lenv *e, char *buf, size_t len);
+
+char *fasl_to_string(char *buf, size_t len);
+char *fasl_from_string(char *s, size_t *len);
+
+#endif
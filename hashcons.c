@@ -0,0 +1,192 @@
+/*
+  Hash-consing
+
+  Interned values are kept in an open-addressing table. A sexp is only
+  interned once its elements are, so two sexps are equal exactly when
+  their elements are the same lvals, and hashing or comparing one never
+  looks deeper than its own list.
+
+  Collection marks everything reachable from the environment, then
+  drops and frees the interned values it didn't reach. Memo caches are
+  emptied rather than kept. A value is reached whenever anything
+  reached holds it, so a sexp is only freed when all the sexps holding
+  it are too.
+*/
+
+#include "hashcons.h"
+#include "lval.h"
+#include "list.h"
+#include "map.h"
+#include "btree.h"
+#include "vector.h"
+#include "memo.h"
+#include "cell.h"
+#include "region.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MINSLOTS 256
+
+__thread bool hashconsing = false;
+__thread lval **table = NULL;
+__thread size_t slots = 0, count = 0;
+__thread size_t collected_at = 0; // Count after the last collection
+__thread long shared = 0; // Values found already interned
+__thread unsigned epoch = 0;
+
+void hashcons_enable(bool on) { hashconsing = on; }
+long hashcons_count(void) { return count; }
+long hashcons_shared(void) { return shared; }
+
+/* Hash of `v` from its own contents, and its elements' addresses */
+uint64_t
+shallow_hash(lval *v)
+{
+  if (get_type(v) != LVAL_SEXP) { return lval_hash(v); }
+  uint64_t h = LVAL_SEXP;
+  for (list *l = get_cell(v); l; l = list_rest(l)) {
+    h = (h ^ (uintptr_t)list_first(l)) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+bool
+shallow_equal(lval *x, lval *y)
+{
+  if (get_type(x) != get_type(y)) { return false; }
+  if (get_type(x) != LVAL_SEXP) { return lval_equal(x, y); }
+  list *a = get_cell(x), *b = get_cell(y);
+  for (; a && b; a = list_rest(a), b = list_rest(b)) {
+    if (list_first(a) != list_first(b)) { return false; }
+  }
+  return !a && !b;
+}
+
+/* Slot holding a value equal to `v`, or the empty slot where it would go */
+size_t
+find(lval **t, size_t n, lval *v, uint64_t h)
+{
+  size_t i = h & (n - 1);
+  while (t[i] && !shallow_equal(t[i], v)) { i = (i + 1) & (n - 1); }
+  return i;
+}
+
+void
+resize(size_t n)
+{
+  lval **t = calloc(n, sizeof(lval *));
+  for (size_t i = 0; i < slots; i++) {
+    if (table[i]) { t[find(t, n, table[i], shallow_hash(table[i]))] = table[i]; }
+  }
+  free(table);
+  table = t;
+  slots = n;
+}
+
+/* The interned value equal to `v`, which is freed if there already was one */
+lval *
+hashcons(lval *v)
+{
+  if (2 * (count + 1) > slots) { resize(slots ? 2 * slots : MINSLOTS); } // Load factor 1/2
+  size_t i = find(table, slots, v, shallow_hash(v));
+  if (table[i]) {
+    shared++;
+    lval_del(v);
+    return table[i];
+  }
+  v = region_promote(v); // The table outlives the form
+  lval_set_interned(v, true);
+  table[i] = v;
+  count++;
+  return v;
+}
+
+void
+mark(lval *v)
+{
+  if (!v || !lval_mark(v, epoch)) { return; }
+  lval *k, *x;
+  switch (get_type(v)) {
+  case LVAL_SEXP:
+    for (list *l = get_cell(v); l; l = list_rest(l)) { mark(list_first(l)); }
+    break;
+  case LVAL_FN:
+  case LVAL_MACRO:
+    mark(get_formals(v));
+    mark(get_body(v));
+    for (list *l = get_env(v); l; l = list_rest(l)) { mark(list_first(l)); }
+    break;
+  case LVAL_DICT: {
+    size_t i = 0;
+    while (map_next(get_dict(v), &i, &k, &x)) {
+      mark(k);
+      mark(x);
+    }
+    break;
+  }
+  case LVAL_SORTED: {
+    bcursor c = btree_first(get_tree(v));
+    while (btree_next(&c, &k, &x)) {
+      mark(k);
+      mark(x);
+    }
+    break;
+  }
+  case LVAL_VECTOR:
+    for (size_t i = 0; i < vec_count(get_vec(v)); i++) { mark(vec_nth(get_vec(v), i)); }
+    break;
+  case LVAL_RECORD:
+    mark(get_struct(v));
+    for (long i = 0; i < get_num(v); i++) { mark(get_fields(v)[i]); }
+    break;
+  }
+}
+
+/*
+   Free the interned values nothing in `e` or `root` can reach. `root`
+   may be NULL; it holds a value not bound anywhere yet, such as a
+   result still to be printed. Returns how many were freed.
+*/
+long
+hashcons_collect(lenv *e, lval *root)
+{
+  if (++epoch == 0) { epoch = 1; } // Fresh lvals have mark 0
+  for (list *l = e; l; l = list_rest(l)) { mark(list_first(l)); }
+  if (root) { mark(root); }
+  cell_mark(mark); // Formulas aren't bound anywhere
+  memo_clear(); // Cached arguments and results may be interned
+
+  lval **dead = malloc((count + 1) * sizeof(lval *));
+  size_t ndead = 0;
+  lval **old = table;
+  size_t nold = slots;
+  table = calloc(nold, sizeof(lval *));
+  count = 0;
+  for (size_t i = 0; i < nold; i++) {
+    lval *v = old[i];
+    if (!v) { continue; }
+    if (lval_mark(v, epoch)) { // Not reached before now
+      dead[ndead++] = v;
+    } else {
+      table[find(table, slots, v, shallow_hash(v))] = v;
+      count++;
+    }
+  }
+  free(old);
+  // Sexps are freed without their elements, so the order doesn't matter
+  for (size_t i = 0; i < ndead; i++) { lval_free_node(dead[i]); }
+  free(dead);
+  collected_at = count;
+  return ndead;
+}
+
+/* Collect once the table has doubled since the last collection */
+long
+hashcons_maybe_collect(lenv *e, lval *root)
+{
+  if (count < MINSLOTS || count < 2 * collected_at) { return 0; }
+  return hashcons_collect(e, root);
+}
@@ -0,0 +1,29 @@
+#ifndef HASHCONS_H
+#define HASHCONS_H
+
+#include <stdbool.h>
+
+#include "structs.h"
+
+/*
+   While `hashconsing` is set, numbers, bools, symbols and strings from
+   the constructors, and sexps from the reader, are interned: equal
+   values are one shared lval, found in a per-thread table. Interned
+   values must not be changed, and lval_del leaves them alone.
+
+   The table is weak. hashcons_collect frees the interned values that
+   can't be reached from an environment or the one root it is given,
+   so call it between top-level evaluations, when nothing else holds
+   them.
+*/
+
+extern __thread bool hashconsing;
+
+void hashcons_enable(bool on);
+lval *hashcons(lval *v);
+long hashcons_count(void);
+long hashcons_shared(void);
+long hashcons_collect(lenv *e, lval *root);
+long hashcons_maybe_collect(lenv *e, lval *root);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+  Heap images
+
+  An image is a flat copy of every struct reachable from the global
+  environment. Pointers inside it are stored as offsets from the start
+  of the file, and a relocation table lists where they are. Loading an
+  image maps the file copy-on-write and adds the mapping's address to
+  each of those offsets. Builtin function pointers are stored by name
+  and looked up again, so an image survives ASLR. It is still tied to
+  the struct layouts of the binary that wrote it.
+*/
+
+#include "image.h"
+#include "list.h"
+#include "builtin.h"
+#include "region.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define IMAGE_MAGIC "BYOLIMG"
+#define IMAGE_VERSION 1
+#define MAXIMAGES 16 // Max images loaded at once
+
+typedef struct image_header image_header;
+typedef struct image_builtin_ref image_builtin_ref;
+
+struct image_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t ptrsize;
+  uint64_t size;
+  uint64_t root;
+  uint64_t relocs; // Offset of the relocation table
+  uint64_t nrelocs;
+  uint64_t builtins; // Offset of the builtin table
+  uint64_t nbuiltins;
+};
+
+struct image_builtin_ref {
+  uint64_t at; // Where the function pointer goes
+  uint64_t name; // Offset of its name
+};
+
+struct image { // An image being written
+  char *buf;
+  size_t len;
+  size_t cap;
+
+  /* Pointers already copied, open addressing */
+  void **seen;
+  size_t *seen_off;
+  size_t seen_cap;
+  size_t seen_count;
+
+  uint64_t *relocs;
+  size_t nrelocs;
+  size_t reloc_cap;
+
+  image_builtin_ref *builtins; // `name` holds the lbuiltin until saved
+  lbuiltin *builtin_fns;
+  size_t nbuiltins;
+  size_t builtin_cap;
+};
+
+struct region {
+  char *base;
+  size_t size;
+};
+
+struct region regions[MAXIMAGES];
+int nregions = 0;
+
+// Writing
+
+size_t
+image_reserve(image *im, size_t size) // Returns the offset of `size` zeroed bytes
+{
+  size_t off = (im->len + 7) & ~(size_t)7; // Keep every struct word aligned
+  while (off + size > im->cap) {
+    im->cap *= 2;
+    im->buf = realloc(im->buf, im->cap);
+  }
+  memset(im->buf + im->len, 0, off + size - im->len);
+  im->len = off + size;
+  return off;
+}
+
+size_t
+seen_slot(image *im, void *p)
+{
+  size_t i = ((uintptr_t)p >> 3) * 11400714819323198485ull & (im->seen_cap - 1);
+  while (im->seen[i] && im->seen[i] != p) { i = (i + 1) & (im->seen_cap - 1); }
+  return i;
+}
+
+bool
+image_seen(image *im, void *p, size_t *off)
+{
+  size_t i = seen_slot(im, p);
+  if (!im->seen[i]) { return false; }
+  *off = im->seen_off[i];
+  return true;
+}
+
+void
+seen_add(image *im, void *p, size_t off)
+{
+  if (2 * (im->seen_count + 1) > im->seen_cap) {
+    void **old = im->seen;
+    size_t *old_off = im->seen_off;
+    size_t old_cap = im->seen_cap;
+    im->seen_cap *= 2;
+    im->seen = calloc(im->seen_cap, sizeof(void *));
+    im->seen_off = calloc(im->seen_cap, sizeof(size_t));
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i]) {
+	size_t j = seen_slot(im, old[i]);
+	im->seen[j] = old[i];
+	im->seen_off[j] = old_off[i];
+      }
+    }
+    free(old);
+    free(old_off);
+  }
+  size_t i = seen_slot(im, p);
+  im->seen[i] = p;
+  im->seen_off[i] = off;
+  im->seen_count++;
+}
+
+/* Copy `size` bytes at `p` into the image, remembering where they went */
+size_t
+image_alloc(image *im, void *p, size_t size)
+{
+  size_t off = image_reserve(im, size);
+  memcpy(im->buf + off, p, size);
+  seen_add(im, p, off);
+  return off;
+}
+
+/* Copy a NUL-terminated string into the image, or return 0 for NULL */
+size_t
+image_string(image *im, char *s)
+{
+  size_t off;
+  if (!s) { return 0; }
+  if (image_seen(im, s, &off)) { return off; }
+  return image_alloc(im, s, strlen(s) + 1);
+}
+
+/* Point the pointer field at offset `at` to offset `target` (0 is NULL) */
+void
+image_ptr(image *im, size_t at, size_t target)
+{
+  *(uint64_t *)(im->buf + at) = target;
+  if (!target) { return; }
+  if (im->nrelocs == im->reloc_cap) {
+    im->reloc_cap *= 2;
+    im->relocs = realloc(im->relocs, im->reloc_cap * sizeof(uint64_t));
+  }
+  im->relocs[im->nrelocs++] = at;
+}
+
+/* Record that the builtin field at offset `at` must be re-linked to `fn` */
+void
+image_builtin(image *im, size_t at, lbuiltin fn)
+{
+  *(uint64_t *)(im->buf + at) = 0;
+  if (!fn) { return; }
+  if (im->nbuiltins == im->builtin_cap) {
+    im->builtin_cap *= 2;
+    im->builtins = realloc(im->builtins, im->builtin_cap * sizeof(image_builtin_ref));
+    im->builtin_fns = realloc(im->builtin_fns, im->builtin_cap * sizeof(lbuiltin));
+  }
+  im->builtins[im->nbuiltins].at = at;
+  im->builtin_fns[im->nbuiltins++] = fn;
+}
+
+image *
+image_new(void)
+{
+  image *im = calloc(1, sizeof(image));
+  im->cap = 4096;
+  im->buf = malloc(im->cap);
+  im->seen_cap = 1024;
+  im->seen = calloc(im->seen_cap, sizeof(void *));
+  im->seen_off = calloc(im->seen_cap, sizeof(size_t));
+  im->reloc_cap = 1024;
+  im->relocs = malloc(im->reloc_cap * sizeof(uint64_t));
+  im->builtin_cap = 64;
+  im->builtins = malloc(im->builtin_cap * sizeof(image_builtin_ref));
+  im->builtin_fns = malloc(im->builtin_cap * sizeof(lbuiltin));
+  return im;
+}
+
+void
+image_delete(image *im)
+{
+  free(im->buf);
+  free(im->seen);
+  free(im->seen_off);
+  free(im->relocs);
+  free(im->builtins);
+  free(im->builtin_fns);
+  free(im);
+}
+
+/* Write everything reachable from `e` to `fname`. Returns 0 on success */
+int
+image_save(char *fname, lenv *e)
+{
+  image *im = image_new();
+  image_reserve(im, sizeof(image_header)); // Offset 0 is never an object
+  size_t root = list_image_dump(im, e);
+
+  for (size_t i = 0; i < im->nbuiltins; i++) {
+    char *name = builtin_name(im->builtin_fns[i]);
+    if (!name) {
+      fprintf(stderr, "image: builtin without a registered name\n");
+      image_delete(im);
+      return -1;
+    }
+    size_t off = image_reserve(im, strlen(name) + 1);
+    strcpy(im->buf + off, name);
+    im->builtins[i].name = off;
+  }
+  size_t relocs = image_reserve(im, im->nrelocs * sizeof(uint64_t));
+  memcpy(im->buf + relocs, im->relocs, im->nrelocs * sizeof(uint64_t));
+  size_t builtins = image_reserve(im, im->nbuiltins * sizeof(image_builtin_ref));
+  memcpy(im->buf + builtins, im->builtins, im->nbuiltins * sizeof(image_builtin_ref));
+
+  image_header *h = (image_header *)im->buf;
+  memcpy(h->magic, IMAGE_MAGIC, sizeof(h->magic));
+  h->version = IMAGE_VERSION;
+  h->ptrsize = sizeof(void *);
+  h->size = im->len;
+  h->root = root;
+  h->relocs = relocs;
+  h->nrelocs = im->nrelocs;
+  h->builtins = builtins;
+  h->nbuiltins = im->nbuiltins;
+
+  FILE *f = fopen(fname, "wb");
+  int status = -1;
+  if (f) {
+    if (fwrite(im->buf, 1, im->len, f) == im->len) { status = 0; }
+    if (fclose(f) != 0) { status = -1; }
+  }
+  image_delete(im);
+  return status;
+}
+
+// Loading
+
+/* Map an image saved by `image_save`, returning its environment or NULL */
+lenv *
+image_load(char *fname)
+{
+  if (nregions == MAXIMAGES) { return NULL; }
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) { return NULL; }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(image_header)) {
+    close(fd);
+    return NULL;
+  }
+  char *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) { return NULL; }
+
+  image_header *h = (image_header *)base;
+  if (memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0
+      || h->version != IMAGE_VERSION || h->ptrsize != sizeof(void *)
+      || h->size != (uint64_t)st.st_size) {
+    munmap(base, st.st_size);
+    return NULL;
+  }
+
+  uint64_t *relocs = (uint64_t *)(base + h->relocs);
+  for (uint64_t i = 0; i < h->nrelocs; i++) {
+    *(uintptr_t *)(base + relocs[i]) += (uintptr_t)base;
+  }
+  image_builtin_ref *builtins = (image_builtin_ref *)(base + h->builtins);
+  for (uint64_t i = 0; i < h->nbuiltins; i++) {
+    lbuiltin fn = builtin_lookup(base + builtins[i].name);
+    if (!fn) {
+      munmap(base, st.st_size);
+      return NULL;
+    }
+    memcpy(base + builtins[i].at, &fn, sizeof(fn));
+  }
+
+  regions[nregions].base = base;
+  regions[nregions++].size = st.st_size;
+  return (lenv *)(base + h->root);
+}
+
+bool
+image_contains(void *p)
+{
+  for (int i = 0; i < nregions; i++) {
+    if ((char *)p >= regions[i].base && (char *)p < regions[i].base + regions[i].size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool /* Free `p` unless a loaded image or an open region owns it. Returns whether it was freed */
+image_free(void *p)
+{
+  if (!p || image_contains(p) || region_owns(p)) { return false; }
+  free(p);
+  return true;
+}
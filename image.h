@@ -0,0 +1,27 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "structs.h"
+
+// Saving and restoring
+
+int image_save(char *fname, lenv *e);
+lenv *image_load(char *fname);
+
+// Used by each module to copy its own structs into an image
+
+bool image_seen(image *im, void *p, size_t *off);
+size_t image_alloc(image *im, void *p, size_t size);
+size_t image_string(image *im, char *s);
+void image_ptr(image *im, size_t at, size_t target);
+void image_builtin(image *im, size_t at, lbuiltin fn);
+
+// Memory owned by a loaded image must never be passed to free
+
+bool image_contains(void *p);
+bool image_free(void *p);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+  Interpreter instances for embedding
+
+  Everything an evaluation touches is reached from the instance's
+  global environment, or is kept per thread (the call stack, tracing,
+  profiles and heap statistics). Heap images are the exception: load
+  them before starting threads. Builtins registered by native libraries
+  are shared by every instance, behind a lock.
+*/
+
+#include "interp.h"
+#include "lval.h"
+#include "list.h"
+#include "map.h"
+#include "environment.h"
+#include "builtin.h"
+#include "read.h"
+#include "image.h"
+#include "fasl.h"
+#include "budget.h"
+#include "hashcons.h"
+#include "cell.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct interp {
+  lenv *env;
+  char *stdlib; // Loaded when the instance was created, or NULL
+  budget *budget; // Limits each eval and call, or NULL
+};
+
+interp *
+interp_of_env(lenv *e, char *stdlib)
+{
+  interp *in = malloc(sizeof(interp));
+  in->env = e;
+  in->stdlib = stdlib ? strdup(stdlib) : NULL;
+  in->budget = NULL;
+  return in;
+}
+
+/*
+   Create an instance with the builtins and, unless `stdlib` is NULL,
+   the definitions in that file. Returns NULL if it can't be loaded.
+*/
+interp *
+interp_new(char *stdlib)
+{
+  lenv *e = lenv_new(NULL);
+  env_add_builtins(e);
+  interp *in = interp_of_env(e, stdlib);
+  if (stdlib && get_type(interp_eval_file(in, stdlib)) == LVAL_ERR) {
+    interp_delete(in);
+    return NULL;
+  }
+  return in;
+}
+
+/* Create an instance from a heap image saved with image_save */
+interp *
+interp_image(char *fname)
+{
+  lenv *e = image_load(fname);
+  return e ? interp_of_env(e, NULL) : NULL;
+}
+
+/*
+   Copy a warmed-up instance. The globals are copied through fasl, which
+   keeps sharing and reattaches closures to the copy's environment, so
+   the copy is independent of the original and may move to another
+   thread.
+*/
+interp *
+interp_clone(interp *in)
+{
+  size_t len;
+  char *buf = fasl_encode(list_first(in->env), &len);
+  lenv *e = lenv_new(NULL);
+  bool was_hashconsing = hashconsing; // The copy's values mustn't be in this thread's table
+  hashcons_enable(false);
+  lval *globals = fasl_decode(e, buf, len);
+  hashcons_enable(was_hashconsing);
+  free(buf);
+  if (get_type(globals) == LVAL_ERR) { return NULL; }
+
+  size_t i = 0;
+  lval *k, *v;
+  while (map_next(get_dict(globals), &i, &k, &v)) { lenv_set(e, k, v); }
+  return interp_of_env(e, in->stdlib);
+}
+
+/*
+   Free an instance. Values may be shared between its globals, so they
+   are left alone; only the instance itself and its global table go.
+*/
+void
+interp_delete(interp *in)
+{
+  cell_forget(in->env);
+  map_delete(get_dict(list_first(in->env)));
+  free(in->stdlib);
+  free(in);
+}
+
+/*
+   Limit every later eval and call to `b`, which each starts afresh, or
+   lift the limit with NULL. The instance keeps the pointer, not a copy.
+*/
+void interp_set_budget(interp *in, budget *b) { in->budget = b; }
+
+budget *
+interp_begin(interp *in)
+{
+  return in->budget ? budget_start(in->budget) : NULL;
+}
+
+void
+interp_end(interp *in, budget *prev)
+{
+  if (in->budget) { budget_stop(prev); }
+}
+
+/* Evaluate every form in `src`, returning the last result */
+lval *
+interp_eval_string(interp *in, char *src)
+{
+  reader *r = reader_string("<string>", src);
+  budget *prev = interp_begin(in);
+  lval *result = eval_reader(in->env, r);
+  interp_end(in, prev);
+  reader_close(r);
+  return result;
+}
+
+lval *
+interp_eval_file(interp *in, char *fname)
+{
+  reader *r = reader_open(fname);
+  if (!r) { return lval_err("ERROR: Could not open file `%s`!", fname); }
+  budget *prev = interp_begin(in);
+  lval *result = eval_reader(in->env, r);
+  interp_end(in, prev);
+  reader_close(r);
+  return result;
+}
+
+/* Call the global function `name` with `args`, a sexp of evaluated values */
+lval *
+interp_call(interp *in, char *name, lval *args)
+{
+  lval *sym = lval_sym(name);
+  lval *fn = lenv_get(in->env, sym);
+  lval_del(sym);
+  if (get_type(fn) == LVAL_ERR) { return fn; }
+  if (get_type(fn) != LVAL_FN) { return lval_err("ERROR: `%s` is not a function", name); }
+  return interp_apply(in, fn, args);
+}
+
+/* Call the function `fn` with `args`, under the instance's budget */
+lval *
+interp_apply(interp *in, lval *fn, lval *args)
+{
+  budget *prev = interp_begin(in);
+  lval *result = lval_call(in->env, fn, args);
+  interp_end(in, prev);
+  return result;
+}
+
+lenv *interp_env(interp *in) { return in->env; }
@@ -0,0 +1,32 @@
+#ifndef INTERP_H
+#define INTERP_H
+
+#include "structs.h"
+#include "budget.h"
+
+/*
+   An interpreter instance: a global environment and its settings.
+   Instances share no mutable state, so each thread can run its own.
+   Values must not be passed between instances on different threads.
+
+   Profiles, traces, memo caches and cells are kept per thread, not per
+   instance. A profile samples only the thread that started it, so it
+   sees the instances that thread runs, and nothing another thread
+   runs meanwhile. Each thread may run one profile at a time.
+*/
+
+typedef struct interp interp;
+
+interp *interp_new(char *stdlib);
+interp *interp_image(char *fname);
+interp *interp_clone(interp *in);
+void interp_delete(interp *in);
+
+lval *interp_eval_string(interp *in, char *src);
+lval *interp_eval_file(interp *in, char *fname);
+lval *interp_call(interp *in, char *name, lval *args);
+lval *interp_apply(interp *in, lval *fn, lval *args);
+lenv *interp_env(interp *in);
+void interp_set_budget(interp *in, budget *b);
+
+#endif
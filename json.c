@@ -0,0 +1,588 @@
+/*
+  JSON reader and writer
+
+  Reading happens in two stages. Stage 1 scans the whole input
+  (16 bytes at a time with SSE2 when available) and records the
+  offset of every structural byte: {}[]:," and backslash. Stage 2
+  walks that index and builds lvals directly. Objects become dicts
+  keyed by symbols, arrays become sexps, null becomes `()`, and
+  strings, integers and bools map to their lval types. There is no
+  float type, so numbers with a fraction or exponent are an error.
+*/
+
+#include "json.h"
+#include "lval.h"
+#include "list.h"
+#include "map.h"
+#include "port.h"
+#include "vector.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MAXDEPTH 1024 // Deepest nesting accepted
+#define WRITEBUF 65536 // Bytes buffered before a file write
+
+typedef struct json_parser json_parser;
+typedef struct json_writer json_writer;
+
+struct json_parser {
+  char *buf;
+  size_t len;
+  uint32_t *index; // Offsets of structural bytes
+  size_t count;
+  size_t cap;
+  size_t next; // Next unread index entry
+  char *scratch; // For unescaping strings
+  size_t scratch_cap;
+  uint32_t last_size[MAXDEPTH + 2]; // Keys in the last object seen at each depth
+};
+
+struct json_writer {
+  char *buf;
+  size_t len;
+  size_t cap;
+  FILE *file; // NULL when writing to memory
+  bool failed;
+};
+
+// Stage 1
+
+bool is_structural(char c) { return strchr("{}[]:,\"\\", c) && c; }
+
+/* Make room for `n` more index entries */
+void
+index_reserve(json_parser *p, size_t n)
+{
+  if (p->count + n <= p->cap) { return; }
+  while (p->count + n > p->cap) { p->cap *= 2; }
+  p->index = realloc(p->index, p->cap * sizeof(uint32_t));
+}
+
+void
+index_scalar(json_parser *p, size_t from)
+{
+  for (size_t i = from; i < p->len; i++) {
+    if (is_structural(p->buf[i])) {
+      index_reserve(p, 1);
+      p->index[p->count++] = i;
+    }
+  }
+}
+
+void
+build_index(json_parser *p)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  __m128i open_brace = _mm_set1_epi8('{'), close_brace = _mm_set1_epi8('}');
+  __m128i open_bracket = _mm_set1_epi8('['), close_bracket = _mm_set1_epi8(']');
+  __m128i colon = _mm_set1_epi8(':'), comma = _mm_set1_epi8(',');
+  __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+  for (; i + 16 <= p->len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((__m128i *)(p->buf + i));
+    __m128i hits = _mm_or_si128(
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, open_brace),
+				_mm_cmpeq_epi8(chunk, close_brace)),
+		   _mm_or_si128(_mm_cmpeq_epi8(chunk, open_bracket),
+				_mm_cmpeq_epi8(chunk, close_bracket))),
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, colon),
+				_mm_cmpeq_epi8(chunk, comma)),
+		   _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+				_mm_cmpeq_epi8(chunk, backslash))));
+    unsigned mask = _mm_movemask_epi8(hits);
+    if (mask) { index_reserve(p, 16); }
+    while (mask) {
+      p->index[p->count++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+#endif
+  index_scalar(p, i);
+}
+
+// Stage 2
+
+lval *
+json_error(json_parser *p, size_t at, char *msg)
+{
+  return lval_err("ERROR: JSON syntax error at byte %lu: %s", (unsigned long)at, msg);
+}
+
+size_t
+skip_ws(json_parser *p, size_t i)
+{
+  while (i < p->len && (p->buf[i] == ' ' || p->buf[i] == '\t'
+			|| p->buf[i] == '\n' || p->buf[i] == '\r')) { i++; }
+  return i;
+}
+
+/* Offset of the next structural byte, or the end of input */
+size_t
+peek_index(json_parser *p)
+{
+  return p->next < p->count ? p->index[p->next] : p->len;
+}
+
+int
+hex_digit(char c)
+{
+  if (c >= '0' && c <= '9') { return c - '0'; }
+  if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+  if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+  return -1;
+}
+
+bool
+read_hex4(char *s, unsigned *x)
+{
+  *x = 0;
+  for (int i = 0; i < 4; i++) {
+    int d = hex_digit(s[i]);
+    if (d < 0) { return false; }
+    *x = (*x << 4) | d;
+  }
+  return true;
+}
+
+size_t
+put_utf8(char *out, unsigned c)
+{
+  if (c < 0x80) { out[0] = c; return 1; }
+  if (c < 0x800) {
+    out[0] = 0xc0 | (c >> 6);
+    out[1] = 0x80 | (c & 0x3f);
+    return 2;
+  }
+  if (c < 0x10000) {
+    out[0] = 0xe0 | (c >> 12);
+    out[1] = 0x80 | ((c >> 6) & 0x3f);
+    out[2] = 0x80 | (c & 0x3f);
+    return 3;
+  }
+  out[0] = 0xf0 | (c >> 18);
+  out[1] = 0x80 | ((c >> 12) & 0x3f);
+  out[2] = 0x80 | ((c >> 6) & 0x3f);
+  out[3] = 0x80 | (c & 0x3f);
+  return 4;
+}
+
+/*
+   Parse the string whose opening quote is the current index entry.
+   Its contents are returned through `s` and `n`, pointing into the
+   input when there were no escapes and into `scratch` otherwise.
+*/
+lval *
+parse_string(json_parser *p, char **s, size_t *n)
+{
+  size_t start = p->index[p->next++] + 1;
+  bool escaped = false;
+  size_t end;
+  while (true) { // Backslashes are indexed too, so quotes inside escapes are skipped
+    end = peek_index(p);
+    if (end == p->len) { return json_error(p, start - 1, "unterminated string"); }
+    p->next++;
+    if (p->buf[end] == '\\') {
+      escaped = true;
+      if (peek_index(p) == end + 1) { p->next++; } // `\"` or `\\`
+    } else if (p->buf[end] == '"') {
+      break;
+    }
+  }
+  if (!escaped) {
+    *s = p->buf + start;
+    *n = end - start;
+    return NULL;
+  }
+
+  if (p->scratch_cap < end - start) {
+    p->scratch_cap = end - start;
+    p->scratch = realloc(p->scratch, p->scratch_cap);
+  }
+  char *out = p->scratch;
+  for (size_t i = start; i < end; i++) {
+    if (p->buf[i] != '\\') { *out++ = p->buf[i]; continue; }
+    switch (p->buf[++i]) {
+    case '"': *out++ = '"'; break;
+    case '\\': *out++ = '\\'; break;
+    case '/': *out++ = '/'; break;
+    case 'b': *out++ = '\b'; break;
+    case 'f': *out++ = '\f'; break;
+    case 'n': *out++ = '\n'; break;
+    case 'r': *out++ = '\r'; break;
+    case 't': *out++ = '\t'; break;
+    case 'u': {
+      unsigned c, low;
+      if (i + 4 >= end || !read_hex4(p->buf + i + 1, &c)) {
+	return json_error(p, i, "bad \\u escape");
+      }
+      i += 4;
+      if (c >= 0xd800 && c < 0xdc00 && i + 6 < end && p->buf[i + 1] == '\\'
+	  && p->buf[i + 2] == 'u' && read_hex4(p->buf + i + 3, &low)
+	  && low >= 0xdc00 && low < 0xe000) { // Surrogate pair
+	c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+	i += 6;
+      }
+      if (c == 0) { return json_error(p, i, "\\u0000 is not supported"); }
+      out += put_utf8(out, c); // Never longer than the escape it replaces
+      break;
+    }
+    default:
+      return json_error(p, i, "bad escape");
+    }
+  }
+  *s = p->scratch;
+  *n = out - p->scratch;
+  return NULL;
+}
+
+/* Parse a number, true, false or null spanning [from, to) */
+lval *
+parse_scalar(json_parser *p, size_t from, size_t to)
+{
+  while (to > from && skip_ws(p, to - 1) == to) { to--; }
+  char *s = p->buf + from;
+  size_t n = to - from;
+  if (n == 4 && memcmp(s, "true", 4) == 0) { return lval_bool(true); }
+  if (n == 5 && memcmp(s, "false", 5) == 0) { return lval_bool(false); }
+  if (n == 4 && memcmp(s, "null", 4) == 0) { return lval_sexp(); }
+
+  size_t i = (n > 0 && s[0] == '-') ? 1 : 0;
+  if (i == n) { return json_error(p, from, "expected a value"); }
+  long x = 0;
+  for (; i < n; i++) {
+    if (s[i] == '.' || s[i] == 'e' || s[i] == 'E') {
+      return json_error(p, from, "non-integer numbers are not supported");
+    }
+    if (s[i] < '0' || s[i] > '9') { return json_error(p, from, "expected a value"); }
+    int d = s[i] - '0';
+    if (x > (LONG_MAX - d) / 10) { return json_error(p, from, "number out of range"); }
+    x = 10 * x + d;
+  }
+  return lval_num(s[0] == '-' ? -x : x);
+}
+
+lval *parse_value(json_parser *p, size_t at, int depth);
+
+/* Whether only whitespace comes between the end of the value just parsed at `at` and `sep` */
+bool
+ends_before(json_parser *p, size_t at, size_t sep)
+{
+  if (at >= p->len || (p->buf[at] != '"' && p->buf[at] != '[' && p->buf[at] != '{')) {
+    return true; // A scalar runs up to `sep`, and was checked whole
+  }
+  return skip_ws(p, p->index[p->next - 1] + 1) == sep;
+}
+
+lval *
+parse_array(json_parser *p, int depth)
+{
+  size_t open = p->index[p->next++];
+  list *items = NULL;
+  size_t at = skip_ws(p, open + 1);
+  if (at < p->len && p->buf[at] == ']') {
+    p->next++;
+    return lval_sexp();
+  }
+  while (true) {
+    lval *item = parse_value(p, at, depth + 1);
+    if (get_type(item) == LVAL_ERR) {
+      list_delete(items);
+      return item;
+    }
+    items = list_cons(item, items);
+    size_t sep = peek_index(p);
+    if (sep == p->len || (p->buf[sep] != ',' && p->buf[sep] != ']') || !ends_before(p, at, sep)) {
+      list_delete(items);
+      return json_error(p, sep, "expected `,` or `]`");
+    }
+    p->next++;
+    if (p->buf[sep] == ']') { break; }
+    at = skip_ws(p, sep + 1);
+  }
+  return lval_sexp_of(list_reverse(items));
+}
+
+lval *
+parse_object(json_parser *p, int depth)
+{
+  size_t open = p->index[p->next++];
+  // Sibling objects (rows of a table) usually have the same keys
+  lval *d = lval_dict_sized(p->last_size[depth]);
+  size_t at = skip_ws(p, open + 1);
+  if (at < p->len && p->buf[at] == '}') {
+    p->next++;
+    return d;
+  }
+  while (true) {
+    if (at >= p->len || p->buf[at] != '"' || peek_index(p) != at) {
+      lval_del(d);
+      return json_error(p, at, "expected a string key");
+    }
+    char *s;
+    size_t n;
+    lval *err = parse_string(p, &s, &n);
+    if (err) { lval_del(d); return err; }
+    lval *key = lval_symn(s, n);
+
+    size_t colon = peek_index(p);
+    if (colon == p->len || p->buf[colon] != ':'
+	|| skip_ws(p, p->index[p->next - 1] + 1) != colon) {
+      lval_del(key);
+      lval_del(d);
+      return json_error(p, colon, "expected `:`");
+    }
+    p->next++;
+    at = skip_ws(p, colon + 1);
+    lval *v = parse_value(p, at, depth + 1);
+    if (get_type(v) == LVAL_ERR) {
+      lval_del(key);
+      lval_del(d);
+      return v;
+    }
+    lval_put(d, key, v);
+
+    size_t sep = peek_index(p);
+    if (sep == p->len || (p->buf[sep] != ',' && p->buf[sep] != '}') || !ends_before(p, at, sep)) {
+      lval_del(d);
+      return json_error(p, sep, "expected `,` or `}`");
+    }
+    p->next++;
+    if (p->buf[sep] == '}') { break; }
+    at = skip_ws(p, sep + 1);
+  }
+  p->last_size[depth] = map_count(get_dict(d));
+  return d;
+}
+
+/* Parse the value starting at byte `at` */
+lval *
+parse_value(json_parser *p, size_t at, int depth)
+{
+  if (depth > MAXDEPTH) { return json_error(p, at, "nested too deeply"); }
+  size_t next = peek_index(p);
+  if (at >= p->len) { return json_error(p, at, "expected a value"); }
+  if (next == at) {
+    char *s;
+    size_t n;
+    lval *err;
+    switch (p->buf[at]) {
+    case '{': return parse_object(p, depth);
+    case '[': return parse_array(p, depth);
+    case '"':
+      if ((err = parse_string(p, &s, &n))) { return err; }
+      return lval_stringn(s, n);
+    default:
+      return json_error(p, at, "expected a value");
+    }
+  }
+  return parse_scalar(p, at, next);
+}
+
+/* Parse a complete JSON document held in `buf` */
+lval *
+json_read(char *buf, size_t len)
+{
+  if (len > UINT32_MAX) { return lval_err("ERROR: JSON input larger than 4 GB!"); }
+  json_parser p = {0};
+  p.buf = buf;
+  p.len = len;
+  p.cap = len / 8 + 16; // Grown as stage 1 finds more
+  p.index = malloc(p.cap * sizeof(uint32_t));
+  build_index(&p);
+
+  lval *v = parse_value(&p, skip_ws(&p, 0), 0);
+  if (get_type(v) != LVAL_ERR) {
+    // A bare scalar document has already been checked up to the end
+    size_t end = p.next ? skip_ws(&p, p.index[p.next - 1] + 1) : len;
+    if (p.next != p.count || end != len) {
+      lval_del(v);
+      v = json_error(&p, p.next < p.count ? p.index[p.next] : end, "trailing characters");
+    }
+  }
+  free(p.index);
+  free(p.scratch);
+  return v;
+}
+
+lval *
+json_read_file(char *fname)
+{
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) { return lval_err("ERROR: Could not open file `%s`!", fname); }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return lval_err("ERROR: Could not open file `%s`!", fname);
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return json_read("", 0);
+  }
+  char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED) { return lval_err("ERROR: Could not read file `%s`!", fname); }
+  madvise(buf, st.st_size, MADV_SEQUENTIAL);
+  lval *v = json_read(buf, st.st_size);
+  munmap(buf, st.st_size);
+  return v;
+}
+
+// Writing
+
+void
+writer_flush(json_writer *w)
+{
+  if (w->file && w->len) {
+    if (fwrite(w->buf, 1, w->len, w->file) != w->len) { w->failed = true; }
+    w->len = 0;
+  }
+}
+
+void
+writer_reserve(json_writer *w, size_t n)
+{
+  if (w->len + n <= w->cap) { return; }
+  writer_flush(w);
+  while (w->len + n > w->cap) { w->cap *= 2; }
+  w->buf = realloc(w->buf, w->cap);
+}
+
+void
+writer_put(json_writer *w, char *s, size_t n)
+{
+  writer_reserve(w, n);
+  memcpy(w->buf + w->len, s, n);
+  w->len += n;
+}
+
+void
+writer_string(json_writer *w, char *s)
+{
+  writer_put(w, "\"", 1);
+  char *run = s; // Bytes that need no escaping are copied in one go
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c != '"' && c != '\\' && c >= 0x20) { continue; }
+    writer_put(w, run, s - run);
+    char esc[7];
+    switch (c) {
+    case '"': writer_put(w, "\\\"", 2); break;
+    case '\\': writer_put(w, "\\\\", 2); break;
+    case '\n': writer_put(w, "\\n", 2); break;
+    case '\r': writer_put(w, "\\r", 2); break;
+    case '\t': writer_put(w, "\\t", 2); break;
+    default:
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      writer_put(w, esc, 6);
+    }
+    run = s + 1;
+  }
+  writer_put(w, run, s - run);
+  writer_put(w, "\"", 1);
+}
+
+lval *
+writer_value(json_writer *w, lval *v, int depth)
+{
+  if (depth > MAXDEPTH) { return lval_err("ERROR: Value nested too deeply for JSON!"); }
+  char num[24];
+  lval *err;
+  switch (get_type(v)) {
+  case LVAL_NUM:
+    writer_put(w, num, snprintf(num, sizeof(num), "%ld", get_num(v)));
+    return NULL;
+  case LVAL_BOOL:
+    if (get_bool(v)) { writer_put(w, "true", 4); } else { writer_put(w, "false", 5); }
+    return NULL;
+  case LVAL_STRING:
+    writer_string(w, get_string(v));
+    return NULL;
+  case LVAL_SYM:
+    writer_string(w, get_sym(v));
+    return NULL;
+  case LVAL_SEXP:
+    writer_put(w, "[", 1);
+    for (list *l = get_cell(v); l; l = list_rest(l)) {
+      if ((err = writer_value(w, list_first(l), depth + 1))) { return err; }
+      if (list_rest(l)) { writer_put(w, ",", 1); }
+    }
+    writer_put(w, "]", 1);
+    return NULL;
+  case LVAL_VECTOR:
+    writer_put(w, "[", 1);
+    for (size_t i = 0; i < vec_count(get_vec(v)); i++) {
+      if (i) { writer_put(w, ",", 1); }
+      if ((err = writer_value(w, vec_nth(get_vec(v), i), depth + 1))) { return err; }
+    }
+    writer_put(w, "]", 1);
+    return NULL;
+  case LVAL_DICT: {
+    size_t i = 0;
+    lval *key, *val;
+    bool first = true;
+    writer_put(w, "{", 1);
+    while (map_next(get_dict(v), &i, &key, &val)) {
+      if (!first) { writer_put(w, ",", 1); }
+      first = false;
+      if (get_type(key) == LVAL_STRING || get_type(key) == LVAL_SYM) {
+	writer_string(w, get_type(key) == LVAL_STRING ? get_string(key) : get_sym(key));
+      } else { // JSON keys must be strings
+	port *p = port_string();
+	lval_write(p, key);
+	writer_string(w, port_contents(p, NULL));
+	port_delete(p);
+      }
+      writer_put(w, ":", 1);
+      if ((err = writer_value(w, val, depth + 1))) { return err; }
+    }
+    writer_put(w, "}", 1);
+    return NULL;
+  }
+  default:
+    return lval_err("ERROR: Cannot write a value of type %s as JSON!",
+		    ltype_name(get_type(v)));
+  }
+}
+
+/* Encode `v` as a JSON string */
+lval *
+json_write(lval *v)
+{
+  json_writer w = {0};
+  w.cap = 256;
+  w.buf = malloc(w.cap);
+  lval *err = writer_value(&w, v, 0);
+  lval *result = err ? err : lval_stringn(w.buf, w.len);
+  free(w.buf);
+  return result;
+}
+
+lval *
+json_write_file(lval *v, char *fname)
+{
+  json_writer w = {0};
+  if (!(w.file = fopen(fname, "wb"))) {
+    return lval_err("ERROR: Could not open file `%s`!", fname);
+  }
+  w.cap = WRITEBUF;
+  w.buf = malloc(w.cap);
+  lval *err = writer_value(&w, v, 0);
+  writer_flush(&w);
+  if (fclose(w.file) != 0) { w.failed = true; }
+  free(w.buf);
+  if (err) { return err; }
+  if (w.failed) { return lval_err("ERROR: Could not write file `%s`!", fname); }
+  return lval_bool(true);
+}
@@ -0,0 +1,13 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stddef.h>
+
+#include "structs.h"
+
+lval *json_read(char *buf, size_t len);
+lval *json_read_file(char *fname);
+lval *json_write(lval *v);
+lval *json_write_file(lval *v, char *fname);
+
+#endif
@@ -5,8 +5,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include "list.h"
 #include "lval.h"
+#include "image.h"
+#include "port.h"
+#include "memstats.h"
+#include "region.h"
 typedef struct list list;
 
 struct list {
@@ -17,7 +22,8 @@ struct list {
 list *
 list_new(lval *data, list *next)
 {
-  list *x = calloc(1, sizeof(list));
+  list *x = region_calloc(sizeof(list));
+  MEM_ALLOC(MEM_LIST, 1);
   x->data = data;
   x->next = next;
   return x;
@@ -26,42 +32,121 @@ list_new(lval *data, list *next)
 list *
 list_copy(list *l)
 {
-  if (!l) return NULL;
-  return list_new(lval_copy(list_first(l)), list_copy(list_rest(l)));
+  list *head = NULL, **tail = &head;
+  for (; l; l = list_rest(l)) { tail = list_snoc(tail, lval_copy(list_first(l))); }
+  return head;
 }
 
 int
 list_count(list *l)
 {
-  if (!l) return 0;
-  return 1 + list_count(list_rest(l));
+  int n = 0;
+  for (; l; l = list_rest(l)) { n++; }
+  return n;
 }
 
+/* Copy the nodes of `l` being promoted out of the region, and promote their elements */
+list *
+list_promote(list *l)
+{
+  list *head = NULL, **tail = &head;
+  size_t n = 0;
+  void *copy;
+  for (; l && region_moving(l); l = l->next, n++) {
+    if (region_seen(l, &copy)) {
+      l = copy;
+      break;
+    }
+    list *x = region_alloc(sizeof(list));
+    MEM_ALLOC(MEM_LIST, 1);
+    region_forward(l, x);
+    x->data = l->data;
+    *tail = x;
+    tail = &x->next;
+  }
+  *tail = l; // The rest was already out of the region
+  list *x = head;
+  for (size_t i = 0; i < n; i++, x = x->next) { x->data = lval_promote(x->data); }
+  return head;
+}
+
+size_t list_sizeof(void) { return sizeof(list); }
+
 void
 list_delete(list *l)
 {
-  if (!l) { return; }
-  list_delete(list_rest(l));
-  lval_del(list_first(l));
-  free(l);
+  while (l) {
+    list *next = l->next;
+    lval_del(list_first(l));
+    if (image_free(l)) { MEM_FREE(MEM_LIST, 1); }
+    l = next;
+  }
 }
 
-lval *list_first(list *l) {return l->data;}
-list *list_rest(list *l) {return l->next;}
-list *list_cons(lval *e, list *l) {return list_new(e, l);}
-
+/* Free the nodes of `l`, but not their elements */
 void
-print_helper(list *l)
+list_free(list *l)
+{
+  while (l) {
+    list *next = l->next;
+    if (image_free(l)) { MEM_FREE(MEM_LIST, 1); }
+    l = next;
+  }
+}
+
+/* Copy the nodes of `l` and their elements into an image */
+size_t
+list_image_dump(image *im, list *l)
 {
-  if (l) {
-    print_lval(list_first(l));
-    if (list_rest(l)) { putchar(' '); }
-    print_helper(list_rest(l));
+  size_t head = 0, prev = 0, off;
+  for (; l; l = list_rest(l)) {
+    bool seen = image_seen(im, l, &off);
+    if (!seen) { off = image_alloc(im, l, sizeof(list)); }
+    if (prev) {
+      image_ptr(im, prev + offsetof(list, next), off);
+    } else {
+      head = off;
+    }
+    if (seen) { break; } // The rest of the list is already in the image
+    image_ptr(im, off + offsetof(list, data), lval_image_dump(im, list_first(l)));
+    prev = off;
   }
+  return head;
+}
+
+/* Reverse `l` in place, returning the new head */
+list *
+list_reverse(list *l)
+{
+  list *prev = NULL;
+  while (l) {
+    list *next = l->next;
+    l->next = prev;
+    prev = l;
+    l = next;
+  }
+  return prev;
+}
+
+/* Put `e` at `*tail`, the end of a list being built, and return the new end */
+list **
+list_snoc(list **tail, lval *e)
+{
+  *tail = list_new(e, NULL);
+  return &(*tail)->next;
 }
 
+lval *list_first(list *l) {return l->data;}
+list *list_rest(list *l) {return l->next;}
+list *list_cons(lval *e, list *l) {return list_new(e, l);}
+
 void
 list_print(list *l)
 {
-  print_helper(l);
+  port *out = port_stdout();
+  for (; l; l = list_rest(l)) {
+    lval_write(out, list_first(l));
+    if (list_rest(l)) { port_putc(out, ' '); }
+  }
+  port_flush(out);
 }
@@ -1,16 +1,25 @@
 #ifndef LIST_H
 #define LIST_H
 
+#include <stddef.h>
+
 #include "structs.h"
 
 list *list_new(lval *data, list *next);
 void list_delete(list *l);
+void list_free(list *l);
 list *list_copy(list *l);
+list *list_promote(list *l);
 void list_print(list *l);
 
 lval *list_first(list *l);
 list *list_rest(list *l);
 list *list_cons(lval * e, list *l);
+list **list_snoc(list **tail, lval *e);
 int list_count(list *l);
+size_t list_sizeof(void);
+list *list_reverse(list *l);
+
+size_t list_image_dump(image *im, list *l);
 
 #endif
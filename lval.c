@@ -1,28 +1,44 @@
 #include "lval.h"
 #include "list.h"
-#include "mpc/mpc.h"
 #include "environment.h"
 #include "map.h"
+#include "btree.h"
+#include "vector.h"
 #include "builtin.h"
+#include "image.h"
+#include "port.h"
+#include "memstats.h"
+#include "profile.h"
+#include "budget.h"
+#include "hashcons.h"
+#include "region.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdbool.h> // for boolean values
 
 #define MAXERR 1024 // Maximum error string length
 #define MAXSTR 1024 // Maximum string length
+#define MAXARGV 8 // Arguments evaluated without allocating
 
 
 struct lval { // lisp value
   int type;
+  int line; // The line a sexp was read from
 
   /* Basic */
   long num;
   bool boolean;
+  bool interned; // Shared by hash-consing, so never changed or freed alone
+  bool view; // A string borrowing its bytes, which it doesn't free
+  unsigned mark; // Last hashcons_collect to reach it
   char* err;
   char* sym;
+  char *name; // The variable a function was defined as, or a struct type's name. Owned
+  char *file; // The file a sexp was read from. Shared, and never freed
 
   /* Function/Macro */
   lbuiltin builtin;
@@ -36,10 +52,20 @@ struct lval { // lisp value
   /* Dict */
   map *dict;
 
+  union {
+    btree *tree; // Sorted map
+    vec *vec; // Vector
+  };
+
   /* String */
   char *str;
+
+  /* Record: `num` fields, allocated along with the lval */
+  lval *field[];
 };
 
+size_t lval_sizeof(void) { return sizeof(lval); }
+
 char * /* Given an lval type, return its name */
 ltype_name(int t)
 {
@@ -53,77 +79,165 @@ ltype_name(int t)
   case LVAL_BOOL: return "bool";
   case LVAL_DICT: return "dict";
   case LVAL_STRING: return "string";
+  case LVAL_SORTED: return "sorted";
+  case LVAL_RECORD: return "record";
+  case LVAL_VECTOR: return "vector";
   default: return "unknown";
   }
 }
 
 // CONSTRUCTORS
+
+/* A counted copy of the `len` bytes at `s`, with a NUL after them, from the region if one is open */
+char *
+str_alloc(char *s, size_t len)
+{
+  char *c = region_alloc(len + 1);
+  MEM_ALLOC(MEM_BYTES, len + 1);
+  memcpy(c, s, len);
+  c[len] = '\0';
+  return c;
+}
+
+lval * // All lvals are allocated here, so they can be counted by type
+lval_new(int type)
+{
+  lval *v = region_calloc(sizeof(lval));
+  v->type = type;
+  MEM_ALLOC(type, 1);
+  return v;
+}
+
+/*
+   A record holds `n` fields after the lval itself. Its `formals` is the
+   struct type, which is a record too: one with no type, whose fields
+   are the field names and whose `name` is the struct's name.
+*/
+lval *
+lval_record(lval *type, int n)
+{
+  lval *v = region_calloc(sizeof(lval) + n * sizeof(lval *));
+  v->type = LVAL_RECORD;
+  v->formals = type;
+  v->num = n;
+  MEM_ALLOC(LVAL_RECORD, 1);
+  MEM_ALLOC(MEM_BYTES, n * sizeof(lval *));
+  return v;
+}
+
+lval * // create a struct type called `name`, with `n` field names to fill in
+lval_struct(char *name, int n)
+{
+  lval *v = lval_record(NULL, n);
+  v->name = str_alloc(name, strlen(name));
+  return v;
+}
+
 lval *
 lval_num(long x) // create new number
 {
-  lval *v = calloc(1, sizeof(lval));
-  v->type = LVAL_NUM;
+  lval *v = lval_new(LVAL_NUM);
   v->num = x;
-  return v;
+  return hashconsing ? hashcons(v) : v;
 }
 
 lval *
 lval_string(char *str)
 {
-  lval *v = calloc(1, sizeof(lval));
-  v->type = LVAL_STRING;
-  v->str = malloc(strlen(str) + 1);
-  v->str = strcpy(v->str, str);
+  lval *v = lval_new(LVAL_STRING);
+  v->str = str_alloc(str, strlen(str));
+  return hashconsing ? hashcons(v) : v;
+}
+
+lval * // create new string from the first `len` bytes of `str`
+lval_stringn(char *str, size_t len)
+{
+  lval *v = lval_new(LVAL_STRING);
+  v->str = str_alloc(str, len);
+  return hashconsing ? hashcons(v) : v;
+}
+
+lval * // create a string borrowing `str` while its region is open. Promoting it copies `str`
+lval_string_view(char *str)
+{
+  lval *v = lval_new(LVAL_STRING);
+  v->str = str;
+  v->view = true;
   return v;
 }
 
 lval *
 lval_dict(void)
 {
-  lval *v = calloc(1, sizeof(lval));
-  v->type = LVAL_DICT;
-  v->dict = map_new();
+  return lval_dict_sized(0);
+}
+
+lval * // create new dict with room for `n` keys
+lval_dict_sized(size_t n)
+{
+  lval *v = lval_new(LVAL_DICT);
+  v->dict = map_new_sized(n);
+  return v;
+}
+
+lval * // create new empty sorted map
+lval_sorted(void)
+{
+  lval *v = lval_new(LVAL_SORTED);
+  v->tree = btree_new();
   return v;
 }
 
+lval *
+lval_vector(vec *v)
+{
+  lval *x = lval_new(LVAL_VECTOR);
+  x->vec = v;
+  return x;
+}
+
 lval *
 lval_bool(bool boolean)
 {
-  lval *v = calloc(1, sizeof(lval));
-  v->type = LVAL_BOOL;
+  lval *v = lval_new(LVAL_BOOL);
   v->boolean = boolean;
-  return v;
+  return hashconsing ? hashcons(v) : v;
 }
 
 lval *
 lval_err(char *fmt, ...) // create new error
 {
-  lval *v = calloc(1, sizeof(lval));
+  lval *v = lval_new(LVAL_ERR);
+  char buf[MAXERR];
   va_list ap;
   va_start(ap, fmt);
-  v->err = calloc(1, MAXERR * sizeof(char));
-  vsnprintf(v->err, MAXERR, fmt, ap);
+  vsnprintf(buf, MAXERR, fmt, ap);
   va_end(ap);
-  v->type = LVAL_ERR;
+  v->err = str_alloc(buf, strlen(buf));
   return v;
 }
 
 lval *
 lval_sym(char *sym) // create new symbol
 {
-  lval *v = calloc(1, sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = calloc(1, strlen(sym) + 1);
-  strcpy(v->sym, sym);
-  return v;
+  lval *v = lval_new(LVAL_SYM);
+  v->sym = str_alloc(sym, strlen(sym));
+  return hashconsing ? hashcons(v) : v;
+}
+
+lval * // create new symbol from the first `len` bytes of `sym`
+lval_symn(char *sym, size_t len)
+{
+  lval *v = lval_new(LVAL_SYM);
+  v->sym = str_alloc(sym, len);
+  return hashconsing ? hashcons(v) : v;
 }
 
 // Returns a user-defined function w/ env, formals and body
 lval *
 lval_lambda(lenv *env, lval *formals, lval *body)
 {
-  lval *v = calloc(1, sizeof(lval));
-  v->type = LVAL_FN;
+  lval *v = lval_new(LVAL_FN);
   v->builtin = NULL; // no builtin, this is a user defined func
   v->formals = formals;
   v->body = body;
@@ -134,16 +248,17 @@ lval_lambda(lenv *env, lval *formals, lval *body)
 lval *
 lval_macro(lenv *e, lval *formals, lval *body) // create new user-defined macro
 {
-  lval *v = lval_lambda(e, formals, body);
-  v->type = LVAL_MACRO;
+  lval *v = lval_new(LVAL_MACRO);
+  v->formals = formals;
+  v->body = body;
+  v->env = e;
   return v;
 }
 
 lval *
 lval_builtin_function(lenv *e, lbuiltin fn)
 {
-  lval *v = calloc(1, sizeof(lval));
-  v->type = LVAL_FN;
+  lval *v = lval_new(LVAL_FN);
   v->formals = NULL;
   v->body = NULL;
   v->env = e;
@@ -154,28 +269,101 @@ lval_builtin_function(lenv *e, lbuiltin fn)
 lval *
 lval_builtin_macro(lenv *e, lbuiltin fn) // create new empty macro
 {
-  lval *v = lval_builtin_function(e, fn);
-  v->type = LVAL_MACRO;
+  lval *v = lval_new(LVAL_MACRO);
+  v->env = e;
+  v->builtin = fn;
   return v;
 }
 
+// Hash-consing
+
+bool is_interned(lval *v) { return v->interned; }
+void lval_set_interned(lval *v, bool interned) { v->interned = interned; }
+
+/* Mark `v` as reached in collection `epoch`, returning false if it already was */
+bool
+lval_mark(lval *v, unsigned epoch)
+{
+  if (v->mark == epoch) { return false; }
+  v->mark = epoch;
+  return true;
+}
+
+/* Free `v` but not its elements, which may be interned themselves */
+void
+lval_free_node(lval *v)
+{
+  if (v->type == LVAL_SEXP) {
+    list_free(v->cell);
+    v->cell = NULL;
+  }
+  v->interned = false;
+  lval_del(v);
+}
+
+/* Give a record read before its type was known the struct type `type` */
+void lval_set_struct(lval *r, lval *type) { r->formals = type; }
+
+/* Give a vector read before its items were known its items */
+void lval_set_vec(lval *v, vec *items) { v->vec = items; }
+
+/* Name a function after the variable it is defined as, with a copy of `name` */
+void
+lval_set_name(lval *fn, char *name)
+{
+  if (fn->name && image_free(fn->name)) { MEM_FREE(MEM_BYTES, strlen(fn->name) + 1); }
+  bool outside = !region_contains(fn); // Then the copy must outlive the region
+  if (outside) { region_pause(); }
+  fn->name = str_alloc(name, strlen(name));
+  if (outside) { region_resume(); }
+}
+
+/* Record where a sexp was read from. `file` must outlive it, as source_name's do */
+void
+lval_set_source(lval *v, char *file, int line)
+{
+  v->file = file;
+  v->line = line;
+}
+
+/* Fill in a user-defined function created before its parts were known */
+void
+lval_set_fn(lval *fn, lenv *e, lval *formals, lval *body)
+{
+  fn->env = e;
+  fn->formals = formals;
+  fn->body = body;
+}
+
 lval *
 lval_sexp(void) // create new empty sexp
 {
-  lval *v = calloc(1, sizeof(lval));
-  v->type = LVAL_SEXP;
+  lval *v = lval_new(LVAL_SEXP);
   v->cell = NULL;
   return v;
 }
 
+lval * // create new sexp that takes ownership of `cell`
+lval_sexp_of(list *cell)
+{
+  lval *v = lval_sexp();
+  v->cell = cell;
+  return v;
+}
+
 void
 lval_del(lval *v) // free memory for an lval
 {
+  if (v->interned) { return; } // Others may hold it
   switch(v->type) {
   case LVAL_DICT:
     map_delete(v->dict);
     break;
+  case LVAL_SORTED:
+    btree_delete(v->tree);
+    break;
   case LVAL_NUM:
+  case LVAL_VECTOR: // Its nodes may be shared, so they are kept
     break;
   case LVAL_MACRO:
   case LVAL_FN:
@@ -184,32 +372,52 @@ lval_del(lval *v) // free memory for an lval
       lval_del(v->formals);
       lval_del(v->body);
     }
+    if (v->name) {
+      size_t n = strlen(v->name) + 1;
+      if (image_free(v->name)) { MEM_FREE(MEM_BYTES, n); }
+    }
     break;
-  case LVAL_ERR:
-    free(v->err);
+  case LVAL_ERR: {
+    size_t n = strlen(v->err) + 1;
+    if (image_free(v->err)) { MEM_FREE(MEM_BYTES, n); }
     break;
-  case LVAL_SYM:
-    free(v->sym);
+  }
+  case LVAL_SYM: {
+    size_t n = strlen(v->sym) + 1;
+    if (image_free(v->sym)) { MEM_FREE(MEM_BYTES, n); }
     break;
+  }
   case LVAL_SEXP:
     list_delete(v->cell);
     break;
-  case LVAL_STRING:
-    free(v->str);
+  case LVAL_STRING: {
+    size_t n = strlen(v->str) + 1;
+    if (!v->view && image_free(v->str)) { MEM_FREE(MEM_BYTES, n); }
     break;
   }
-  free(v);
+  case LVAL_RECORD: // Fields may be shared, so they are kept
+    if (!v->formals) { return; } // Struct types are shared by their records
+    if (!image_contains(v) && !region_owns(v)) { MEM_FREE(MEM_BYTES, v->num * sizeof(lval *)); }
+    break;
+  }
+  int type = v->type;
+  if (image_free(v)) { MEM_FREE(type, 1); }
 }
 
 lval *
 lval_copy(lval *v)
 {
-  lval *x;
+  if (v->interned) { return v; } // Immutable, so it can be shared
+  lval *x = NULL;
   switch (v->type) {
   case LVAL_DICT:
-    x = lval_dict();
+    x = lval_new(LVAL_DICT);
     x->dict = map_copy(v->dict);
     break;
+  case LVAL_SORTED:
+    x = lval_new(LVAL_SORTED);
+    x->tree = btree_copy(v->tree);
+    break;
   case LVAL_BOOL:
     x = lval_bool(v->boolean);
     break;
@@ -222,6 +430,7 @@ lval_copy(lval *v)
     } else {
       x = lval_macro(lenv_copy(v->env), lval_copy(v->formals), lval_copy(v->body));
     }
+    if (v->name) { lval_set_name(x, v->name); }
     break;
   case LVAL_FN:
     if (v->builtin) {
@@ -229,9 +438,10 @@ lval_copy(lval *v)
     } else {
       x = lval_lambda(lenv_copy(v->env), lval_copy(v->formals), lval_copy(v->body));
     }
+    if (v->name) { lval_set_name(x, v->name); }
     break;
   case LVAL_ERR:
-    x = lval_err(v->err);
+    x = lval_err("%s", v->err);
     break;
   case LVAL_SYM:
     x = lval_sym(get_sym(v));
@@ -239,10 +449,79 @@ lval_copy(lval *v)
   case LVAL_SEXP:
     x = lval_sexp();
     x->cell = list_copy(v->cell);
+    lval_set_source(x, v->file, v->line);
     break;
   case LVAL_STRING:
     x = lval_string(v->str);
     break;
+  case LVAL_RECORD:
+    if (!v->formals) { return v; } // A struct type is known by its address
+    x = lval_record(v->formals, v->num);
+    memcpy(x->field, v->field, v->num * sizeof(lval *));
+    break;
+  case LVAL_VECTOR: // Immutable, so the copy shares it
+    x = lval_vector(v->vec);
+    break;
+  }
+  return x;
+}
+
+/* A copy of `s` if it is being promoted, or if `view` says `v` doesn't own it */
+char *
+promote_string(char *s, bool view)
+{
+  return s && (view || region_moving(s)) ? str_alloc(s, strlen(s)) : s;
+}
+
+/*
+   A copy of `v`, if it is being promoted out of the region, and of
+   everything in the region it points to. Only called by region.c while
+   it promotes, which decides where the copies go.
+*/
+lval *
+lval_promote(lval *v)
+{
+  void *copy;
+  if (!v || !region_moving(v)) { return v; }
+  if (region_seen(v, &copy)) { return copy; }
+  size_t size = sizeof(lval) + (v->type == LVAL_RECORD ? v->num * sizeof(lval *) : 0);
+  lval *x = region_alloc(size);
+  memcpy(x, v, size);
+  MEM_ALLOC(v->type, 1);
+  if (v->type == LVAL_RECORD) { MEM_ALLOC(MEM_BYTES, v->num * sizeof(lval *)); }
+  region_forward(v, x);
+  x->err = promote_string(v->err, false);
+  x->sym = promote_string(v->sym, false);
+  x->name = promote_string(v->name, false);
+  x->str = promote_string(v->str, v->view); // A view's bytes won't outlive the call, so it gets its own
+  x->view = false;
+  switch (v->type) {
+  case LVAL_SEXP:
+    x->cell = list_promote(v->cell);
+    break;
+  case LVAL_FN:
+  case LVAL_MACRO:
+    x->env = list_promote(v->env);
+    x->formals = lval_promote(v->formals);
+    x->body = lval_promote(v->body);
+    break;
+  case LVAL_DICT:
+    x->dict = map_promote(v->dict);
+    break;
+  case LVAL_SORTED: { // The tree is on the heap, but may hold lvals in the region
+    x->tree = btree_new();
+    bcursor c = btree_first(v->tree);
+    lval *key, *val;
+    while (btree_next(&c, &key, &val)) { btree_put(x->tree, lval_promote(key), lval_promote(val)); }
+    break;
+  }
+  case LVAL_VECTOR: // Only the nodes made in the region are copied; the rest are shared
+    x->vec = vec_promote(v->vec);
+    break;
+  case LVAL_RECORD:
+    x->formals = lval_promote(v->formals);
+    for (long i = 0; i < v->num; i++) { x->field[i] = lval_promote(v->field[i]); }
+    break;
   }
   return x;
 }
@@ -250,7 +529,8 @@ lval_copy(lval *v)
 bool
 lval_equal(lval *x, lval *y)
 {
-  if (get_type(x) != get_type(y)) { return lval_bool(false); }
+  if (x == y) { return true; } // Always the case for hash-consed values
+  if (get_type(x) != get_type(y)) { return false; }
   switch (get_type(x)) {
   case LVAL_BOOL:
     return get_bool(x) == get_bool(y);
@@ -264,16 +544,13 @@ lval_equal(lval *x, lval *y)
   case LVAL_SYM:
     return strcmp(get_sym(x), get_sym(y)) == 0;
     break;
-  case LVAL_SEXP:
-    if (get_count(x) == 0 && get_count(y) == 0) {
-      return true;
-    } else if (get_count(x) == 0 || get_count(y) == 0) {
-      return false;
-    } else {
-      return lval_equal(lval_first(x), lval_first(y)) &&
-	lval_equal(lval_rest(x), lval_rest(y));
+  case LVAL_SEXP: {
+    list *a = x->cell, *b = y->cell;
+    for (; a && b; a = list_rest(a), b = list_rest(b)) {
+      if (!lval_equal(list_first(a), list_first(b))) { return false; }
     }
-    break;
+    return !a && !b;
+  }
   case LVAL_MACRO:
   case LVAL_FN:
     if (x->builtin && y->builtin) {
@@ -285,57 +562,231 @@ lval_equal(lval *x, lval *y)
       return false;
     }
     break;
-  case LVAL_DICT:
-    return false; // TODO fix this
-    break;
+  case LVAL_DICT: { // Equal pairs, in any order
+    if (map_count(x->dict) != map_count(y->dict)) { return false; }
+    size_t i = 0;
+    lval *k, *v, *other;
+    while (map_next(x->dict, &i, &k, &v)) {
+      if (!(other = map_get(y->dict, k)) || !lval_equal(v, other)) { return false; }
+    }
+    return true;
+  }
   case LVAL_STRING:
     return strcmp(x->str, y->str) == 0;
+  case LVAL_SORTED: {
+    if (btree_count(x->tree) != btree_count(y->tree)) { return false; }
+    bcursor cx = btree_first(x->tree), cy = btree_first(y->tree);
+    lval *kx, *vx, *ky, *vy;
+    while (btree_next(&cx, &kx, &vx) && btree_next(&cy, &ky, &vy)) {
+      if (!lval_equal(kx, ky) || !lval_equal(vx, vy)) { return false; }
+    }
+    return true;
+  }
+  case LVAL_VECTOR:
+    if (vec_count(x->vec) != vec_count(y->vec)) { return false; }
+    for (size_t i = 0; i < vec_count(x->vec); i++) {
+      if (!lval_equal(vec_nth(x->vec, i), vec_nth(y->vec, i))) { return false; }
+    }
+    return true;
+  case LVAL_RECORD: // Struct types by name and field names, records by type and fields
+    if (!x->formals != !y->formals || x->num != y->num) { return false; }
+    if (x->formals ? !lval_equal(x->formals, y->formals) : strcmp(x->name, y->name) != 0) {
+      return false;
+    }
+    for (long i = 0; i < x->num; i++) {
+      if (!lval_equal(x->field[i], y->field[i])) { return false; }
+    }
+    return true;
   }
   return false;
 }
 
+/*
+   Order two lvals, returning <0, 0 or >0 like strcmp. Numbers compare
+   by value and strings, symbols and errors by their bytes. Values of
+   different types are ordered by type, so any keys can share a sorted
+   map. Other types are only equal when they are the same lval.
+*/
+int
+lval_compare(lval *x, lval *y)
+{
+  if (x->type != y->type) { return x->type < y->type ? -1 : 1; }
+  switch (x->type) {
+  case LVAL_NUM: return (x->num > y->num) - (x->num < y->num);
+  case LVAL_BOOL: return x->boolean - y->boolean;
+  case LVAL_STRING: return strcmp(x->str, y->str);
+  case LVAL_SYM: return strcmp(x->sym, y->sym);
+  case LVAL_ERR: return strcmp(x->err, y->err);
+  default: return (x > y) - (x < y);
+  }
+}
+
+// PRINTING
+
+typedef struct print_task print_task;
+
+struct print_task { // One pending piece of output
+  enum { PRINT_LVAL, PRINT_TEXT, PRINT_LIST, PRINT_DICT, PRINT_SORTED, PRINT_RECORD, PRINT_VECTOR } kind;
+  lval *v; // PRINT_LVAL
+  char *text; // PRINT_TEXT
+  list *cur; // PRINT_LIST: the elements left
+  map *dict; // PRINT_DICT
+  size_t pos; // PRINT_DICT: iteration position, PRINT_RECORD: field, PRINT_VECTOR: index
+  bcursor cursor; // PRINT_SORTED
+  bool first;
+};
+
+typedef struct print_stack {
+  print_task *tasks;
+  int count;
+  int cap;
+} print_stack;
+
 void
-print_lval(lval *v)
+push_task(print_stack *s, print_task t)
 {
-  if (!v) { printf("print_lval recieved `NULL`\n"); return; }
-  switch (v->type) {
-  case LVAL_DICT:
-    map_print(v->dict);
-    break;
-  case LVAL_NUM: printf("%li", v->num); break;
-  case LVAL_MACRO:
-    if (v->builtin) {
-      printf("<builtin macro>");
-    } else {
-      //print_lval(v->env);
-      printf("(macro "); print_lval(v->formals);
-      putchar(' '); print_lval(v->body); putchar(')');
+  if (s->count == s->cap) {
+    s->cap *= 2;
+    s->tasks = realloc(s->tasks, s->cap * sizeof(print_task));
+  }
+  s->tasks[s->count++] = t;
+}
+
+void push_lval(print_stack *s, lval *v) { push_task(s, (print_task){PRINT_LVAL, .v = v}); }
+void push_text(print_stack *s, char *t) { push_task(s, (print_task){PRINT_TEXT, .text = t}); }
+
+/*
+   Write the printed form of `v` to `p`. Nested values are handled
+   with an explicit stack, so depth and length cost no C stack.
+*/
+void
+lval_write(port *p, lval *v)
+{
+  print_stack s = {malloc(16 * sizeof(print_task)), 0, 16};
+  char num[24];
+  push_lval(&s, v);
+  while (s.count) {
+    print_task t = s.tasks[--s.count];
+    switch (t.kind) {
+    case PRINT_TEXT:
+      port_puts(p, t.text);
+      continue;
+    case PRINT_LIST: // Tasks are pushed in reverse of the order they print
+      if (list_rest(t.cur)) {
+	push_task(&s, (print_task){PRINT_LIST, .cur = list_rest(t.cur)});
+	push_text(&s, " ");
+      }
+      push_lval(&s, list_first(t.cur));
+      continue;
+    case PRINT_DICT: {
+      lval *key, *val;
+      if (!map_next(t.dict, &t.pos, &key, &val)) { continue; }
+      push_task(&s, (print_task){PRINT_DICT, .dict = t.dict, .pos = t.pos});
+      push_lval(&s, val);
+      push_text(&s, " : ");
+      push_lval(&s, key);
+      if (!t.first) { push_text(&s, ", "); }
+      continue;
     }
-    break;
-  case LVAL_FN:
-    if (v->builtin) {
-      printf("<builtin fn>");
-    } else {
-      printf("(\\ "); print_lval(v->formals);
-      putchar(' '); print_lval(v->body); putchar(')');
+    case PRINT_SORTED: {
+      lval *key, *val;
+      if (!btree_next(&t.cursor, &key, &val)) { continue; }
+      push_task(&s, (print_task){PRINT_SORTED, .cursor = t.cursor});
+      push_lval(&s, val);
+      push_text(&s, " : ");
+      push_lval(&s, key);
+      if (!t.first) { push_text(&s, ", "); }
+      continue;
+    }
+    case PRINT_RECORD: {
+      if (t.pos == get_num(t.v)) { continue; }
+      push_task(&s, (print_task){PRINT_RECORD, .v = t.v, .pos = t.pos + 1});
+      push_lval(&s, t.v->field[t.pos]);
+      push_text(&s, " : ");
+      push_lval(&s, t.v->formals->field[t.pos]);
+      if (t.pos) { push_text(&s, ", "); }
+      continue;
+    }
+    case PRINT_VECTOR:
+      if (t.pos == vec_count(t.v->vec)) { continue; }
+      push_task(&s, (print_task){PRINT_VECTOR, .v = t.v, .pos = t.pos + 1});
+      push_lval(&s, vec_nth(t.v->vec, t.pos));
+      if (t.pos) { push_text(&s, " "); }
+      continue;
+    case PRINT_LVAL:
+      break;
+    }
+
+    v = t.v;
+    if (!v) { port_puts(p, "<NULL>"); continue; }
+    switch (v->type) {
+    case LVAL_DICT:
+      port_putc(p, '{');
+      push_text(&s, "}");
+      push_task(&s, (print_task){PRINT_DICT, .dict = v->dict, .first = true});
+      break;
+    case LVAL_SORTED:
+      port_puts(p, "#sorted{");
+      push_text(&s, "}");
+      push_task(&s, (print_task){PRINT_SORTED, .cursor = btree_first(v->tree), .first = true});
+      break;
+    case LVAL_VECTOR:
+      port_puts(p, "#[");
+      push_text(&s, "]");
+      push_task(&s, (print_task){PRINT_VECTOR, .v = v});
+      break;
+    case LVAL_RECORD:
+      port_putc(p, '#');
+      if (!v->formals) { // A struct type
+	port_puts(p, "struct ");
+	port_puts(p, v->name);
+	break;
+      }
+      port_puts(p, v->formals->name);
+      port_putc(p, '{');
+      push_text(&s, "}");
+      push_task(&s, (print_task){PRINT_RECORD, .v = v});
+      break;
+    case LVAL_NUM:
+      port_write(p, num, snprintf(num, sizeof(num), "%li", v->num));
+      break;
+    case LVAL_MACRO:
+    case LVAL_FN:
+      if (v->builtin) {
+	port_puts(p, v->type == LVAL_FN ? "<builtin fn>" : "<builtin macro>");
+      } else {
+	port_puts(p, v->type == LVAL_FN ? "(\\ " : "(macro ");
+	push_text(&s, ")");
+	push_lval(&s, v->body);
+	push_text(&s, " ");
+	push_lval(&s, v->formals);
+      }
+      break;
+    case LVAL_ERR: port_puts(p, v->err); break;
+    case LVAL_SYM: port_puts(p, v->sym); break;
+    case LVAL_SEXP:
+      port_putc(p, '(');
+      push_text(&s, ")");
+      if (v->cell) { push_task(&s, (print_task){PRINT_LIST, .cur = v->cell}); }
+      break;
+    case LVAL_BOOL:
+      port_puts(p, v->boolean ? "true" : "false");
+      break;
+    case LVAL_STRING:
+      port_putc(p, '"');
+      port_puts(p, v->str);
+      port_putc(p, '"');
+      break;
     }
-    break;
-  case LVAL_ERR: printf(v->err); break;
-  case LVAL_SYM: printf(v->sym); break;
-  case LVAL_SEXP:
-    putchar('(');
-    list_print(v->cell); // print the internal linked list of lvals
-    printf(")");
-    break;
-  case LVAL_BOOL:
-    if (v->boolean)
-      printf("true");
-    else printf("false");
-    break;
-  case LVAL_STRING:
-    printf("\"%s\"", v->str);
-    break;
   }
+  free(s.tasks);
+}
+
+void
+print_lval(lval *v)
+{
+  lval_write(port_stdout(), v);
+  port_flush(port_stdout());
 }
 
 // FUNCTIONS
@@ -354,11 +805,9 @@ lval *lval_rest(lval *l)
 lval * /* Get nth element of l, 0-indexed */
 lval_nth(lval *l, int n)
 {
-  if (n == 0) {
-    return lval_first(l);
-  } else {
-    return lval_nth(lval_rest(l), n - 1);
-  }
+  list *c = l->cell;
+  while (n-- > 0) { c = list_rest(c); }
+  return list_first(c);
 }
 
 lval * // append x to list v
@@ -369,35 +818,79 @@ lval_cons(lval *v, lval *x)
 }
 
 lval *
-lval_call(lenv *e, lval* fn, lval *args)
+lval_apply(lenv *e, lval* fn, lval *args)
 {
   if (fn->builtin) return fn->builtin(e, args);
-  //lenv *new_e = fn->env;
   lenv *new_e = lenv_new(fn->env);
-  lval *formals = fn->formals;
-  while (!is_empty(args)) {
-    if (is_empty(formals)) {
+  list *formals = fn->formals->cell; // Walked in place, without a sexp per step
+  for (list *a = args->cell; a; a = list_rest(a), formals = list_rest(formals)) {
+    if (!formals) {
       return lval_err("ERROR: Function passed too many arguments.");
     }
-    lenv_set(new_e, lval_first(formals), lval_first(args));
-    formals = lval_rest(formals);
-    args = lval_rest(args);
+    lenv_set(new_e, list_first(formals), list_first(a));
   }
-  if (is_empty(formals)) {
+  if (!formals) {
     return lval_eval(new_e, fn->body);
   } else { // this allows currying:
-    return lval_lambda(new_e, formals, fn->body);
+    return lval_lambda(new_e, lval_sexp_of(formals), fn->body);
   }
 }
 
+/* Call `fn` with its frame on the profiler's call stack, tracing it if asked */
+lval *
+lval_call(lenv *e, lval *fn, lval *args)
+{
+  CALL_PUSH(fn);
+  if (tracing) { trace_enter(fn); }
+  lval *result = lval_apply(e, fn, args);
+  if (tracing) { trace_exit(); }
+  CALL_POP();
+  return result;
+}
+
+/*
+   Call `fn` on the `n` values in `argv`. A lambda taking exactly `n`
+   arguments has them bound straight into its frame, with no argument
+   list built; anything else goes through lval_call.
+*/
+lval *
+lval_call_n(lenv *e, lval *fn, int n, lval **argv)
+{
+  int nformals = 0;
+  if (!fn->builtin) {
+    for (list *f = fn->formals->cell; f && nformals <= n; f = list_rest(f)) { nformals++; }
+  }
+  if (fn->builtin || nformals != n) {
+    lval *args = lval_sexp();
+    for (int i = n - 1; i >= 0; i--) { lval_cons(args, argv[i]); }
+    return lval_call(e, fn, args);
+  }
+  CALL_PUSH(fn);
+  if (tracing) { trace_enter(fn); }
+  lenv *new_e = lenv_new(fn->env);
+  list *f = fn->formals->cell;
+  for (int i = 0; i < n; i++, f = list_rest(f)) { lenv_set(new_e, list_first(f), argv[i]); }
+  lval *result = lval_eval(new_e, fn->body);
+  if (tracing) { trace_exit(); }
+  CALL_POP();
+  return result;
+}
+
 lval *
 lval_eval_sexp(lenv *e, lval *s)
 {
   if (is_empty(s)) { return s; } // Return `()`
+  if (--budget_ticks < 0) {
+    lval *err = budget_tick();
+    if (err) { return err; }
+  }
   lval *first = lval_eval(e, lval_first(s));
   if (get_type(first) == LVAL_MACRO) {
+    lenv *outer = first->env;
     first->env = e; // Give macros access to the current environment
-    return lval_call(e, first, lval_rest(s));
+    lval *result = lval_call(e, first, lval_rest(s));
+    first->env = outer; // `e` may be released with its region, and the macro not
+    return result;
   }
   if (get_type(first) == LVAL_ERR) { return first; }
   if (get_type(first) != LVAL_FN) {
@@ -405,14 +898,27 @@ lval_eval_sexp(lenv *e, lval *s)
 		    ltype_name(get_type(first)));
   }
   // Now we know we have a function as the first element
-  lval *rest = lval_rest(s);
-  lval *children = lval_sexp();
-  for (int i = get_count(rest) - 1; i >= 0; i--) {
-    lval *child = lval_eval(e, lval_nth(rest, i));
-    if (get_type(child) == LVAL_ERR) { return child; } // check for errors
-    lval_cons(children, child); // accumulate evalled children
+  // Arguments are evaluated last first, from the stack unless there are many
+  lval *small[MAXARGV], **argv = small;
+  int n = 0;
+  for (list *l = list_rest(get_cell(s)); l; l = list_rest(l)) {
+    if (n == MAXARGV && argv == small) {
+      argv = malloc(get_count(s) * sizeof(lval *));
+      memcpy(argv, small, sizeof(small));
+    }
+    argv[n++] = list_first(l);
   }
-
+  lval *children = lval_sexp(), *err = NULL;
+  while (n-- > 0 && !err) {
+    lval *child = lval_eval(e, argv[n]);
+    if (get_type(child) == LVAL_ERR) { // check for errors
+      err = child;
+    } else {
+      lval_cons(children, child); // accumulate evalled children
+    }
+  }
+  if (argv != small) { free(argv); }
+  if (err) { return err; }
   return lval_call(e, first, children);
 }
 
@@ -456,13 +962,62 @@ lval_put(lval *dict, lval *name, lval *v)
 }
 
 
+// IMAGE
+
+/* Copy `v` and everything it points to into an image */
+size_t
+lval_image_dump(image *im, lval *v)
+{
+  size_t off;
+  if (!v) { return 0; }
+  if (image_seen(im, v, &off)) { return off; }
+  size_t fields = v->type == LVAL_RECORD ? v->num : 0;
+  off = image_alloc(im, v, sizeof(lval) + fields * sizeof(lval *));
+  image_ptr(im, off + offsetof(lval, err), image_string(im, v->err));
+  image_ptr(im, off + offsetof(lval, sym), image_string(im, v->sym));
+  image_ptr(im, off + offsetof(lval, str), image_string(im, v->str));
+  image_ptr(im, off + offsetof(lval, name), image_string(im, v->name));
+  image_ptr(im, off + offsetof(lval, file), image_string(im, v->file));
+  image_builtin(im, off + offsetof(lval, builtin), v->builtin);
+  image_ptr(im, off + offsetof(lval, env), list_image_dump(im, v->env));
+  image_ptr(im, off + offsetof(lval, formals), lval_image_dump(im, v->formals));
+  image_ptr(im, off + offsetof(lval, body), lval_image_dump(im, v->body));
+  image_ptr(im, off + offsetof(lval, cell), list_image_dump(im, v->cell));
+  if (v->dict) {
+    image_ptr(im, off + offsetof(lval, dict), map_image_dump(im, v->dict));
+  }
+  if (v->type == LVAL_SORTED) {
+    image_ptr(im, off + offsetof(lval, tree), btree_image_dump(im, v->tree));
+  }
+  if (v->type == LVAL_VECTOR) {
+    image_ptr(im, off + offsetof(lval, vec), vec_image_dump(im, v->vec));
+  }
+  for (size_t i = 0; i < fields; i++) {
+    image_ptr(im, off + offsetof(lval, field) + i * sizeof(lval *), lval_image_dump(im, v->field[i]));
+  }
+  return off;
+}
+
 // Accessor
 
-int get_num(lval *l) {return l->num;}
+long get_num(lval *l) {return l->num;}
 bool get_bool(lval *l) {return l->boolean;}
 char *get_sym(lval *l) {return l->sym;}
 int get_type(lval *l) {return l->type;}
 int get_count(lval *l){ return list_count(l->cell); }
-bool is_empty(lval *l){ return list_count(l->cell) == 0; }
+bool is_empty(lval *l){ return l->cell == NULL; }
 lenv *get_env(lval *fn) { return fn->env; }
 char *get_string(lval *l) { return l->str; }
+char *get_err(lval *l) { return l->err; }
+lbuiltin get_builtin(lval *fn) { return fn->builtin; }
+lval *get_formals(lval *fn) { return fn->formals; }
+lval *get_body(lval *fn) { return fn->body; }
+list *get_cell(lval *l) { return l->cell; }
+map *get_dict(lval *l) { return l->dict; }
+btree *get_tree(lval *l) { return l->tree; }
+vec *get_vec(lval *l) { return l->vec; }
+lval *get_struct(lval *r) { return r->formals; }
+lval **get_fields(lval *r) { return r->field; }
+char *get_name(lval *fn) { return fn->name; }
+char *get_file(lval *l) { return l->file; }
+int get_line(lval *l) { return l->line; }
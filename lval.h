@@ -1,22 +1,29 @@
 #ifndef CORE_H
 #define CORE_H
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "structs.h"
 
 enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_SEXP,
        LVAL_MACRO, LVAL_FN, LVAL_BOOL, LVAL_DICT,
-       LVAL_STRING };
+       LVAL_STRING, LVAL_SORTED, LVAL_RECORD, LVAL_VECTOR };
 
 void lval_del(lval *v);
 lval *lval_copy(lval *v);
+lval *lval_promote(lval *v);
 void print_lval(lval *v);
+void lval_write(port *p, lval *v);
 
 // Functions
 
 char *ltype_name(int t);
+size_t lval_sizeof(void);
 lval *lval_eval(lenv *e, lval *v);
+lval *lval_call(lenv *e, lval *fn, lval *args);
+lval *lval_call_n(lenv *e, lval *fn, int n, lval **argv);
 bool lval_equal(lval *x, lval *y);
+int lval_compare(lval *x, lval *y);
 
 lval *lval_first(lval *l);
 lval *lval_rest(lval *l);
@@ -27,26 +34,51 @@ lval *lval_cons(lval *v, lval *x);
 // Constructor
 
 lval *lval_sexp(void);
+lval *lval_sexp_of(list *cell);
 lval *lval_num(long x);
 lval *lval_bool(bool x);
 lval *lval_dict(void);
+lval *lval_dict_sized(size_t n);
+lval *lval_sorted(void);
+lval *lval_record(lval *type, int n);
+lval *lval_vector(vec *v);
+lval *lval_struct(char *name, int n);
 lval *lval_sym(char *sym);
+lval *lval_symn(char *sym, size_t len);
 lval *lval_err(char *fmt, ...);
 lval *lval_string(char *str);
+lval *lval_stringn(char *str, size_t len);
+lval *lval_string_view(char *str);
 
 lval *lval_lambda(lenv *e, lval *formals, lval *body);
 lval *lval_macro(lenv *e, lval *formals, lval *body);
 lval *lval_builtin_function(lenv *e, lbuiltin fn);
 lval *lval_builtin_macro(lenv *e, lbuiltin fn);
+void lval_set_fn(lval *fn, lenv *e, lval *formals, lval *body);
+void lval_set_name(lval *fn, char *name);
+void lval_set_source(lval *v, char *file, int line);
+void lval_set_struct(lval *r, lval *type);
+void lval_set_vec(lval *v, vec *items);
+
+// Hash-consing
+
+bool is_interned(lval *v);
+void lval_set_interned(lval *v, bool interned);
+bool lval_mark(lval *v, unsigned epoch);
+void lval_free_node(lval *v);
 
 // Dict
 
 lval *lval_get(lval *d, lval *name);
 lval *lval_put(lval *d, lval *name, lval *v);
 
+// Image
+
+size_t lval_image_dump(image *im, lval *v);
+
 // Accessor
 
-int get_num(lval *l);
+long get_num(lval *l);
 bool get_bool(lval *l);
 int get_count(lval *l);
 bool is_empty(lval *l);
@@ -55,6 +87,19 @@ int get_type(lval *l);
 lenv *get_env(lval *fn);
 int get_count(lval *l);
 char *get_string(lval *l);
+char *get_err(lval *l);
+lbuiltin get_builtin(lval *fn);
+lval *get_formals(lval *fn);
+lval *get_body(lval *fn);
+list *get_cell(lval *l);
+map *get_dict(lval *l);
+btree *get_tree(lval *l);
+vec *get_vec(lval *l);
+lval *get_struct(lval *r);
+lval **get_fields(lval *r);
+char *get_name(lval *fn);
+char *get_file(lval *l);
+int get_line(lval *l);
 
 // MACROS ////////////////////////////////////////////////////////////////////////////////
 
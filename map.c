@@ -1,124 +1,244 @@
 /*
-  Simple hash table of lvals
- */
+  Hash table of lvals
+
+  Entries live in a dense array in insertion order, which is the
+  order iteration sees them in. A separate open-addressing index of
+  entry numbers, kept with Robin Hood probing, finds them by hash.
+  Removing a key marks its entry dead and backward-shifts the index,
+  so there are no tombstones. Dead entries are squeezed out when the
+  entry array next grows.
+*/
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
-#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #include "map.h"
 #include "list.h"
 #include "environment.h"
 #include "lval.h"
-#define ARRAYSIZE 1024
-#define MAXKEY 256 // Max key length
+#include "btree.h"
+#include "vector.h"
+#include "image.h"
+#include "port.h"
+#include "memstats.h"
+#include "region.h"
+
+#define MINSLOTS 8 // Index size of a new map
+#define EMPTY UINT32_MAX // Index slot with no entry
 
-struct map { // hash map with chaining
-  list **data; // Array of list pointers
-  list *keys;
+typedef struct entry entry;
+
+struct entry {
+  lval *key; // NULL once removed
+  lval *val;
+  uint64_t hash;
 };
 
-int
-hash(lval *key)
-{
-  int h = 1;
-  char *keystr = get_sym(key);
-  int keylen = strlen(keystr);
+struct map {
+  entry *entries;
+  uint32_t nentries; // Used entries, dead ones included
+  uint32_t count; // Live entries
+  uint32_t entry_cap;
+  uint32_t *index; // Entry numbers, or EMPTY
+  uint32_t mask; // Index size - 1
+  bool inline_entries, inline_index; // Allocated along with the map, so not freed alone
+};
 
-  char c;
-  for (int i = 0; i < keylen; i++) {
-    c = keystr[i];
-    h = h + ((i + 12) * c);
-    i++;
-  }
-  h = abs(943287 * h) % ARRAYSIZE;
-  assert(h >= 0);
+uint64_t
+mix(uint64_t h) // Finalizer from MurmurHash3
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
   return h;
 }
 
-// List helper functions
+uint64_t
+hash_string(char *s)
+{
+  uint64_t h = 14695981039346656037ull; // FNV-1a
+  for (; *s; s++) { h = (h ^ (unsigned char)*s) * 1099511628211ull; }
+  return h;
+}
 
-/* Remove an lval by key from a list of key/value pairs */
-list *
-list_remove_pair(list *l, lval *k)
+/*
+   Keys of any type can be hashed; lvals that are lval_equal always hash
+   the same. Lists, dicts and sorted maps are hashed by their contents,
+   dicts without regard to order, functions by their code and records
+   by their type and fields.
+*/
+uint64_t
+lval_hash(lval *key)
 {
-  if (!l) { return l; }
-  lval *list_key = lval_first(list_first(l));
-  // if the sym `k` and the sym in the current node are equal:
-  if (lval_equal(list_key, k)) {
-    return list_rest(l);
-  } else {
-    return list_cons(list_first(l), list_remove_pair(list_rest(l), k));
+  uint64_t h = 0;
+  lval *k, *v;
+  switch (get_type(key)) {
+  case LVAL_SYM: h = hash_string(get_sym(key)); break;
+  case LVAL_STRING: h = hash_string(get_string(key)); break;
+  case LVAL_ERR: h = hash_string(get_err(key)); break;
+  case LVAL_NUM: h = get_num(key); break;
+  case LVAL_BOOL: h = get_bool(key); break;
+  case LVAL_SEXP:
+    for (list *l = get_cell(key); l; l = list_rest(l)) { h = h * 31 + lval_hash(list_first(l)); }
+    break;
+  case LVAL_VECTOR:
+    for (size_t i = 0; i < vec_count(get_vec(key)); i++) { h = h * 31 + lval_hash(vec_nth(get_vec(key), i)); }
+    break;
+  case LVAL_DICT: {
+    size_t i = 0;
+    while (map_next(get_dict(key), &i, &k, &v)) { h += mix(lval_hash(k) ^ (lval_hash(v) << 1)); }
+    break;
+  }
+  case LVAL_SORTED: {
+    bcursor c = btree_first(get_tree(key));
+    while (btree_next(&c, &k, &v)) { h = h * 31 + (lval_hash(k) ^ (lval_hash(v) << 1)); }
+    break;
+  }
+  case LVAL_FN:
+  case LVAL_MACRO:
+    if (get_builtin(key)) { h = (uintptr_t)get_builtin(key); }
+    else { h = lval_hash(get_formals(key)) * 31 + lval_hash(get_body(key)); }
+    break;
+  case LVAL_RECORD: // By name, not address, so hashes stay right in a loaded image
+    h = hash_string(get_name(get_struct(key) ? get_struct(key) : key));
+    if (!get_struct(key)) { break; }
+    for (long i = 0; i < get_num(key); i++) { h = h * 31 + lval_hash(get_fields(key)[i]); }
+    break;
   }
+  return mix(h ^ ((uint64_t)get_type(key) << 56));
 }
 
-list *
-list_remove(list *l, lval *v)
+uint32_t ideal_slot(map *m, uint64_t h) { return h & m->mask; }
+uint32_t probe_distance(map *m, uint32_t slot, uint64_t h) { return (slot - h) & m->mask; }
+
+/* Index slot holding `key`, or EMPTY */
+uint32_t
+find_slot(map *m, lval *key, uint64_t h)
 {
-  if (!l) { return l; }
-  char *list_key = get_sym(list_first(l));
-  if (strcmp(list_key, get_sym(v)) == 0) {
-    return list_rest(l);
-  } else {
-    return list_cons(list_first(l), list_remove(list_rest(l), v));
+  uint32_t slot = ideal_slot(m, h);
+  for (uint32_t dist = 0; ; dist++, slot = (slot + 1) & m->mask) {
+    uint32_t i = m->index[slot];
+    if (i == EMPTY) { return EMPTY; }
+    entry *e = &m->entries[i];
+    // Robin Hood order: past the point where our key would have been placed
+    if (probe_distance(m, slot, e->hash) < dist) { return EMPTY; }
+    if (e->hash == h && lval_equal(e->key, key)) { return slot; }
   }
 }
 
+void
+index_insert(map *m, uint32_t i)
+{
+  uint64_t h = m->entries[i].hash;
+  uint32_t slot = ideal_slot(m, h);
+  for (uint32_t dist = 0; ; dist++, slot = (slot + 1) & m->mask) {
+    uint32_t other = m->index[slot];
+    if (other == EMPTY) {
+      m->index[slot] = i;
+      return;
+    }
+    uint32_t other_dist = probe_distance(m, slot, m->entries[other].hash);
+    if (other_dist < dist) { // Take from the rich
+      m->index[slot] = i;
+      i = other;
+      dist = other_dist;
+    }
+  }
+}
 
-lval *
-list_get(list *l, lval *k)
-{
-  if (!l) { return NULL; }
-  lval *head = list_first(l);
-  if (lval_equal(lval_first(head), k)) {
-    return lval_first(lval_rest(list_first(l)));
-  } else {
-    return list_get(list_rest(l), k);
+/* Rebuild the index at `slots` slots, dropping dead entries */
+void
+rehash(map *m, uint32_t slots)
+{
+  uint32_t live = 0;
+  for (uint32_t i = 0; i < m->nentries; i++) {
+    if (m->entries[i].key) { m->entries[live++] = m->entries[i]; }
   }
+  m->nentries = live;
+  if (!m->inline_index) { image_free(m->index); }
+  m->inline_index = false;
+  m->index = region_alloc_near(m, slots * sizeof(uint32_t));
+  memset(m->index, 0xff, slots * sizeof(uint32_t));
+  m->mask = slots - 1;
+  for (uint32_t i = 0; i < m->nentries; i++) { index_insert(m, i); }
 }
 
+/* A map with room for `n` keys before it has to grow */
 map *
-map_new(void)
+map_new_sized(size_t n)
 {
-  map *m = calloc(1, sizeof(map));
-  m->data = calloc(ARRAYSIZE, sizeof(list *));
-  m->keys = NULL;
+  uint32_t slots = MINSLOTS;
+  while (slots - slots / 4 < n) { slots *= 2; } // Load factor 3/4
+  uint32_t entry_cap = slots - slots / 4;
+  // One allocation for the map and its first tables, since most maps never grow
+  map *m = region_calloc(sizeof(map) + entry_cap * sizeof(entry) + slots * sizeof(uint32_t));
+  MEM_ALLOC(MEM_MAP, 1);
+  m->entry_cap = entry_cap;
+  m->entries = (entry *)(m + 1);
+  m->index = (uint32_t *)(m->entries + entry_cap);
+  m->inline_entries = m->inline_index = true;
+  memset(m->index, 0xff, slots * sizeof(uint32_t));
+  m->mask = slots - 1;
   return m;
 }
 
-map *
+map *map_new(void) { return map_new_sized(0); }
+
+map * /* Shallow copy: keys and values are shared */
 map_copy(map *m)
 {
-  map *x = map_new();
-  list *keys = m->keys;
-  while (keys) {
-    map_add(x, list_first(keys), map_get(m, list_first(keys)));
-    keys = list_rest(keys);
-  }
+  map *x = map_new_sized(m->count);
+  size_t i = 0;
+  lval *k, *v;
+  while (map_next(m, &i, &k, &v)) { map_add(x, k, v); }
   return x;
 }
 
+/* A copy of `m` out of the region if it is being promoted, with its keys and values promoted */
+map *
+map_promote(map *m)
+{
+  if (!region_moving(m)) { return m; }
+  map *x = map_new_sized(m->count);
+  size_t i = 0;
+  lval *k, *v;
+  while (map_next(m, &i, &k, &v)) { map_add(x, lval_promote(k), lval_promote(v)); }
+  return x;
+}
+
+/* Free the table itself. Keys and values may be shared, so they are kept */
 void
 map_delete(map *m)
 {
-  list *l = m->keys;
-  while (l) {
-    map_remove(m, list_first(l));
-    l = list_rest(l);
-  }
-  free(m->data);
-  list_delete(m->keys);
-  free(m);
+  if (!m->inline_entries) { image_free(m->entries); }
+  if (!m->inline_index) { image_free(m->index); }
+  if (image_free(m)) { MEM_FREE(MEM_MAP, 1); }
 }
 
 /* Remove a key:value pair from the map */
 void
 map_remove(map *m, lval *key)
 {
-  m->keys = list_remove(m->keys, key);
-  m->data[hash(key)] = list_remove_pair(m->data[hash(key)], key);
+  uint32_t slot = find_slot(m, key, lval_hash(key));
+  if (slot == EMPTY) { return; }
+  m->entries[m->index[slot]].key = NULL;
+  m->entries[m->index[slot]].val = NULL;
+  m->count--;
+  // Shift the rest of the cluster back so lookups never hit a hole
+  uint32_t next = (slot + 1) & m->mask;
+  while (m->index[next] != EMPTY
+	 && probe_distance(m, next, m->entries[m->index[next]].hash) > 0) {
+    m->index[slot] = m->index[next];
+    slot = next;
+    next = (next + 1) & m->mask;
+  }
+  m->index[slot] = EMPTY;
 }
 
 /*
@@ -128,14 +248,31 @@ map_remove(map *m, lval *key)
 void
 map_add(map *m, lval *key, lval *val)
 {
-  if (map_contains(m, key)) { map_remove(m, key); }
-  int h = hash(key);
-  // The pair is stored as a 2-element linked list:
-  lval *pair = lval_sexp();
-  lval_cons(pair, val);
-  lval_cons(pair, key);
-  m->data[h] = list_cons(pair, m->data[h]);
-  m->keys = list_cons(key, m->keys);
+  uint64_t h = lval_hash(key);
+  uint32_t slot = find_slot(m, key, h);
+  if (slot != EMPTY) {
+    m->entries[m->index[slot]].val = val;
+    return;
+  }
+  if (m->nentries == m->entry_cap) {
+    if (m->count + 1 > m->entry_cap / 2) { // Otherwise dropping dead entries is enough
+      m->entry_cap *= 2;
+      entry *entries = region_alloc_near(m, m->entry_cap * sizeof(entry));
+      memcpy(entries, m->entries, m->nentries * sizeof(entry));
+      if (!m->inline_entries) { image_free(m->entries); }
+      m->inline_entries = false;
+      m->entries = entries;
+    }
+    rehash(m, m->mask + 1);
+  }
+  uint32_t slots = m->mask + 1;
+  if (m->count + 1 > slots - slots / 4) { rehash(m, 2 * slots); } // Load factor 3/4
+  uint32_t i = m->nentries++;
+  m->entries[i].key = key;
+  m->entries[i].val = val;
+  m->entries[i].hash = h;
+  m->count++;
+  index_insert(m, i);
 }
 
 /* Wrapper around map_get that returns a bool */
@@ -144,23 +281,64 @@ bool map_contains(map *m, lval *key) { return map_get(m, key) != NULL; }
 lval *
 map_get(map *m, lval *key)
 {
-  list *l = m->data[hash(key)];
-  if (!l) { return NULL; }
-  return list_get(l, key); // returns NULL if key isn't found/list is NULL
+  uint32_t slot = find_slot(m, key, lval_hash(key));
+  return slot == EMPTY ? NULL : m->entries[m->index[slot]].val;
 }
 
+size_t map_count(map *m) { return m->count; }
+
+/*
+   Iterate over the map in insertion order. Start with `*i` at 0; each
+   call stores the next pair and returns false when there are no more.
+*/
+bool
+map_next(map *m, size_t *i, lval **key, lval **val)
+{
+  while (*i < m->nentries) {
+    entry *e = &m->entries[(*i)++];
+    if (e->key) {
+      *key = e->key;
+      *val = e->val;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Copy `m`, its entries and its index into an image */
+size_t
+map_image_dump(image *im, map *m)
+{
+  size_t off;
+  if (image_seen(im, m, &off)) { return off; }
+  off = image_alloc(im, m, sizeof(map));
+  size_t entries = image_alloc(im, m->entries, m->entry_cap * sizeof(entry));
+  for (uint32_t i = 0; i < m->nentries; i++) {
+    size_t at = entries + i * sizeof(entry);
+    image_ptr(im, at + offsetof(entry, key), lval_image_dump(im, m->entries[i].key));
+    image_ptr(im, at + offsetof(entry, val), lval_image_dump(im, m->entries[i].val));
+  }
+  image_ptr(im, off + offsetof(map, entries), entries);
+  image_ptr(im, off + offsetof(map, index),
+	    image_alloc(im, m->index, (m->mask + 1) * sizeof(uint32_t)));
+  return off;
+}
 
 void
 map_print(map *m)
 {
-  list *keys = m->keys;
-  printf("{");
-  while (keys) {
-    print_lval(list_first(keys));
-    printf(" : ");
-    print_lval(map_get(m, list_first(keys)));
-    keys = list_rest(keys);
-    if (keys) { printf(", "); }
+  port *out = port_stdout();
+  size_t i = 0;
+  lval *k, *v;
+  bool first = true;
+  port_putc(out, '{');
+  while (map_next(m, &i, &k, &v)) {
+    if (!first) { port_puts(out, ", "); }
+    lval_write(out, k);
+    port_puts(out, " : ");
+    lval_write(out, v);
+    first = false;
   }
-  printf("}\n");
+  port_puts(out, "}\n");
+  port_flush(out);
 }
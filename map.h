@@ -1,16 +1,27 @@
 #ifndef MAP_H
 #define MAP_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "structs.h"
 
 map *map_new(void);
+map *map_new_sized(size_t n);
 void map_delete(map *m);
 map *map_copy(map *m);
+map *map_promote(map *m);
 void map_print(map *m);
 
 void map_add(map *m, lval *key, lval *val);
 lval *map_get(map *m, lval *key);
 bool map_contains(map *m, lval *key);
 void map_remove(map *m, lval *key);
+size_t map_count(map *m);
+uint64_t lval_hash(lval *key);
+bool map_next(map *m, size_t *i, lval **key, lval **val);
+
+size_t map_image_dump(image *im, map *m);
 
 #endif
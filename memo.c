@@ -0,0 +1,202 @@
+/*
+  Memoization
+
+  (memo f) returns a function taking the same arguments as `f`, which
+  calls `f` only for arguments it hasn't seen. Arguments are compared
+  with lval_equal, through the structural lval_hash, so lists and dicts
+  work as well as numbers.
+
+  Each wrapped function gets a cache of at most `size` results, which
+  are evicted with the CLOCK algorithm: a hit sets an entry's reference
+  bit, and the hand passes over and clears set bits until it finds a
+  clear one to evict.
+
+  As with load-native, the wrapper is an ordinary lambda calling the
+  memo-call builtin, so it survives images and fasl. Caches are looked
+  up by the wrapped function and kept per thread, so a copy in another
+  interpreter or thread starts with an empty one. Since they outlive
+  the form that fills them, caches are kept on the heap, and so are
+  the functions, arguments and results in them.
+*/
+
+#include "memo.h"
+#include "lval.h"
+#include "map.h"
+#include "builtin.h"
+#include "region.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+typedef struct memo {
+  lval *fn;
+  map *index; // Arguments to slot number
+  lval **keys;
+  lval **vals;
+  bool *ref;
+  long size;
+  long count;
+  long hand;
+  long hits, misses;
+} memo;
+
+// Caches by function, with open addressing
+__thread memo **memos = NULL;
+__thread size_t nmemos = 0, memo_slots = 0;
+
+memo *
+memo_new(lval *fn, long size)
+{
+  memo *m = calloc(1, sizeof(memo));
+  m->fn = fn;
+  m->index = map_new();
+  m->size = size;
+  m->keys = calloc(size, sizeof(lval *));
+  m->vals = calloc(size, sizeof(lval *));
+  m->ref = calloc(size, sizeof(bool));
+  return m;
+}
+
+size_t
+memo_slot(memo **table, size_t slots, lval *fn)
+{
+  size_t i = ((uintptr_t)fn >> 4) & (slots - 1);
+  while (table[i] && table[i]->fn != fn) { i = (i + 1) & (slots - 1); }
+  return i;
+}
+
+/* The cache for `fn` in this thread, or NULL */
+memo *
+memo_find(lval *fn)
+{
+  return memo_slots ? memos[memo_slot(memos, memo_slots, fn)] : NULL;
+}
+
+memo *
+memo_get(lval *fn, long size)
+{
+  memo *m = memo_find(fn);
+  if (m) { return m; }
+  if (2 * (nmemos + 1) > memo_slots) { // Load factor 1/2
+    size_t slots = memo_slots ? 2 * memo_slots : 16;
+    memo **table = calloc(slots, sizeof(memo *));
+    for (size_t i = 0; i < memo_slots; i++) {
+      if (memos[i]) { table[memo_slot(table, slots, memos[i]->fn)] = memos[i]; }
+    }
+    free(memos);
+    memos = table;
+    memo_slots = slots;
+  }
+  m = memo_new(fn, size);
+  memos[memo_slot(memos, memo_slots, fn)] = m;
+  nmemos++;
+  return m;
+}
+
+/* Slot for a new entry, evicting one if the cache is full */
+long
+memo_evict(memo *m)
+{
+  if (m->count < m->size) { return m->count++; }
+  while (m->ref[m->hand]) {
+    m->ref[m->hand] = false;
+    m->hand = (m->hand + 1) % m->size;
+  }
+  long slot = m->hand;
+  m->hand = (m->hand + 1) % m->size;
+  map_remove(m->index, m->keys[slot]);
+  return slot;
+}
+
+/* Wrap `fn`, a lambda, in a function that remembers up to `size` results */
+lval *
+memo_wrap(lenv *e, lval *fn, long size)
+{
+  if (get_type(fn) != LVAL_FN || get_builtin(fn)) {
+    return lval_err("ERROR: Function `memo` requires a lambda");
+  }
+  if (size < 1) { return lval_err("ERROR: A memo cache needs a size of at least 1"); }
+  fn = region_promote(fn); // Its address names its cache
+
+  // (\ (a0 a1 ...) (memo-call size fn a0 a1 ...))
+  lval *formals = lval_sexp();
+  lval *body = lval_sexp();
+  char arg[16];
+  for (int i = get_count(get_formals(fn)) - 1; i >= 0; i--) {
+    snprintf(arg, sizeof(arg), "a%d", i);
+    lval_cons(formals, lval_sym(arg));
+    lval_cons(body, lval_sym(arg));
+  }
+  lval_cons(body, fn);
+  lval_cons(body, lval_num(size));
+  lval_cons(body, lval_builtin_function(e, builtin_memo_call));
+  return lval_lambda(e, formals, body);
+}
+
+/* Look `args` up in the cache of `fn`, calling it on a miss */
+lval *
+memo_call(lenv *e, lval *fn, long size, lval *args)
+{
+  fn = region_promote(fn);
+  region_pause();
+  memo *m = memo_get(fn, size);
+  region_resume();
+  lval *slot = map_get(m->index, args);
+  if (slot) {
+    m->hits++;
+    m->ref[get_num(slot)] = true;
+    return m->vals[get_num(slot)];
+  }
+  m->misses++;
+  lval *result = lval_call(e, fn, args);
+  if (get_type(result) == LVAL_ERR) { return result; }
+  region_pause();
+  long i = memo_evict(m);
+  m->keys[i] = region_promote(args);
+  m->vals[i] = region_promote(result);
+  m->ref[i] = false;
+  map_add(m->index, m->keys[i], lval_num(i));
+  region_resume();
+  return m->vals[i];
+}
+
+/* Empty every cache in this thread. The counts of hits and misses are kept */
+void
+memo_clear(void)
+{
+  for (size_t i = 0; i < memo_slots; i++) {
+    memo *m = memos[i];
+    if (!m) { continue; }
+    map_delete(m->index);
+    region_pause();
+    m->index = map_new();
+    region_resume();
+    memset(m->ref, 0, m->size * sizeof(bool));
+    m->count = 0;
+    m->hand = 0;
+  }
+}
+
+/* {hits, misses, count, size} for a function returned by memo_wrap */
+lval *
+memo_stats(lval *memoized)
+{
+  lval *body = get_type(memoized) == LVAL_FN && !get_builtin(memoized)
+    ? get_body(memoized) : NULL;
+  if (!body || get_type(body) != LVAL_SEXP || is_empty(body)
+      || get_type(lval_first(body)) != LVAL_FN
+      || get_builtin(lval_first(body)) != builtin_memo_call) {
+    return lval_err("ERROR: Function `memo-stats` requires a memoized function");
+  }
+  lval *fn = lval_nth(body, 2);
+  memo *m = memo_find(fn);
+  lval *d = lval_dict_sized(4);
+  lval_put(d, lval_sym("hits"), lval_num(m ? m->hits : 0));
+  lval_put(d, lval_sym("misses"), lval_num(m ? m->misses : 0));
+  lval_put(d, lval_sym("count"), lval_num(m ? m->count : 0));
+  lval_put(d, lval_sym("size"), lval_num(get_num(lval_nth(body, 1))));
+  return d;
+}
@@ -0,0 +1,13 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include "structs.h"
+
+#define MEMO_SIZE 1024 // Results kept by default
+
+lval *memo_wrap(lenv *e, lval *fn, long size);
+lval *memo_call(lenv *e, lval *fn, long size, lval *args);
+lval *memo_stats(lval *memoized);
+void memo_clear(void);
+
+#endif
@@ -0,0 +1,111 @@
+/*
+  Heap statistics
+
+  Each stat keeps the amount live now, the most that was ever live at
+  once and the total ever allocated. What is allocated in a region is
+  counted as live until the region is released.
+*/
+
+#include "memstats.h"
+#include "lval.h"
+#include "list.h"
+#include "port.h"
+#include "region.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+typedef struct memstat {
+  long live;
+  long peak;
+  long total;
+} memstat;
+
+__thread memstat stats[MEM_NSTATS]; // Per thread, so each interpreter thread counts its own
+
+void
+mem_alloc(int stat, long n)
+{
+  memstat *s = &stats[stat];
+  s->live += n;
+  s->total += n;
+  if (s->live > s->peak) { s->peak = s->live; }
+  region_count(stat, n); // Uncounted when it is released, if it is allocated in one
+}
+
+void mem_free(int stat, long n) { stats[stat].live -= n; }
+long mem_live(int stat) { return stats[stat].live; }
+long mem_peak(int stat) { return stats[stat].peak; }
+
+long // Objects allocated so far, of every kind
+mem_allocs(void)
+{
+  long n = 0;
+  for (int i = 0; i < MEM_BYTES; i++) { n += stats[i].total; }
+  return n;
+}
+
+/* Bytes held by live lvals, list nodes and strings, leaving out maps and trees */
+long
+mem_heap_bytes(void)
+{
+  long n = stats[MEM_BYTES].live + stats[MEM_LIST].live * list_sizeof();
+  for (int i = 0; i < MEM_LVAL_TYPES; i++) { n += stats[i].live * lval_sizeof(); }
+  return n;
+}
+
+char *
+stat_name(int stat)
+{
+  switch (stat) {
+  case MEM_LIST: return "list-nodes";
+  case MEM_MAP: return "maps";
+  case MEM_BYTES: return "string-bytes";
+  default: return ltype_name(stat);
+  }
+}
+
+bool
+stat_used(int stat) // lval types that don't exist are skipped
+{
+  return stat >= MEM_LVAL_TYPES || strcmp(ltype_name(stat), "unknown") != 0;
+}
+
+/* A dict of {live, peak, total} dicts, one per stat */
+lval *
+mem_stats(void)
+{
+#ifdef NMEMSTATS
+  return lval_err("ERROR: Heap statistics were compiled out (NMEMSTATS)");
+#else
+  lval *d = lval_dict_sized(MEM_NSTATS);
+  for (int i = 0; i < MEM_NSTATS; i++) {
+    if (!stat_used(i)) { continue; }
+    lval *s = lval_dict_sized(3);
+    lval_put(s, lval_sym("live"), lval_num(stats[i].live));
+    lval_put(s, lval_sym("peak"), lval_num(stats[i].peak));
+    lval_put(s, lval_sym("total"), lval_num(stats[i].total));
+    lval_put(d, lval_sym(stat_name(i)), s);
+  }
+  return d;
+#endif
+}
+
+/* Write the stats as a table */
+void
+mem_write(port *p)
+{
+#ifdef NMEMSTATS
+  port_puts(p, "Heap statistics were compiled out (NMEMSTATS)\n");
+#else
+  char line[128];
+  port_puts(p, "                    live         peak        total\n");
+  for (int i = 0; i < MEM_NSTATS; i++) {
+    if (!stat_used(i)) { continue; }
+    int n = snprintf(line, sizeof(line), "%-14s %12ld %12ld %12ld\n",
+		     stat_name(i), stats[i].live, stats[i].peak, stats[i].total);
+    port_write(p, line, n);
+  }
+#endif
+}
@@ -0,0 +1,36 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include "structs.h"
+
+/*
+   Counts of live heap objects, kept by the constructors and
+   destructors in lval.c, list.c and map.c, separately for each
+   thread. Build with -DNMEMSTATS to compile the counting out.
+*/
+
+#define MEM_LVAL_TYPES 16 // lvals are counted by type, stats 0 to this
+
+enum { MEM_LIST = MEM_LVAL_TYPES, // List nodes
+       MEM_MAP, // Hash tables
+       MEM_BYTES, // Bytes held by strings, symbols and error buffers
+       MEM_NSTATS };
+
+#ifdef NMEMSTATS
+#define MEM_ALLOC(stat, n) ((void)sizeof(stat), (void)sizeof(n)) // Not evaluated
+#define MEM_FREE(stat, n) ((void)sizeof(stat), (void)sizeof(n))
+#else
+#define MEM_ALLOC(stat, n) mem_alloc(stat, n)
+#define MEM_FREE(stat, n) mem_free(stat, n)
+#endif
+
+void mem_alloc(int stat, long n);
+void mem_free(int stat, long n);
+long mem_live(int stat);
+long mem_peak(int stat);
+long mem_allocs(void);
+long mem_heap_bytes(void);
+lval *mem_stats(void);
+void mem_write(port *p);
+
+#endif
@@ -0,0 +1,255 @@
+/*
+  Calling C from Lisp
+
+  load-native opens a shared object. Given a function name and a
+  signature such as "double(double, double)", it returns a Lisp
+  function that calls the C function through libffi:
+
+    (def pow (load-native "libm.so.6" "pow" "double(double, double)"))
+
+  Argument types are int, long, double, string and buffer. Numbers are
+  passed by value. Strings and buffers pass a pointer to the lval's own
+  bytes, so nothing is copied; a buffer is one the C side may write
+  into, in place, up to its current length. The return type may also be
+  void. Hash-consed strings are shared, so they can't be buffers.
+  There are no floating point lvals, so a double result is
+  truncated to a number.
+
+  The returned function is an ordinary lambda whose body calls
+  native-call with the library, name and signature, so it survives
+  images and fasl like any other function. The symbol and its prepared
+  call are looked up once and cached against the signature lval.
+*/
+
+#include "native.h"
+#include "lval.h"
+#include "builtin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <dlfcn.h>
+#include <ffi.h>
+
+#define MAXARGS 16
+#define CACHESIZE 64 // Prepared calls kept per thread
+
+enum { N_VOID, N_INT, N_LONG, N_DOUBLE, N_STRING, N_BUFFER };
+
+struct ntype {
+  char *name;
+  ffi_type *ffi;
+};
+
+struct ntype ntypes[] = {
+  [N_VOID] = {"void", &ffi_type_void},
+  [N_INT] = {"int", &ffi_type_sint},
+  [N_LONG] = {"long", &ffi_type_slong},
+  [N_DOUBLE] = {"double", &ffi_type_double},
+  [N_STRING] = {"string", &ffi_type_pointer},
+  [N_BUFFER] = {"buffer", &ffi_type_pointer},
+};
+
+#define NTYPES (sizeof(ntypes) / sizeof(ntypes[0]))
+
+typedef struct native_fn {
+  lval *key; // The signature lval this was prepared for
+  char *path, *name, *sig;
+  void *fn;
+  int ret;
+  int nargs;
+  int types[MAXARGS];
+  ffi_type *ffi_args[MAXARGS];
+  ffi_cif cif;
+} native_fn;
+
+__thread native_fn *cache[CACHESIZE];
+
+/* Read a type name at `*s`, or return -1 */
+int
+parse_type(char **s)
+{
+  while (isspace((unsigned char)**s)) { (*s)++; }
+  char *start = *s;
+  while (isalpha((unsigned char)**s)) { (*s)++; }
+  size_t len = *s - start;
+  while (isspace((unsigned char)**s)) { (*s)++; }
+  for (int t = 0; t < NTYPES; t++) {
+    if (strlen(ntypes[t].name) == len && strncmp(ntypes[t].name, start, len) == 0) { return t; }
+  }
+  return -1;
+}
+
+/* Parse "ret(arg, ...)" into `f`. Returns an error message or NULL */
+char *
+parse_signature(native_fn *f, char *sig)
+{
+  char *s = sig;
+  f->ret = parse_type(&s);
+  if (f->ret < 0 || f->ret == N_BUFFER) { return "bad return type"; }
+  if (*s++ != '(') { return "expected `(`"; }
+  f->nargs = 0;
+  char *after = s;
+  if (parse_type(&after) == N_VOID && *after == ')') { s = after; } // f(void)
+  while (*s != ')') {
+    if (f->nargs == MAXARGS) { return "too many arguments"; }
+    int t = parse_type(&s);
+    if (t < 0 || t == N_VOID) { return "bad argument type"; }
+    f->types[f->nargs] = t;
+    f->ffi_args[f->nargs++] = ntypes[t].ffi;
+    if (*s == ',') { s++; }
+    else if (*s != ')') { return "expected `,` or `)`"; }
+  }
+  if (*++s) { return "trailing characters"; }
+  return NULL;
+}
+
+void
+native_fn_delete(native_fn *f)
+{
+  if (!f) { return; }
+  free(f->path);
+  free(f->name);
+  free(f->sig);
+  free(f);
+}
+
+/* Open the library, find the symbol and prepare the call */
+lval *
+native_resolve(char *path, char *name, char *sig, native_fn **out)
+{
+  native_fn *f = calloc(1, sizeof(native_fn));
+  char *msg = parse_signature(f, sig);
+  if (msg) {
+    native_fn_delete(f);
+    return lval_err("ERROR: Bad native signature `%s`: %s", sig, msg);
+  }
+  void *lib = dlopen(path, RTLD_NOW | RTLD_GLOBAL);
+  if (!lib) {
+    native_fn_delete(f);
+    return lval_err("ERROR: Could not load `%s`: %s", path, dlerror());
+  }
+  dlerror();
+  f->fn = dlsym(lib, name);
+  char *err = dlerror();
+  if (err) {
+    native_fn_delete(f);
+    return lval_err("ERROR: Could not find `%s`: %s", name, err);
+  }
+  if (ffi_prep_cif(&f->cif, FFI_DEFAULT_ABI, f->nargs, ntypes[f->ret].ffi,
+		   f->ffi_args) != FFI_OK) {
+    native_fn_delete(f);
+    return lval_err("ERROR: Could not prepare a call to `%s`", name);
+  }
+  f->path = strdup(path);
+  f->name = strdup(name);
+  f->sig = strdup(sig);
+  *out = f;
+  return NULL;
+}
+
+/* The prepared call for this signature lval, resolving it on a miss */
+lval *
+native_lookup(lval *path, lval *name, lval *sig, native_fn **out)
+{
+  native_fn **slot = &cache[((uintptr_t)sig >> 4) % CACHESIZE];
+  native_fn *f = *slot;
+  // The lval may have been freed and its address reused, so check the text too
+  if (f && f->key == sig && strcmp(f->sig, get_string(sig)) == 0
+      && strcmp(f->name, get_string(name)) == 0 && strcmp(f->path, get_string(path)) == 0) {
+    *out = f;
+    return NULL;
+  }
+  lval *err = native_resolve(get_string(path), get_string(name), get_string(sig), &f);
+  if (err) { return err; }
+  f->key = sig;
+  native_fn_delete(*slot);
+  *slot = f;
+  *out = f;
+  return NULL;
+}
+
+/* Open `path` and let it register its own builtins */
+lval *
+native_open(lenv *e, char *path)
+{
+  void *lib = dlopen(path, RTLD_NOW | RTLD_GLOBAL);
+  if (!lib) { return lval_err("ERROR: Could not load `%s`: %s", path, dlerror()); }
+  int (*init)(lenv *) = (int (*)(lenv *))dlsym(lib, NATIVE_INIT);
+  if (init && init(e) != 0) {
+    return lval_err("ERROR: `%s` failed to initialize", path);
+  }
+  return lval_bool(true);
+}
+
+/* A Lisp function calling `name` in `path` */
+lval *
+native_function(lenv *e, char *path, char *name, char *sig)
+{
+  native_fn *f;
+  lval *err = native_resolve(path, name, sig, &f);
+  if (err) { return err; }
+
+  // (\ (a0 a1 ...) (native-call path name sig a0 a1 ...))
+  lval *formals = lval_sexp();
+  lval *body = lval_sexp();
+  char arg[16];
+  for (int i = f->nargs - 1; i >= 0; i--) {
+    snprintf(arg, sizeof(arg), "a%d", i);
+    lval_cons(formals, lval_sym(arg));
+    lval_cons(body, lval_sym(arg));
+  }
+  native_fn_delete(f);
+  lval_cons(body, lval_string(sig));
+  lval_cons(body, lval_string(name));
+  lval_cons(body, lval_string(path));
+  lval_cons(body, lval_builtin_function(e, builtin_native_call));
+  return lval_lambda(e, formals, body);
+}
+
+/* Call the C function with `args`, converted as its signature says */
+lval *
+native_call(lval *path, lval *name, lval *sig, lval *args)
+{
+  native_fn *f;
+  lval *err = native_lookup(path, name, sig, &f);
+  if (err) { return err; }
+  if (get_count(args) != f->nargs) {
+    return lval_err("ERROR: Native function `%s` requires %d argument(s) (passed %d)!",
+		    f->name, f->nargs, get_count(args));
+  }
+
+  union { int i; long l; double d; void *p; } vals[MAXARGS];
+  void *ptrs[MAXARGS];
+  for (int i = 0; i < f->nargs; i++, args = lval_rest(args)) {
+    lval *a = lval_first(args);
+    int want = f->types[i] >= N_STRING ? LVAL_STRING : LVAL_NUM;
+    if (get_type(a) != want) {
+      return lval_err("ERROR: Native function `%s` requires argument %d of type %s (passed %s)!",
+		      f->name, i + 1, ltype_name(want), ltype_name(get_type(a)));
+    }
+    if (f->types[i] == N_BUFFER && is_interned(a)) {
+      return lval_err("ERROR: Native function `%s` can't write into argument %d, a shared string",
+		      f->name, i + 1);
+    }
+    switch (f->types[i]) {
+    case N_INT: vals[i].i = get_num(a); break;
+    case N_LONG: vals[i].l = get_num(a); break;
+    case N_DOUBLE: vals[i].d = get_num(a); break;
+    default: vals[i].p = get_string(a); break;
+    }
+    ptrs[i] = &vals[i];
+  }
+
+  union { ffi_sarg i; double d; char *p; } ret;
+  ffi_call(&f->cif, FFI_FN(f->fn), &ret, ptrs);
+  switch (f->ret) {
+  case N_INT: return lval_num((int)ret.i);
+  case N_LONG: return lval_num((long)ret.i);
+  case N_DOUBLE: return lval_num((long)ret.d);
+  case N_STRING: return ret.p ? lval_string(ret.p) : lval_sexp();
+  default: return lval_sexp();
+  }
+}
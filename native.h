@@ -0,0 +1,20 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include "structs.h"
+
+/*
+   A shared library can add its own builtins by exporting
+
+     int byol_init(lenv *e);
+
+   which load-native calls once the library is open. It should register
+   each builtin with builtin_register and return 0, or nonzero on failure.
+*/
+#define NATIVE_INIT "byol_init"
+
+lval *native_open(lenv *e, char *path);
+lval *native_function(lenv *e, char *path, char *name, char *sig);
+lval *native_call(lval *path, lval *name, lval *sig, lval *args);
+
+#endif
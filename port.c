@@ -0,0 +1,101 @@
+/*
+  Output ports
+
+  A port is a byte buffer with an optional FILE behind it. File ports
+  only write through when the buffer fills or on port_flush. String
+  ports grow without bound and their contents can be read back.
+*/
+
+#include "port.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PORTBUF 65536 // Initial buffer size of a file port
+#define STRINGBUF 64 // Initial buffer size of a string port
+
+struct port {
+  char *buf;
+  size_t len;
+  size_t cap;
+  FILE *file; // NULL for string ports
+};
+
+port *
+port_new(FILE *f, size_t cap)
+{
+  port *p = malloc(sizeof(port));
+  p->buf = malloc(cap);
+  p->len = 0;
+  p->cap = cap;
+  p->file = f;
+  return p;
+}
+
+port *port_file(FILE *f) { return port_new(f, PORTBUF); }
+port *port_string(void) { return port_new(NULL, STRINGBUF); }
+
+port *
+port_stdout(void) // Shared by every writer to standard output on this thread
+{
+  static __thread port *out = NULL;
+  if (!out) { out = port_file(stdout); }
+  return out;
+}
+
+void
+port_delete(port *p)
+{
+  port_flush(p);
+  free(p->buf);
+  free(p);
+}
+
+void
+port_flush(port *p)
+{
+  if (!p->file) { return; }
+  fwrite(p->buf, 1, p->len, p->file);
+  fflush(p->file);
+  p->len = 0;
+}
+
+void
+port_write(port *p, char *s, size_t n)
+{
+  if (p->len + n > p->cap) {
+    if (p->file) {
+      port_flush(p);
+      if (n > p->cap) { // Too big to be worth buffering
+	fwrite(s, 1, n, p->file);
+	return;
+      }
+    } else {
+      while (p->len + n > p->cap) { p->cap *= 2; }
+      p->buf = realloc(p->buf, p->cap);
+    }
+  }
+  memcpy(p->buf + p->len, s, n);
+  p->len += n;
+}
+
+void port_puts(port *p, char *s) { port_write(p, s, strlen(s)); }
+
+void
+port_putc(port *p, char c)
+{
+  if (p->len == p->cap) { port_write(p, &c, 1); return; }
+  p->buf[p->len++] = c;
+}
+
+/* The bytes written to a string port so far, NUL-terminated */
+char *
+port_contents(port *p, size_t *len)
+{
+  port_putc(p, '\0');
+  p->len--;
+  if (len) { *len = p->len; }
+  return p->buf;
+}
+
+void port_clear(port *p) { p->len = 0; }
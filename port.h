@@ -0,0 +1,22 @@
+#ifndef PORT_H
+#define PORT_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "structs.h"
+
+port *port_file(FILE *f);
+port *port_string(void);
+port *port_stdout(void);
+void port_delete(port *p);
+
+void port_write(port *p, char *s, size_t n);
+void port_puts(port *p, char *s);
+void port_putc(port *p, char c);
+void port_flush(port *p);
+
+char *port_contents(port *p, size_t *len);
+void port_clear(port *p);
+
+#endif
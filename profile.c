@@ -0,0 +1,361 @@
+/*
+  Profilers
+
+  While a profile runs, SIGPROF fires `hz` times per second of CPU time
+  and the handler copies the Lisp call stack into a preallocated
+  buffer. Nothing else happens in the handler. When the profile stops,
+  identical stacks are merged and written in the collapsed format
+  flamegraph tools read: one line per stack, frames from the outermost
+  in separated by `;`, then a space and the number of samples.
+
+  Profiles are per thread: each has its own buffers, and its timer
+  counts only that thread's CPU time and signals only that thread, so
+  instances on several threads can each run one at once.
+
+  Tracing instead counts and times every call. Time is read from the
+  TSC where there is one. The cost of tracing a call is measured once
+  and subtracted, so short functions that are called often aren't
+  blamed for the profiler's own time.
+*/
+
+#define _GNU_SOURCE // SIGEV_THREAD_ID
+
+#include "profile.h"
+#include "lval.h"
+#include "map.h"
+#include "builtin.h"
+#include "port.h"
+#include "memstats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define MAXFRAMES (1 << 20) // Frames buffered per profile
+#define MAXSAMPLES (1 << 16)
+
+__thread lval *call_stack[MAXCALLS];
+__thread volatile sig_atomic_t call_depth = 0;
+
+__thread lval **frames = NULL; // Every sample's stack, back to back
+__thread size_t nframes;
+__thread int *sample_depth;
+__thread long nsamples;
+__thread long dropped; // Samples that didn't fit
+__thread volatile sig_atomic_t profiling = false;
+__thread timer_t profile_timer;
+
+void
+on_sigprof(int sig)
+{
+  if (!profiling) { return; } // A signal sent before the timer stopped
+  int depth = call_depth < MAXCALLS ? call_depth : MAXCALLS;
+  if (depth == 0) { return; } // Not inside any Lisp call
+  if (nsamples == MAXSAMPLES || nframes + depth > MAXFRAMES) {
+    dropped++;
+    return;
+  }
+  memcpy(&frames[nframes], call_stack, depth * sizeof(lval *));
+  nframes += depth;
+  sample_depth[nsamples++] = depth;
+}
+
+/* Write a frame's name: name@file:line for functions, the name for builtins */
+void
+frame_label(port *p, lval *fn)
+{
+  char line[16];
+  if (get_builtin(fn)) {
+    char *name = builtin_name(get_builtin(fn));
+    port_puts(p, name ? name : "builtin");
+    return;
+  }
+  port_puts(p, get_name(fn) ? get_name(fn) : "lambda");
+  lval *body = get_body(fn);
+  if (body && get_type(body) == LVAL_SEXP && get_file(body)) {
+    port_putc(p, '@');
+    port_puts(p, get_file(body));
+    port_write(p, line, snprintf(line, sizeof(line), ":%d", get_line(body)));
+  }
+}
+
+/*
+   Start sampling this thread. Returns 0, or -1 if it is already
+   running a profile or the timer can't be made
+*/
+int
+profile_start(int hz)
+{
+  if (profiling) { return -1; }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_sigprof;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL); // Shared by every thread, and left in place
+
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGPROF;
+  sev._sigev_un._tid = syscall(SYS_gettid);
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &profile_timer) != 0) { return -1; }
+
+  frames = malloc(MAXFRAMES * sizeof(lval *));
+  sample_depth = malloc(MAXSAMPLES * sizeof(int));
+  nframes = nsamples = dropped = 0;
+  profiling = true;
+  struct itimerspec it;
+  it.it_interval.tv_sec = 0;
+  it.it_interval.tv_nsec = 1000000000L / hz;
+  it.it_value = it.it_interval;
+  timer_settime(profile_timer, 0, &it, NULL);
+  return 0;
+}
+
+/*
+   Stop sampling this thread and write the collapsed stacks to
+   `fname`. Returns the number of samples written, or -1 if it wasn't
+   running one or the file can't be written.
+*/
+long
+profile_stop(char *fname)
+{
+  if (!profiling) { return -1; }
+  profiling = false;
+  timer_delete(profile_timer);
+
+  // Merge identical stacks, keeping the order they were first seen in
+  map *counts = map_new();
+  port *label = port_string();
+  size_t at = 0;
+  for (long i = 0; i < nsamples; i++) {
+    port_clear(label);
+    for (int j = 0; j < sample_depth[i]; j++) {
+      if (j) { port_putc(label, ';'); }
+      frame_label(label, frames[at + j]);
+    }
+    at += sample_depth[i];
+    lval *stack = lval_string(port_contents(label, NULL));
+    lval *n = map_get(counts, stack);
+    map_add(counts, stack, lval_num(n ? get_num(n) + 1 : 1));
+  }
+  port_delete(label);
+  free(frames);
+  free(sample_depth);
+
+  FILE *f = fopen(fname, "w");
+  if (!f) { return -1; }
+  port *out = port_file(f);
+  size_t i = 0;
+  lval *stack, *n;
+  char num[24];
+  while (map_next(counts, &i, &stack, &n)) {
+    port_puts(out, get_string(stack));
+    port_write(out, num, snprintf(num, sizeof(num), " %ld\n", get_num(n)));
+  }
+  port_delete(out);
+  fclose(f);
+  for (i = 0; map_next(counts, &i, &stack, &n); ) {
+    lval_del(stack);
+    lval_del(n);
+  }
+  map_delete(counts);
+  if (dropped) { fprintf(stderr, "profile: %ld samples dropped\n", dropped); }
+  return nsamples;
+}
+
+// TRACING
+
+typedef struct fn_stats {
+  lval *fn;
+  long calls;
+  long active; // Calls on the stack now; recursion counts once for inclusive time
+  uint64_t incl;
+  uint64_t excl;
+  long allocs; // Made by the function itself, not its callees
+} fn_stats;
+
+typedef struct trace_frame {
+  fn_stats *stats;
+  uint64_t start;
+  uint64_t child_ticks; // Time spent in callees, already corrected
+  long child_calls; // Calls made below this frame
+  long start_allocs;
+  long child_allocs;
+} trace_frame;
+
+// Each thread traces its own calls
+__thread bool tracing = false;
+__thread fn_stats *fns = NULL; // Open addressing on the function pointer
+__thread size_t fn_cap, fn_count;
+__thread trace_frame *trace = NULL;
+__thread int trace_depth, trace_cap;
+__thread uint64_t call_overhead; // Ticks added by tracing one call
+__thread double ns_per_tick = 0;
+
+uint64_t
+ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ull + t.tv_nsec;
+#endif
+}
+
+fn_stats *
+fn_slot(fn_stats *table, size_t cap, lval *fn)
+{
+  size_t i = ((uintptr_t)fn >> 3) * 11400714819323198485ull & (cap - 1);
+  while (table[i].fn && table[i].fn != fn) { i = (i + 1) & (cap - 1); }
+  return &table[i];
+}
+
+fn_stats *
+fn_lookup(lval *fn)
+{
+  fn_stats *s = fn_slot(fns, fn_cap, fn);
+  if (s->fn) { return s; }
+  if (2 * (fn_count + 1) > fn_cap) {
+    fn_stats *old = fns;
+    size_t old_cap = fn_cap;
+    fn_cap *= 2;
+    fns = calloc(fn_cap, sizeof(fn_stats));
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].fn) { *fn_slot(fns, fn_cap, old[i].fn) = old[i]; }
+    }
+    free(old);
+    // Frames point into the table
+    for (int i = 0; i < trace_depth; i++) { trace[i].stats = fn_slot(fns, fn_cap, trace[i].stats->fn); }
+    s = fn_slot(fns, fn_cap, fn);
+  }
+  s->fn = fn;
+  fn_count++;
+  return s;
+}
+
+void
+trace_enter(lval *fn)
+{
+  if (trace_depth == trace_cap) {
+    trace_cap *= 2;
+    trace = realloc(trace, trace_cap * sizeof(trace_frame));
+  }
+  fn_stats *s = fn_lookup(fn);
+  s->calls++;
+  s->active++;
+  trace[trace_depth++] = (trace_frame){s, 0, 0, 0, mem_allocs(), 0};
+  trace[trace_depth - 1].start = ticks(); // Last, so setup isn't timed
+}
+
+void
+trace_exit(void)
+{
+  uint64_t now = ticks();
+  trace_frame *f = &trace[--trace_depth];
+  uint64_t overhead = call_overhead * f->child_calls;
+  uint64_t spent = now - f->start;
+  spent = spent > overhead ? spent - overhead : 0;
+  uint64_t own = spent > f->child_ticks ? spent - f->child_ticks : 0;
+  long allocs = mem_allocs() - f->start_allocs;
+
+  fn_stats *s = f->stats;
+  s->excl += own;
+  s->allocs += allocs - f->child_allocs;
+  if (--s->active == 0) { s->incl += spent; }
+  if (trace_depth > 0) {
+    trace_frame *parent = &trace[trace_depth - 1];
+    parent->child_ticks += spent;
+    parent->child_calls += f->child_calls + 1;
+    parent->child_allocs += allocs;
+  }
+}
+
+/* Measure how long a traced call takes with nothing in it */
+void
+calibrate(void)
+{
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  uint64_t start = ticks();
+  do { clock_gettime(CLOCK_MONOTONIC, &t1); }
+  while ((t1.tv_sec - t0.tv_sec) * 1000000000l + (t1.tv_nsec - t0.tv_nsec) < 10000000);
+  ns_per_tick = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / (ticks() - start);
+
+  lval *outer = lval_sym("calibrate"), *inner = lval_sym("calibrate-inner");
+  int n = 10000;
+  call_overhead = 0;
+  trace_enter(outer);
+  for (int i = 0; i < n; i++) {
+    trace_enter(inner);
+    trace_exit();
+  }
+  trace_depth--;
+  uint64_t total = ticks() - trace[0].start;
+  call_overhead = total / n;
+}
+
+/* Start tracing calls. Returns -1 if tracing is already on */
+int
+trace_start(void)
+{
+  if (tracing) { return -1; }
+  fn_cap = 64;
+  fns = calloc(fn_cap, sizeof(fn_stats));
+  trace_cap = 64;
+  trace_depth = 0;
+  trace = malloc(trace_cap * sizeof(trace_frame));
+  if (ns_per_tick == 0) { calibrate(); }
+  memset(fns, 0, fn_cap * sizeof(fn_stats)); // Drop calibration's entries
+  fn_count = 0;
+  tracing = true;
+  return 0;
+}
+
+int
+by_excl(const void *a, const void *b)
+{
+  const fn_stats *x = a, *y = b;
+  return (x->excl < y->excl) - (x->excl > y->excl);
+}
+
+/* Stop tracing and write a table of the calls made, most time first */
+void
+trace_stop(port *p)
+{
+  tracing = false;
+  size_t n = 0;
+  for (size_t i = 0; i < fn_cap; i++) {
+    if (fns[i].fn) { fns[n++] = fns[i]; }
+  }
+  qsort(fns, n, sizeof(fn_stats), by_excl);
+
+  char line[128];
+  port *label = port_string();
+  port_puts(p, "        calls      incl ms      excl ms       allocs  function\n");
+  for (size_t i = 0; i < n; i++) {
+    fn_stats *s = &fns[i];
+    port_write(p, line, snprintf(line, sizeof(line), "%13ld %12.3f %12.3f %12ld  ",
+				 s->calls, s->incl * ns_per_tick / 1e6,
+				 s->excl * ns_per_tick / 1e6, s->allocs));
+    port_clear(label);
+    frame_label(label, s->fn);
+    port_puts(p, port_contents(label, NULL));
+    port_putc(p, '\n');
+  }
+  port_delete(label);
+  free(fns);
+  free(trace);
+}
@@ -0,0 +1,45 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <signal.h>
+#include <stdbool.h>
+
+#include "structs.h"
+
+/*
+   The Lisp call stack of this thread, outermost call first. lval_call keeps it up to
+   date whether or not a profile is running; calls deeper than
+   MAXCALLS are counted but not recorded.
+*/
+
+#define MAXCALLS 4096
+
+extern __thread lval *call_stack[MAXCALLS];
+extern __thread volatile sig_atomic_t call_depth;
+
+#define CALL_PUSH(fn) do {					\
+    if (call_depth < MAXCALLS) { call_stack[call_depth] = (fn); }	\
+    call_depth++;						\
+  } while (0)
+#define CALL_POP() (call_depth--)
+
+void frame_label(port *p, lval *fn);
+
+// Sampling
+
+extern __thread volatile sig_atomic_t profiling; // By this thread
+
+
+int profile_start(int hz);
+long profile_stop(char *fname);
+
+// Tracing: every call is counted and timed while `tracing` is set
+
+extern __thread bool tracing;
+
+void trace_enter(lval *fn);
+void trace_exit(void);
+int trace_start(void);
+void trace_stop(port *p);
+
+#endif
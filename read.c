@@ -1,139 +1,348 @@
+/*
+  Recursive-descent reader for byol
+
+  Lexes straight out of a byte buffer into lvals, with no intermediate
+  AST. The grammar is the one the old mpc parser accepted:
+
+    string : /"(\\.|[^"])*"/ ;
+    bool   : "true" | "false" ;
+    num    : /-?[0-9]+/ ;
+    symbol : /[a-zA-Z0-9*+\-\/\\_=<>!&?]+/ ;
+    sexp   : '(' <exp>* ')' ;
+    exp    : <string> | <bool> | <num> | <symbol> | <sexp> ;
+ */
+
 #include "read.h"
-#include <string.h>
 #include "lval.h"
-#include "mpc/mpc.h"
-// Global definition for the parser
-mpc_parser_t *String, *Bool, *Num, *Symbol, *Exp, *Sexp, *Program;
+#include "list.h"
+#include "hashcons.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-lval *read_num(mpc_ast_t *t);
-lval *read_bool(mpc_ast_t *t);
-lval *read(mpc_ast_t *t);
+#define CHUNKSIZE 65536 // Bytes requested from a file per read
+
+struct reader {
+  char *name; // Used in error messages
+  char *buf;
+  size_t len;
+  size_t cap;
+  size_t pos;
+  int fd; // -1 when reading from a string
+  int line;
+  int col;
+  int error; // errno from a failed read, or 0
+};
+
+lval *read_exp(reader *r);
 
 void
-read_initialize(void)
-{
-  extern mpc_parser_t *String;
-  extern mpc_parser_t *Bool;
-  extern mpc_parser_t *Num;
-  extern mpc_parser_t *Symbol;
-  extern mpc_parser_t *Sexp;
-  extern mpc_parser_t *Exp;
-  extern mpc_parser_t *Program;
-  Program = mpc_new("program");
-  String = mpc_new("string");
-  Bool = mpc_new("bool");
-  Num = mpc_new("num");
-  Symbol = mpc_new("symbol");
-  Sexp = mpc_new("sexp");
-  Exp = mpc_new("exp");
-
-  mpca_lang(MPCA_LANG_DEFAULT,"\
-  string : /\"(\\\\.|[^\"])*\"/ ;					\
-  bool : \"true\" | \"false\" ;						\
-  num : /-?[0-9]+/ ;							\
-  symbol : /[a-zA-Z0-9*+\\-\\/\\\\_=<>!&]+/ ;				\
-  sexp : '(' <exp>* ')' ;						\
-  exp : <string> | <bool> | <num> | <symbol> | <sexp> ; \
-  program : /^/ <exp>* /$/ ;", String, Bool, Num, Symbol, Sexp, Exp, Program);
+reader_init(reader *r, char *name, char *buf, size_t len)
+{
+  r->name = name;
+  r->buf = buf;
+  r->len = len;
+  r->cap = len;
+  r->pos = 0;
+  r->fd = -1;
+  r->line = 1;
+  r->col = 1;
+  r->error = 0;
+}
+
+/* Open a file ("-" for stdin) to be read one form at a time */
+reader *
+reader_open(char *fname)
+{
+  int fd = strcmp(fname, "-") == 0 ? STDIN_FILENO : open(fname, O_RDONLY);
+  if (fd < 0) { return NULL; }
+  return reader_fd(fname, fd);
+}
+
+typedef struct source source;
+
+struct source {
+  source *next;
+  char name[];
+};
+
+__thread source *sources = NULL; // Every name read from, by this thread
+
+/* A copy of `name` that is never freed, made once however often it is read */
+char *
+source_name(char *name)
+{
+  for (source *s = sources; s; s = s->next) {
+    if (strcmp(s->name, name) == 0) { return s->name; }
+  }
+  source *s = malloc(sizeof(source) + strlen(name) + 1);
+  strcpy(s->name, name);
+  s->next = sources;
+  sources = s;
+  return s->name;
+}
+
+/* Read forms from an open descriptor, such as a socket. Closing the reader closes it */
+reader *
+reader_fd(char *name, int fd)
+{
+  reader *r = malloc(sizeof(reader));
+  reader_init(r, source_name(name), malloc(CHUNKSIZE), 0);
+  r->cap = CHUNKSIZE;
+  r->fd = fd;
+  return r;
+}
+
+/* Read forms from a copy of the string `src`; `name` is used in errors */
+reader *
+reader_string(char *name, char *src)
+{
+  reader *r = malloc(sizeof(reader));
+  reader_init(r, source_name(name), strdup(src), strlen(src));
+  return r;
 }
 
 void
-read_cleanup(void)
+reader_close(reader *r)
 {
-  extern mpc_parser_t *String;
-  extern mpc_parser_t *Bool;
-  extern mpc_parser_t *Num;
-  extern mpc_parser_t *Symbol;
-  extern mpc_parser_t *Sexp;
-  extern mpc_parser_t *Exp;
-  extern mpc_parser_t *Program;
-  mpc_cleanup(7, String, Bool, Num, Symbol, Sexp, Exp, Program);
+  if (r->fd >= 0 && r->fd != STDIN_FILENO) { close(r->fd); }
+  free(r->buf);
+  free(r);
 }
 
-lval *
-read_num(mpc_ast_t *t) // Convert an AST to an LVAL containing a number
+/*
+   Pull the next chunk of the file into the buffer, growing it only
+   when a single form doesn't fit. Returns false at end of input, or
+   when the read fails, which is kept in `r->error`.
+*/
+bool
+reader_fill(reader *r)
 {
-  long x = strtol(t->contents, NULL, 10);
-  if (errno != ERANGE) return lval_num(x);
-  else return lval_err("ERROR: Invalid number!");
+  if (r->fd < 0) { return false; }
+  if (r->len == r->cap) {
+    r->cap *= 2;
+    r->buf = realloc(r->buf, r->cap);
+  }
+  ssize_t n;
+  do {
+    n = read(r->fd, r->buf + r->len, r->cap - r->len);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) { r->error = errno; }
+  if (n <= 0) { return false; }
+  r->len += n;
+  return true;
 }
 
+/* Drop the bytes of forms that have already been read */
+void
+reader_discard(reader *r)
+{
+  memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+  r->len -= r->pos;
+  r->pos = 0;
+}
 
-lval *
-read_string(mpc_ast_t *t) // Convert an AST to an LVAL containing a number
+int
+reader_peek(reader *r)
 {
-  t->contents[strlen(t->contents) - 1] = '\0'; // Cut off last quote
-  char *str = malloc(strlen(t->contents + 1) + 1);
-  strcpy(str, t->contents + 1);
-  lval *s = lval_string(str);
-  free(str);
-  return s;
+  if (r->pos >= r->len && !reader_fill(r)) { return EOF; }
+  return (unsigned char)r->buf[r->pos];
 }
 
-lval *
-read_line(char *line)
+void
+reader_advance(reader *r)
 {
-  mpc_result_t r;
-  if (mpc_parse("<stdin>", line, Program, &r)) {
-    lval *lval_input = read(r.output);
-    mpc_ast_delete(r.output);
-    return lval_input;
+  if (r->buf[r->pos++] == '\n') {
+    r->line++;
+    r->col = 1;
   } else {
-    return lval_err("ERROR: Syntax error!");
+    r->col++;
   }
 }
 
-/* Read in any number of lisp expressions from a file and stuff them into a sexp */
+void
+skip_whitespace(reader *r)
+{
+  int c;
+  while ((c = reader_peek(r)) == ' ' || c == '\t' || c == '\n' || c == '\r'
+	 || c == '\f' || c == '\v') {
+    reader_advance(r);
+  }
+}
+
+bool
+is_symbol_char(int c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+    || (c != EOF && strchr("*+-/\\_=<>!&?", c) != NULL);
+}
+
 lval *
-read_file(char *fname)
+read_error(reader *r, char *msg)
+{
+  return lval_err("ERROR: Syntax error at %s:%d:%d: %s", r->name, r->line, r->col, msg);
+}
+
+lval *
+read_string(reader *r) // Contents are kept verbatim, escapes included
 {
-  mpc_result_t r;
-  if (mpc_parse_contents(fname, Program, &r)) {
-    /* Read contents */
-    mpc_ast_t *t = r.output;
-    lval *children;
-    if (strcmp(t->tag, ">") == 0) {
-      children = lval_sexp();
-      for (int i = t->children_num - 2; i >= 1; i--) {
-	lval *child = read(t->children[i]);
-	lval_cons(children, child);
-      }
+  reader_advance(r); // Opening quote
+  size_t start = r->pos;
+  int c;
+  while ((c = reader_peek(r)) != '"') {
+    if (c == EOF) { return read_error(r, "unterminated string"); }
+    if (c == '\\') {
+      reader_advance(r);
+      if (reader_peek(r) == EOF) { return read_error(r, "unterminated string"); }
     }
-    lval_cons(children, lval_sym("progn"));
-    mpc_ast_delete(r.output);
-    return children;
-  } else {
-    return lval_err("ERROR: Load error!");
+    reader_advance(r);
+  }
+  lval *s = lval_stringn(r->buf + start, r->pos - start);
+  reader_advance(r); // Closing quote
+  return s;
+}
+
+/* Is the token [s, s+n) a number of the form -?[0-9]+ */
+bool
+is_number(char *s, size_t n)
+{
+  size_t i = (n > 1 && s[0] == '-') ? 1 : 0;
+  if (i == n) { return false; }
+  for (; i < n; i++) {
+    if (s[i] < '0' || s[i] > '9') { return false; }
   }
+  return true;
 }
 
 lval *
-read(mpc_ast_t *t) // convert the AST into a sexp
+read_atom(reader *r) // Bools, numbers and symbols share one token class
 {
-  // if the tree is the root, return its children as a list
-  if (strcmp(t->tag, ">") == 0) {
-    if (t->children_num > 1)
-      return read(t->children[1]);
+  int line = r->line, col = r->col;
+  size_t start = r->pos;
+  while (is_symbol_char(reader_peek(r))) { reader_advance(r); }
+  char *tok = r->buf + start;
+  size_t n = r->pos - start;
+
+  if (n == 4 && strncmp(tok, "true", 4) == 0) { return lval_bool(true); }
+  if (n == 5 && strncmp(tok, "false", 5) == 0) { return lval_bool(false); }
+  if (is_number(tok, n)) {
+    errno = 0;
+    long x = strtol(tok, NULL, 10);
+    if (errno == ERANGE) {
+      return lval_err("ERROR: Invalid number at %s:%d:%d!", r->name, line, col);
+    }
+    return lval_num(x);
   }
-  if (strstr(t->tag, "bool")) { return lval_bool(strcmp(t->contents, "true") == 0); }
-  if (strstr(t->tag, "string")) { return read_string(t); }
-  if (strstr(t->tag, "num")) { return read_num(t); }
-  if (strstr(t->tag, "sym")) { return lval_sym(t->contents); }
-
-  // if the tree a sexp then create an empty sexp
-  lval *v;
-  if (strstr(t->tag, "sexp")) {
-    v = lval_sexp();
+  return lval_symn(tok, n);
+}
+
+lval *
+read_sexp(reader *r)
+{
+  int line = r->line, col = r->col;
+  reader_advance(r); // Opening paren
+  list *children = NULL; // Built backwards, then reversed once
+  while (true) {
+    skip_whitespace(r);
+    int c = reader_peek(r);
+    if (c == ')') { break; }
+    if (c == EOF) {
+      list_delete(children);
+      return lval_err("ERROR: Syntax error at %s:%d:%d: unclosed `(`",
+		      r->name, line, col);
+    }
+    lval *child = read_exp(r);
+    if (get_type(child) == LVAL_ERR) {
+      list_delete(children);
+      return child;
+    }
+    children = list_cons(child, children);
   }
-  // fill the empty sexp with any expressions within
-  // need to go through backwards for the cons to work
-  for (int i = t->children_num - 1; i >= 0; i--) {
-    if (strcmp(t->children[i]->tag, "regex") == 0) { continue; } // skip the noise
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    lval_cons(v, read(t->children[i]));
+  reader_advance(r); // Closing paren
+  lval *v = lval_sexp_of(list_reverse(children));
+  lval_set_source(v, r->name, line);
+  return hashconsing ? hashcons(v) : v;
+}
+
+lval *
+read_exp(reader *r)
+{
+  int c = reader_peek(r);
+  if (c == '(') { return read_sexp(r); }
+  if (c == '"') { return read_string(r); }
+  if (is_symbol_char(c)) { return read_atom(r); }
+  if (c == ')') { return read_error(r, "unexpected `)`"); }
+  return read_error(r, "unexpected character");
+}
+
+/* The error for a failed read, so a broken file isn't taken for a shorter one */
+lval *
+read_failed(reader *r)
+{
+  return lval_err("ERROR: Could not read `%s`: %s", r->name, strerror(r->error));
+}
+
+/* Read every expression in the buffer, returning them as a list */
+lval *
+read_all(reader *r)
+{
+  list *children = NULL;
+  while (true) {
+    skip_whitespace(r);
+    lval *child = reader_peek(r) == EOF ? NULL : read_exp(r);
+    if (r->error) { child = read_failed(r); }
+    if (!child) { break; }
+    if (get_type(child) == LVAL_ERR) {
+      list_delete(children);
+      return child;
+    }
+    children = list_cons(child, children);
   }
-  return v;
+  return lval_sexp_of(list_reverse(children));
+}
+
+/* Read the next top-level form, or return NULL at end of input */
+lval *
+read_next(reader *r)
+{
+  if (r->fd >= 0) { reader_discard(r); }
+  skip_whitespace(r);
+  lval *v = reader_peek(r) == EOF ? NULL : read_exp(r);
+  return r->error ? read_failed(r) : v;
+}
+
+/* Whether nothing but whitespace is left to read */
+bool
+read_done(reader *r)
+{
+  skip_whitespace(r);
+  return reader_peek(r) == EOF;
+}
+
+/* Read the first expression on a line; an empty line reads as `()` */
+lval *
+read_line(char *line)
+{
+  reader r;
+  reader_init(&r, "<stdin>", line, strlen(line));
+  lval *all = read_all(&r);
+  if (get_type(all) == LVAL_ERR || is_empty(all)) { return all; }
+  return lval_first(all);
+}
+
+/* Read in any number of lisp expressions from a file and stuff them into a sexp */
+lval *
+read_file(char *fname)
+{
+  reader *r = reader_open(fname);
+  if (!r) { return lval_err("ERROR: Could not open file `%s`!", fname); }
+  lval *children = read_all(r);
+  reader_close(r);
+  if (get_type(children) == LVAL_ERR) { return children; }
+  lval_cons(children, lval_sym("progn"));
+  return children;
 }
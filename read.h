@@ -1,10 +1,16 @@
 #ifndef READ_H
 #define READ_H
 
+#include <stdbool.h>
+
 #include "structs.h"
 
-void read_initialize(void);
-void read_cleanup(void);
+reader *reader_open(char *fname);
+reader *reader_fd(char *name, int fd);
+reader *reader_string(char *name, char *src);
+void reader_close(reader *r);
+lval *read_next(reader *r);
+bool read_done(reader *r);
 
 lval *read_line(char *line);
 lval *read_file(char *fname);
@@ -0,0 +1,137 @@
+/*
+  Records
+
+  (defstruct point x y) defines a struct type and four functions:
+
+    (make-point 1 2)   a new record
+    (point? v)         whether `v` is a point
+    (point-x p)        the x field of a point, and point-y likewise
+
+  A record keeps its fields in an array allocated with the lval, in
+  the order they were declared, so it costs one allocation however
+  many fields it has. Each accessor is a lambda calling record-get
+  with the type and a constant field number, so reading a field is a
+  check of the record's type and an array load.
+
+  The struct type is itself an lval, and the generated functions hold
+  it in their bodies, so like memo and load-native they survive images
+  and fasl. Struct types with the same name and fields are equal, so a
+  record read back from fasl still belongs to its struct; comparing
+  them is only needed when they aren't the same lval.
+*/
+
+#include "record.h"
+#include "lval.h"
+#include "list.h"
+#include "environment.h"
+#include "builtin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Bind `fn` in `e` to `prefix` `name` `suffix`, naming it to match */
+void
+define(lenv *e, char *prefix, char *name, char *suffix, lval *fn)
+{
+  size_t len = strlen(prefix) + strlen(name) + strlen(suffix) + 1;
+  char *sym = malloc(len);
+  snprintf(sym, len, "%s%s%s", prefix, name, suffix);
+  lval_set_name(fn, sym);
+  lenv_set(e, lval_sym(sym), fn);
+  free(sym);
+}
+
+/* (\ (r) (builtin type consts... r)) */
+lval *
+unary(lenv *e, lbuiltin fn, lval *type, lval *constant)
+{
+  lval *body = lval_cons(lval_sexp(), lval_sym("r"));
+  if (constant) { lval_cons(body, constant); }
+  lval_cons(body, type);
+  lval_cons(body, lval_builtin_function(e, fn));
+  return lval_lambda(e, lval_cons(lval_sexp(), lval_sym("r")), body);
+}
+
+/* Define the struct `name` with the named fields in `e`. Returns the type */
+lval *
+record_define(lenv *e, lval *name, lval *fields)
+{
+  int n = get_count(fields);
+  lval *type = lval_struct(get_sym(name), n);
+  int i = 0;
+  for (list *l = get_cell(fields); l; l = list_rest(l), i++) {
+    lval *f = list_first(l);
+    if (get_type(f) != LVAL_SYM) {
+      return lval_err("ERROR: Field %d of struct `%s` must be a symbol (passed %s)!",
+		      i + 1, get_sym(name), ltype_name(get_type(f)));
+    }
+    for (int j = 0; j < i; j++) {
+      if (lval_equal(get_fields(type)[j], f)) {
+	return lval_err("ERROR: Struct `%s` has two fields named `%s`", get_sym(name), get_sym(f));
+      }
+    }
+    get_fields(type)[i] = f;
+  }
+
+  // (\ (x y ...) (record-new type x y ...))
+  lval *formals = lval_sexp();
+  lval *body = lval_sexp();
+  for (i = n - 1; i >= 0; i--) {
+    lval_cons(formals, get_fields(type)[i]);
+    lval_cons(body, get_fields(type)[i]);
+  }
+  lval_cons(body, type);
+  lval_cons(body, lval_builtin_function(e, builtin_record_new));
+  define(e, "make-", get_sym(name), "", lval_lambda(e, formals, body));
+
+  define(e, "", get_sym(name), "?", unary(e, builtin_record_is, type, NULL));
+  for (i = 0; i < n; i++) {
+    char *field = get_sym(get_fields(type)[i]);
+    char *suffix = malloc(strlen(field) + 2);
+    sprintf(suffix, "-%s", field);
+    define(e, "", get_sym(name), suffix, unary(e, builtin_record_get, type, lval_num(i)));
+    free(suffix);
+  }
+  return type;
+}
+
+/* A record of struct `type` holding `args`, one per field */
+lval *
+record_new(lval *type, lval *args)
+{
+  if (get_count(args) != get_num(type)) {
+    return lval_err("ERROR: Struct `%s` has %ld field(s) (passed %d)!",
+		    get_name(type), get_num(type), get_count(args));
+  }
+  lval *r = lval_record(type, get_num(type));
+  lval **field = get_fields(r);
+  for (list *l = get_cell(args); l; l = list_rest(l)) { *field++ = list_first(l); }
+  return r;
+}
+
+bool
+is_a(lval *r, lval *type)
+{
+  return get_type(r) == LVAL_RECORD && get_struct(r)
+    && (get_struct(r) == type || lval_equal(get_struct(r), type));
+}
+
+lval *
+record_is(lval *type, lval *r)
+{
+  return lval_bool(is_a(r, type));
+}
+
+/* Field `i` of `r`, which must be a record of struct `type` */
+lval *
+record_get(lval *type, long i, lval *r)
+{
+  if (!is_a(r, type)) {
+    return lval_err("ERROR: Function `%s-%s` requires a %s (passed %s)!",
+		    get_name(type), get_sym(get_fields(type)[i]), get_name(type),
+		    get_type(r) == LVAL_RECORD && get_struct(r)
+		    ? get_name(get_struct(r)) : ltype_name(get_type(r)));
+  }
+  return get_fields(r)[i];
+}
@@ -0,0 +1,11 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include "structs.h"
+
+lval *record_define(lenv *e, lval *name, lval *fields);
+lval *record_new(lval *type, lval *args);
+lval *record_is(lval *type, lval *r);
+lval *record_get(lval *type, long i, lval *r);
+
+#endif
@@ -0,0 +1,387 @@
+/*
+  Regions
+
+  Evaluating a top-level form makes many short-lived lvals, list nodes,
+  maps, strings and vector nodes. While a region is open they are
+  bump-allocated from its chunks instead of calloc, and when the form
+  is done the chunks are released at once, without visiting anything
+  in them.
+
+  First, whatever escapes is promoted: copied out of the region along
+  with everything in the region it points to. A forwarding table, kept
+  for the whole region, copies each object once, so sharing and cycles
+  survive. Values escape in three ways:
+
+  - as the form's result, which region_end is given;
+  - by being bound in a frame outside the region, as `def` does at top
+    level. lenv_set remembers the binding, and its value is promoted
+    when the region ends, so a loop that sets a global copies only
+    the last value;
+  - through a holder outside the region: cells, memo caches, the
+    hash-consing table, and sorted maps and transient vectors changed
+    in place. These call region_promote when they keep something, or
+    region_pause while they allocate their own tables.
+
+  Nothing else on the heap may point into the region, so it is never
+  scanned. Tables that grow with an object, such as a map's entries or
+  a transient vector's nodes, are allocated next to it with
+  region_alloc_near, so they live exactly as long as it does. The
+  nodes of sorted maps still come from malloc.
+
+  Regions nest: a form evaluated by `load` gets a region inside the
+  one of the form that called it. When it ends, what escapes is moved
+  into the outer region rather than the heap, and the bindings it made
+  are remembered there, so the outer region still sees everything that
+  points into it. A holder outside every region gets a heap copy from
+  region_promote, of whatever it keeps in any of them.
+
+  The objects counted by memstats while a region is open are counted
+  against it too, and uncounted when it is released.
+
+  Profiles and traces remember functions by address, so while either
+  is running no region is opened, and one that sees them start is
+  leaked rather than reused.
+*/
+
+#include "region.h"
+#include "lval.h"
+#include "map.h"
+#include "cell.h"
+#include "profile.h"
+#include "memstats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define SPARES 4 // Released chunks kept for the next regions
+
+typedef struct chunk chunk;
+typedef struct region region;
+
+struct chunk {
+  chunk *next; // The one before, half the size
+  size_t size;
+  char data[]; // 16-byte aligned, after two 8-byte fields
+};
+
+typedef struct {
+  lval *frame, *key;
+} binding;
+
+struct region {
+  region *outer; // The region it is nested in, or NULL
+  chunk *chunks; // Newest first
+  char *bump, *bump_end; // Free space in the newest chunk
+  size_t used;
+  binding *bindings; // Made in frames outside the region
+  size_t nbindings, bindcap;
+  void **forward_from, **forward_to; // Open addressing
+  size_t nforward, forward_slots;
+  long counts[MEM_NSTATS]; // Counted by memstats while allocated in it
+};
+
+__thread bool region_open = false;
+__thread region *current = NULL; // The innermost open region
+__thread int paused = 0; // Allocate on the heap even though a region is open
+__thread bool promoting = false; // Copying objects out of the regions inside `moving_to`
+__thread region *moving_to = NULL; // Where they go while promoting: a region, or NULL for the heap
+__thread chunk *spares = NULL; // Released chunks, kept to be reused
+__thread int nspares = 0;
+__thread size_t released = 0;
+
+/* A chunk of at least `size` bytes, the first of a region */
+chunk *
+chunk_new(size_t size)
+{
+  if (spares && size <= REGION_CHUNK) {
+    chunk *c = spares;
+    spares = c->next;
+    nspares--;
+    return c;
+  }
+  size_t n = REGION_CHUNK;
+  while (n < size) { n *= 2; }
+  chunk *c = malloc(sizeof(chunk) + n);
+  c->size = n;
+  return c;
+}
+
+void
+region_grow(region *r, size_t size)
+{
+  chunk *c;
+  if (r->chunks) {
+    size_t n = 2 * r->chunks->size;
+    while (n < size) { n *= 2; }
+    c = malloc(sizeof(chunk) + n);
+    c->size = n;
+  } else {
+    c = chunk_new(size);
+  }
+  c->next = r->chunks;
+  r->chunks = c;
+  r->bump = c->data;
+  r->bump_end = c->data + c->size;
+}
+
+/* Open a region for this thread, inside the open one if any. False if it can't be */
+bool
+region_begin(void)
+{
+  if (profiling || tracing || paused) { return false; }
+  region *r = calloc(1, sizeof(region));
+  r->outer = current;
+  region_grow(r, 0);
+  current = r;
+  region_open = true;
+  return true;
+}
+
+/* `size` bytes from `r` */
+void *
+bump_alloc(region *r, size_t size)
+{
+  size = (size + 15) & ~(size_t)15;
+  if (size > r->bump_end - r->bump) { region_grow(r, size); }
+  void *p = r->bump;
+  r->bump += size;
+  r->used += size;
+  return p;
+}
+
+/* The region new objects go to: the open one, or the one promoted into. NULL for the heap */
+region *
+allocating(void)
+{
+  if (!region_open || paused) { return NULL; }
+  return promoting ? moving_to : current;
+}
+
+/* `size` bytes, from the region if one is open */
+void *
+region_alloc(size_t size)
+{
+  region *r = allocating();
+  return r ? bump_alloc(r, size) : malloc(size);
+}
+
+/* `size` zeroed bytes, from the region if one is open */
+void *
+region_calloc(size_t size)
+{
+  region *r = allocating();
+  if (!r) { return calloc(1, size); }
+  void *p = bump_alloc(r, size);
+  memset(p, 0, size);
+  return p;
+}
+
+bool
+in_region(region *r, void *p)
+{
+  for (chunk *c = r->chunks; c; c = c->next) {
+    if ((char *)p >= c->data && (char *)p < c->data + c->size) { return true; }
+  }
+  return false;
+}
+
+/* The open region holding `p`, or NULL */
+region *
+region_of(void *p)
+{
+  for (region *r = current; r; r = r->outer) {
+    if (in_region(r, p)) { return r; }
+  }
+  return NULL;
+}
+
+/* `size` bytes that live as long as `owner`: from the region holding it, or the heap */
+void *
+region_alloc_near(void *owner, size_t size)
+{
+  region *r = region_open ? region_of(owner) : NULL;
+  return r ? bump_alloc(r, size) : malloc(size);
+}
+
+/* Whether `p` is in the innermost open region */
+bool
+region_contains(void *p)
+{
+  return region_open && in_region(current, p);
+}
+
+/* Whether `p` is in any open region, which will free it */
+bool region_owns(void *p) { return region_open && region_of(p); }
+
+/* Whether `p` is being promoted: in the open regions inside the one promoted into */
+bool
+region_moving(void *p)
+{
+  if (!region_open) { return false; }
+  for (region *r = current; r != moving_to; r = r->outer) {
+    if (in_region(r, p)) { return true; }
+  }
+  return false;
+}
+
+void region_pause(void) { paused++; }
+void region_resume(void) { paused--; }
+
+/* Count `n` more of `stat` against the region it is allocated in, if any */
+void
+region_count(int stat, long n)
+{
+  region *r = allocating();
+  if (r) { r->counts[stat] += n; }
+}
+
+/* Called by lenv_set: `key` was bound in `frame`, which may be outside the region */
+void
+region_remember(lval *frame, lval *key)
+{
+  if (paused || !region_open || in_region(current, frame)) { return; }
+  region *r = current;
+  if (r->nbindings && r->bindings[r->nbindings - 1].frame == frame
+      && r->bindings[r->nbindings - 1].key == key) {
+    return;
+  }
+  if (r->nbindings == r->bindcap) {
+    r->bindcap = r->bindcap ? 2 * r->bindcap : 64;
+    r->bindings = realloc(r->bindings, r->bindcap * sizeof(binding));
+  }
+  r->bindings[r->nbindings++] = (binding){frame, key};
+}
+
+/* A heap copy of `v`, for a holder outside the region, of all it holds in any region */
+lval *
+region_promote(lval *v)
+{
+  if (!region_owns(v)) { return v; }
+  bool was = promoting;
+  region *to = moving_to;
+  promoting = true;
+  moving_to = NULL;
+  paused++;
+  v = lval_promote(v);
+  paused--;
+  promoting = was;
+  moving_to = to;
+  return v;
+}
+
+size_t
+forward_slot(void **table, size_t slots, void *p)
+{
+  size_t i = ((uintptr_t)p >> 4) & (slots - 1);
+  while (table[i] && table[i] != p) { i = (i + 1) & (slots - 1); }
+  return i;
+}
+
+/* Whether `p` was promoted already, and if so, to where */
+bool
+region_seen(void *p, void **copy)
+{
+  region *r = current;
+  if (!r->forward_slots) { return false; }
+  size_t i = forward_slot(r->forward_from, r->forward_slots, p);
+  if (!r->forward_from[i]) { return false; }
+  *copy = r->forward_to[i];
+  return true;
+}
+
+/* Record that `p` was promoted to `copy` */
+void
+region_forward(void *p, void *copy)
+{
+  region *r = current;
+  if (2 * (r->nforward + 1) > r->forward_slots) { // Load factor 1/2
+    size_t slots = r->forward_slots ? 2 * r->forward_slots : 256;
+    void **from = calloc(slots, sizeof(void *)), **to = malloc(slots * sizeof(void *));
+    for (size_t i = 0; i < r->forward_slots; i++) {
+      if (!r->forward_from[i]) { continue; }
+      size_t j = forward_slot(from, slots, r->forward_from[i]);
+      from[j] = r->forward_from[i];
+      to[j] = r->forward_to[i];
+    }
+    free(r->forward_from);
+    free(r->forward_to);
+    r->forward_from = from;
+    r->forward_to = to;
+    r->forward_slots = slots;
+  }
+  size_t i = forward_slot(r->forward_from, r->forward_slots, p);
+  r->forward_from[i] = p;
+  r->forward_to[i] = copy;
+  r->nforward++;
+}
+
+/* Move the binding `b` and its current value out of the region, updating its key */
+void
+rebind(binding *b)
+{
+  map *m = get_dict(b->frame);
+  lval *v = map_get(m, b->key);
+  if (!v) { return; }
+  lval *k = lval_promote(b->key), *pv = lval_promote(v);
+  if (k == b->key && pv == v) { return; }
+  map_remove(m, b->key);
+  map_add(m, k, pv);
+  b->key = k;
+}
+
+/* Give the chunks of `r` back, keeping a few to reuse */
+void
+release(region *r)
+{
+#ifndef NDEBUG
+  // Poison what is released, so anything left pointing into it fails early
+  for (chunk *c = r->chunks; c; c = c->next) {
+    memset(c->data, 0xdb, c == r->chunks ? r->bump - c->data : c->size);
+  }
+#endif
+  while (r->chunks) {
+    chunk *c = r->chunks;
+    r->chunks = c->next;
+    if (nspares < SPARES && c->size == REGION_CHUNK) {
+      c->next = spares;
+      spares = c;
+      nspares++;
+    } else {
+      free(c);
+    }
+  }
+  released += r->used;
+}
+
+/* Promote `result`, and whatever else escaped, then release the innermost region */
+lval *
+region_end(lval *result)
+{
+  region *r = current;
+  promoting = true;
+  moving_to = r->outer;
+  if (result) { result = lval_promote(result); }
+  for (size_t i = 0; i < r->nbindings; i++) { rebind(&r->bindings[i]); }
+  cell_promote(!r->outer);
+  promoting = false;
+  moving_to = NULL;
+
+  current = r->outer;
+  region_open = current != NULL;
+  // The outer region may hold what they are bound to now
+  for (size_t i = 0; i < r->nbindings; i++) { region_remember(r->bindings[i].frame, r->bindings[i].key); }
+
+  if (!profiling && !tracing) { release(r); } // Otherwise they may have seen functions in it
+  for (int i = 0; i < MEM_NSTATS; i++) {
+    if (r->counts[i]) { MEM_FREE(i, r->counts[i]); }
+  }
+  free(r->bindings);
+  free(r->forward_from);
+  free(r->forward_to);
+  free(r);
+  return result;
+}
+
+/* Bytes released by the regions of this thread so far */
+size_t region_released(void) { return released; }
@@ -0,0 +1,34 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "structs.h"
+
+#define REGION_CHUNK (1 << 20) // Size of a region's first chunk; later ones double
+
+extern __thread bool region_open; // Objects are being allocated in a region, maybe nested
+
+bool region_begin(void);
+lval *region_end(lval *result);
+size_t region_released(void);
+
+void *region_alloc(size_t size);
+void *region_calloc(size_t size);
+void *region_alloc_near(void *owner, size_t size);
+bool region_contains(void *p);
+bool region_owns(void *p);
+void region_pause(void);
+void region_resume(void);
+void region_count(int stat, long n);
+
+// Keeping objects that escape
+
+void region_remember(lval *frame, lval *key);
+lval *region_promote(lval *v);
+bool region_moving(void *p);
+bool region_seen(void *p, void **copy);
+void region_forward(void *p, void *copy);
+
+#endif
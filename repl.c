@@ -2,47 +2,223 @@
 #include "lval.h"
 #include "environment.h"
 #include "builtin.h"
+#include "image.h"
+#include "interp.h"
+#include "server.h"
+#include "memstats.h"
+#include "port.h"
+#include "budget.h"
+#include "hashcons.h"
+#include "stream.h"
+#include "region.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define MAXLINE 1024
 
 // MAIN ////////////////////////////////////////////////////////////////////////////////
 
+/* At a terminal, ask whether to let an expression that ran out of budget go on */
+bool
+ask_to_continue(budget *b, void *data)
+{
+  budget *limits = data;
+  if (!isatty(STDIN_FILENO)) { return false; }
+  printf("Evaluation budget exhausted (%s). Continue? [y/N] ", b->why);
+  fflush(stdout);
+  char answer[16];
+  if (!fgets(answer, sizeof(answer), stdin) || answer[0] != 'y') { return false; }
+  b->steps += b->steps ? limits->steps : 0;
+  b->ms += b->ms ? limits->ms : 0;
+  b->bytes += b->bytes ? limits->bytes : 0;
+  return true;
+}
+
+/* Each form gets a fresh copy of `limits`, unless it is NULL */
 void
-run_repl(lenv *e)
+run_repl(lenv *e, budget *limits)
 {
   char *line = malloc(MAXLINE * sizeof (char));
   while (strcmp(line, "quit\n") != 0) {
     printf("> ");
     fgets(line, MAXLINE, stdin);
+    if (strcmp(line, ":mem\n") == 0) { // Dump heap statistics
+      mem_write(port_stdout());
+      port_flush(port_stdout());
+      continue;
+    }
+    bool top = region_begin(); // Released once the line is done
     lval *input = read_line(line);
+    budget b, *prev = NULL;
+    if (limits) {
+      b = *limits;
+      prev = budget_start(&b);
+    }
     lval *output = lval_eval(e, input);
+    if (limits) { budget_stop(prev); }
     print_lval(output);
     putchar('\n');
+    if (top) { region_end(NULL); } // Printed, so only what it bound is kept
+    if (hashconsing) { hashcons_maybe_collect(e, NULL); } // The result is printed already
   }
   free(line);
   putchar('\n');
 }
 
-/* Main loop, provides a REPL */
+/* Evaluate `src`, writing its result to `out`. False on an error, which goes to stderr */
+bool
+stream_eval(interp *in, char *src, port *out)
+{
+  lval *v = interp_eval_string(in, src);
+  if (get_type(v) == LVAL_ERR) {
+    fprintf(stderr, "%s\n", get_err(v));
+    return false;
+  }
+  stream_write(out, v);
+  return true;
+}
+
+/* Run `fn` on each record of standard input, with `begin` before and `end` after */
 int
-main (int argc, char **argv)
+run_stream(interp *in, char *fn, char delim, char *begin, char *end)
 {
+  port *out = port_stdout();
+  if (begin && !stream_eval(in, begin, out)) { return 1; }
+  lval *f = interp_eval_string(in, fn); // Evaluated once, then called on every record
+  if (get_type(f) != LVAL_ERR) { f = stream_records(in, f, STDIN_FILENO, delim, out); }
+  if (get_type(f) == LVAL_ERR) {
+    port_flush(out);
+    fprintf(stderr, "%s\n", get_err(f));
+    return 1;
+  }
+  if (end && !stream_eval(in, end, out)) { return 1; }
+  port_flush(out);
+  return 0;
+}
 
-  lenv *e = lenv_new(NULL); // Create the global environment
-  env_add_builtins(e);
-  read_initialize();
+/* Create an interpreter with the standard library, or without it if it won't load */
+interp *
+init_interp(void)
+{
+  interp *in = interp_new("stdlib.byol");
+  if (!in) {
+    fprintf(stderr, "WARNING: Could not load stdlib.byol\n");
+    in = interp_new(NULL);
+  }
+  return in;
+}
 
-  // Read in the standard library
-  lval *args = lval_sexp();
-  lval_cons(args, lval_string("stdlib.byol"));
-  builtin_load(e, args);
+void
+usage(void)
+{
+  fprintf(stderr, "usage: repl [--image FILE] [--save-image FILE] [--hashcons]\n"
+	  "            [--max-steps N] [--max-time MS] [--max-heap MB]\n"
+	  "            [--serve SOCKET [--workers N] [--timeout SECONDS] [--max-memory MB]]\n"
+	  "            [-n -e FN [-d DELIM] [--begin EXPR] [--end EXPR]]\n");
+}
+
+/*
+   Main loop, provides a REPL.
+
+   repl --save-image FILE  initialize, write the heap to FILE and exit
+   repl --image FILE       start from a heap image instead of stdlib.byol
+   repl --hashcons         share equal numbers, symbols, strings and
+                           sexps that are read, instead of copying them
+   repl --max-steps N      stop each form after N steps,
+     --max-time MS         MS milliseconds
+     --max-heap MB         or MB of heap growth. At a terminal, you are
+                           asked whether to carry on
+   repl --serve SOCKET     evaluate requests on a Unix socket instead, with
+     --workers N           N requests served at once (default 4)
+     --timeout SECONDS     a time limit per request (default 10, 0 for none)
+     --max-memory MB       a cap on each request's address space
+   repl -n -e FN           call the function FN on each line of standard
+     -d DELIM              input, or each record ending in DELIM's first
+                           character (a NUL if it is empty), writing
+                           the results to standard output
+     --begin EXPR          evaluate EXPR before the first record,
+     --end EXPR            and EXPR after the last
+*/
+int
+main (int argc, char **argv)
+{
+  char *image = NULL, *save_image = NULL, *sock_path = NULL;
+  char *record_fn = NULL, *begin = NULL, *end = NULL, delim = '\n';
+  bool streaming = false;
+  server_options opt = {4, 10, 0};
+  budget limits = {0};
+  limits.exhausted = ask_to_continue;
+  limits.data = &limits;
+  for (int i = 1; i < argc; i++) {
+    char *arg = argv[i];
+    if (strcmp(arg, "--hashcons") == 0) {
+      hashcons_enable(true);
+      continue;
+    }
+    if (strcmp(arg, "-n") == 0) {
+      streaming = true;
+      continue;
+    }
+    if (i + 1 == argc) {
+      usage();
+      return 1;
+    }
+    if (strcmp(arg, "--image") == 0) { image = argv[++i]; }
+    else if (strcmp(arg, "--save-image") == 0) { save_image = argv[++i]; }
+    else if (strcmp(arg, "--serve") == 0) { sock_path = argv[++i]; }
+    else if (strcmp(arg, "--workers") == 0) { opt.workers = atoi(argv[++i]); }
+    else if (strcmp(arg, "--timeout") == 0) { opt.timeout = atoi(argv[++i]); }
+    else if (strcmp(arg, "--max-memory") == 0) { opt.max_memory = atol(argv[++i]); }
+    else if (strcmp(arg, "--max-steps") == 0) { limits.steps = atol(argv[++i]); }
+    else if (strcmp(arg, "--max-time") == 0) { limits.ms = atol(argv[++i]); }
+    else if (strcmp(arg, "--max-heap") == 0) { limits.bytes = atol(argv[++i]) << 20; }
+    else if (strcmp(arg, "-e") == 0) { record_fn = argv[++i]; }
+    else if (strcmp(arg, "-d") == 0) { delim = argv[++i][0]; }
+    else if (strcmp(arg, "--begin") == 0) { begin = argv[++i]; }
+    else if (strcmp(arg, "--end") == 0) { end = argv[++i]; }
+    else {
+      usage();
+      return 1;
+    }
+  }
+  if (opt.workers < 1 || streaming != (record_fn != NULL)) {
+    usage();
+    return 1;
+  }
 
-  run_repl(e);
-  read_cleanup();
-  lenv_delete(e);
+  interp *in;
+  if (image) {
+    if (!(in = interp_image(image))) {
+      fprintf(stderr, "ERROR: Could not load image `%s`\n", image);
+      return 1;
+    }
+  } else {
+    in = init_interp();
+  }
+  if (save_image) {
+    if (image_save(save_image, interp_env(in)) != 0) {
+      fprintf(stderr, "ERROR: Could not write image `%s`\n", save_image);
+      return 1;
+    }
+    return 0;
+  }
+  if (sock_path) {
+    if (serve(interp_env(in), sock_path, &opt) != 0) {
+      fprintf(stderr, "ERROR: Could not listen on `%s`\n", sock_path);
+      return 1;
+    }
+    return 0;
+  }
+
+  bool limited = limits.steps || limits.ms || limits.bytes;
+  if (streaming) {
+    if (limited) { interp_set_budget(in, &limits); } // Per record
+    return run_stream(in, record_fn, delim, begin, end);
+  }
+  run_repl(interp_env(in), limited ? &limits : NULL);
+  interp_delete(in);
   return 0;
 }
@@ -0,0 +1,160 @@
+/*
+  Evaluation server
+
+  The parent warms up an environment once, listens on a Unix socket
+  and keeps `workers` children forked, each blocked in accept. A child
+  inherits the warm heap copy-on-write, serves exactly one connection
+  and exits, so no request sees another's definitions; the parent
+  forks a replacement. Forking happens off the request path.
+
+  A client writes forms and shuts down its side of the connection.
+  The printed result of each form is written back, one per line, as
+  soon as it is evaluated. A syntax error is reported and ends the
+  request.
+*/
+
+#include "server.h"
+#include "lval.h"
+#include "read.h"
+#include "port.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define BACKLOG 128
+
+volatile sig_atomic_t stopping = 0;
+int client_fd = -1; // The connection a child is serving
+
+void on_stop(int sig) { stopping = 1; }
+
+void
+on_timeout(int sig)
+{
+  static const char msg[] = "ERROR: Request timed out\n";
+  if (write(client_fd, msg, sizeof(msg) - 1) < 0) { _exit(1); }
+  _exit(1);
+}
+
+/* Serve one connection in a freshly forked child, then exit */
+void
+serve_one(lenv *e, int listener, server_options *opt, sigset_t *unblocked)
+{
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  sigprocmask(SIG_SETMASK, unblocked, NULL);
+  int fd;
+  while ((fd = accept(listener, NULL, NULL)) < 0) {
+    if (errno != EINTR) { _exit(1); }
+  }
+  close(listener);
+  client_fd = fd;
+
+  if (opt->timeout > 0) {
+    signal(SIGALRM, on_timeout);
+    alarm(opt->timeout);
+  }
+  if (opt->max_memory > 0) {
+    struct rlimit rl;
+    rl.rlim_cur = rl.rlim_max = (rlim_t)opt->max_memory << 20;
+    setrlimit(RLIMIT_AS, &rl);
+  }
+
+  FILE *f = fdopen(dup(fd), "w");
+  port *out = port_file(f);
+  reader *r = reader_fd("<client>", fd);
+  lval *form;
+  while ((form = read_next(r))) {
+    bool syntax_error = get_type(form) == LVAL_ERR;
+    lval_write(out, syntax_error ? form : lval_eval(e, form));
+    port_putc(out, '\n');
+    port_flush(out);
+    if (syntax_error) { break; }
+  }
+  port_delete(out);
+  fclose(f);
+  reader_close(r);
+  _exit(0);
+}
+
+pid_t
+spawn(lenv *e, int listener, server_options *opt)
+{
+  // A stop signal must not reach the child before it has dropped our handler
+  sigset_t stop, old;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGTERM);
+  sigaddset(&stop, SIGINT);
+  sigprocmask(SIG_BLOCK, &stop, &old);
+  pid_t pid = fork();
+  if (pid == 0) { serve_one(e, listener, opt, &old); }
+  sigprocmask(SIG_SETMASK, &old, NULL);
+  return pid;
+}
+
+/*
+   Serve requests against `e` on the socket at `path` until SIGTERM or
+   SIGINT. Returns 0, or -1 if the socket can't be set up.
+*/
+int
+serve(lenv *e, char *path, server_options *opt)
+{
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) { return -1; }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) { return -1; }
+  unlink(path);
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || listen(listener, BACKLOG) < 0) {
+    close(listener);
+    return -1;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop; // No SA_RESTART, so waitpid returns to check `stopping`
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  port_flush(port_stdout()); // Or children would repeat buffered output
+  fflush(NULL);
+  pid_t *workers = calloc(opt->workers, sizeof(pid_t));
+  for (int i = 0; i < opt->workers; i++) { workers[i] = spawn(e, listener, opt); }
+
+  while (!stopping) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR) { continue; }
+      break;
+    }
+    for (int i = 0; i < opt->workers; i++) {
+      if (workers[i] == pid) { workers[i] = stopping ? 0 : spawn(e, listener, opt); }
+    }
+  }
+
+  for (int i = 0; i < opt->workers; i++) {
+    if (workers[i] > 0) {
+      kill(workers[i], SIGTERM);
+      waitpid(workers[i], NULL, 0);
+    }
+  }
+  free(workers);
+  close(listener);
+  unlink(path);
+  return 0;
+}
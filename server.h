@@ -0,0 +1,14 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "structs.h"
+
+typedef struct server_options {
+  int workers; // Requests served at once
+  int timeout; // Seconds per request, 0 for none
+  long max_memory; // MB of address space per request, 0 for no limit
+} server_options;
+
+int serve(lenv *e, char *path, server_options *opt);
+
+#endif
@@ -0,0 +1,106 @@
+/*
+  Streaming records
+
+  repl -n reads its input as records separated by a delimiter, a
+  newline by default, and calls one function on each, as awk does:
+
+    repl -n -e '(\ (line) (if (= line "") () line))' < log
+
+  The input is read in large blocks into one buffer, which grows to
+  hold a record of any length. A record is passed as a string viewing
+  the buffer in place, with the delimiter overwritten by a NUL, so no
+  bytes are copied. Each call gets a region, so what it allocates is
+  released before the next record, and a record that is kept past the
+  call, as a result, a binding or in a holder outside the region, is
+  copied when it is promoted. If no region can be opened the record is
+  passed as a copy instead, since nothing would make one when it is
+  kept.
+
+  Each result is written to the output port followed by a newline:
+  strings as their bytes, `()` not at all, and anything else as the
+  repl prints it. The port buffers, so the output is flushed only when
+  it fills or the caller flushes it.
+*/
+
+#include "stream.h"
+#include "lval.h"
+#include "port.h"
+#include "region.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* Write `v` as one line of output */
+void
+stream_write(port *out, lval *v)
+{
+  if (get_type(v) == LVAL_SEXP && is_empty(v)) { return; }
+  if (get_type(v) == LVAL_STRING) {
+    port_puts(out, get_string(v));
+  } else {
+    lval_write(out, v);
+  }
+  port_putc(out, '\n');
+}
+
+/*
+   Call `fn` on each record read from `fd`, writing the results to
+   `out`. Returns the number of records, or the first error, which
+   stops the stream.
+*/
+lval *
+stream_records(interp *in, lval *fn, int fd, char delim, port *out)
+{
+  if (get_type(fn) != LVAL_FN) {
+    return lval_err("ERROR: Records must be passed to a function, not a %s",
+		    ltype_name(get_type(fn)));
+  }
+  size_t cap = STREAMBUF;
+  char *buf = malloc(cap + 1); // One more for the NUL after an unterminated last record
+  size_t start = 0, scanned = 0, end = 0; // buf[start, scanned) holds no delimiter
+  bool eof = false;
+  long n = 0;
+  lval *result = NULL;
+  while (!result) {
+    char *d = memchr(buf + scanned, delim, end - scanned);
+    if (!d && !eof) {
+      // Keep the partial record, at the front, and read more after it
+      memmove(buf, buf + start, end - start);
+      end -= start;
+      start = 0;
+      scanned = end;
+      if (end == cap) {
+	cap *= 2;
+	buf = realloc(buf, cap + 1);
+      }
+      ssize_t got = read(fd, buf + end, cap - end);
+      if (got < 0 && errno != EINTR) {
+	result = lval_err("ERROR: Could not read records: %s", strerror(errno));
+      }
+      if (got == 0) { eof = true; }
+      if (got > 0) { end += got; }
+      continue;
+    }
+    if (!d) { // End of input
+      if (start == end) { break; }
+      d = buf + end;
+    }
+    *d = '\0';
+    bool top = region_begin();
+    lval *rec = top ? lval_string_view(buf + start) : lval_string(buf + start);
+    lval *args = lval_cons(lval_sexp(), rec);
+    lval *v = interp_apply(in, fn, args);
+    if (get_type(v) == LVAL_ERR) {
+      result = v;
+    } else {
+      stream_write(out, v);
+      n++;
+    }
+    if (top) { result = region_end(result); }
+    start = scanned = d < buf + end ? d - buf + 1 : end;
+  }
+  free(buf);
+  return result ? result : lval_num(n);
+}
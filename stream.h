@@ -0,0 +1,12 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "structs.h"
+#include "interp.h"
+
+#define STREAMBUF (1 << 20) // Initial size of the input buffer
+
+lval *stream_records(interp *in, lval *fn, int fd, char delim, port *out);
+void stream_write(port *out, lval *v);
+
+#endif
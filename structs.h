@@ -6,5 +6,10 @@ typedef list lenv;
 typedef struct lval lval;
 typedef lval* (*lbuiltin)(lenv *, lval *);
 typedef struct map map;
+typedef struct btree btree;
+typedef struct vec vec;
+typedef struct image image;
+typedef struct port port;
+typedef struct reader reader;
 
 #endif
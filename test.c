@@ -1,14 +1,37 @@
+#define _DEFAULT_SOURCE // usleep, for the server test
+
 #include "list.h"
 #include "lval.h"
 #include "map.h"
+#include "btree.h"
+#include "vector.h"
 #include "environment.h"
 #include "builtin.h"
 #include "read.h"
+#include "image.h"
+#include "fasl.h"
+#include "json.h"
+#include "port.h"
+#include "memstats.h"
+#include "profile.h"
+#include "interp.h"
+#include "server.h"
+#include "budget.h"
+#include "hashcons.h"
+#include "stream.h"
+#include "region.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 
 void
 test_list(void)
@@ -50,12 +73,764 @@ test_map(void)
   map_remove(m_copy, z);
   assert(map_contains(m_copy, z) == 0);
   map_delete(m);
+
+  // Any key type, growth and removal, iteration in insertion order
+  m = map_new();
+  for (int i = 0; i < 10000; i++) { map_add(m, lval_num(i), lval_num(i * i)); }
+  map_add(m, lval_string("x"), y);
+  assert(lval_equal(map_get(m, lval_string("x")), y));
+  assert(!map_contains(m, x)); // Symbol `x` isn't string "x"
+  for (int i = 0; i < 10000; i += 2) { map_remove(m, lval_num(i)); }
+  assert(map_count(m) == 5001);
+  assert(get_num(map_get(m, lval_num(9999))) == 9999 * 9999);
+  assert(!map_contains(m, lval_num(5000)));
+  size_t i = 0;
+  lval *k, *v;
+  long expect = 1;
+  while (map_next(m, &i, &k, &v) && get_type(k) == LVAL_NUM) {
+    assert(get_num(k) == expect);
+    expect += 2;
+  }
+  assert(expect == 10001 && get_type(k) == LVAL_STRING);
+  map_delete(m);
+
+  // Lists and dicts are keys by their contents, dicts in any order
+  char *docs[] = {"{\"a\": [1, 2], \"b\": {}}", "{\"b\": {}, \"a\": [1, 2]}",
+		  "{\"a\": [1, 3], \"b\": {}}"};
+  lval *d1 = json_read(docs[0], strlen(docs[0]));
+  lval *d2 = json_read(docs[1], strlen(docs[1]));
+  assert(lval_equal(d1, d2) && lval_hash(d1) == lval_hash(d2));
+  assert(!lval_equal(d1, json_read(docs[2], strlen(docs[2]))));
+  m = map_new();
+  map_add(m, read_line("(1 (2 \"three\"))"), x);
+  map_add(m, d1, y);
+  assert(map_get(m, read_line("(1 (2 \"three\"))")) == x);
+  assert(map_get(m, d2) == y && !map_contains(m, read_line("(1 (2 three))")));
+}
+
+void
+test_sorted(void)
+{
+  btree *t = btree_new();
+  for (long i = 0; i < 10000; i++) { // Insert out of order so nodes split everywhere
+    long k = (i * 7919) % 10000;
+    btree_put(t, lval_num(2 * k), lval_num(k));
+  }
+  btree_put(t, lval_num(10), lval_num(-1)); // Overwrite
+  assert(btree_count(t) == 10000);
+  assert(get_num(btree_get(t, lval_num(10))) == -1);
+  assert(get_num(btree_get(t, lval_num(9998))) == 4999);
+  assert(!btree_get(t, lval_num(7)));
+
+  lval *k, *v;
+  assert(btree_floor(t, lval_num(7), &k, &v) && get_num(k) == 6);
+  assert(btree_ceiling(t, lval_num(7), &k, &v) && get_num(k) == 8);
+  assert(btree_floor(t, lval_num(20000), &k, &v) && get_num(k) == 19998);
+  assert(!btree_floor(t, lval_num(-1), &k, &v));
+  assert(!btree_ceiling(t, lval_num(19999), &k, &v));
+
+  bcursor c = btree_first(t);
+  long expect = 0;
+  while (btree_next(&c, &k, &v)) {
+    assert(get_num(k) == expect);
+    expect += 2;
+  }
+  assert(expect == 20000);
+  btree *copy = btree_copy(t);
+  btree_delete(t);
+  c = btree_seek(copy, lval_num(101));
+  assert(btree_next(&c, &k, &v) && get_num(k) == 102);
+  btree_delete(copy);
+
+  lenv *e = lenv_new(NULL);
+  env_add_builtins(e);
+  lval_eval(e, read_line("(def m (sorted-map \"pear\" 3 \"apple\" 1 5 true))"));
+  lval_eval(e, read_line("(sorted-put m \"fig\" 2)"));
+  lval *keys = lval_eval(e, read_line("(sorted-keys m)"));
+  assert(get_count(keys) == 4 && get_num(lval_first(keys)) == 5); // Numbers first
+  assert(strcmp(get_string(lval_nth(keys, 2)), "fig") == 0);
+  lval *r = lval_eval(e, read_line("(range m \"b\" \"g\")"));
+  assert(get_count(r) == 1 && get_num(lval_nth(lval_first(r), 1)) == 2);
+  r = lval_eval(e, read_line("(floor m \"orange\")"));
+  assert(strcmp(get_string(lval_first(r)), "fig") == 0);
+  assert(is_empty(lval_eval(e, read_line("(ceiling m \"q\")"))));
+  assert(get_type(lval_eval(e, read_line("(sorted-get m \"kiwi\")"))) == LVAL_ERR);
+
+  size_t len;
+  char *buf = fasl_encode(lval_eval(e, read_line("m")), &len);
+  lval *m2 = fasl_decode(e, buf, len);
+  assert(lval_equal(m2, lval_eval(e, read_line("m"))));
+  free(buf);
+}
+
+/* Check that `v` holds `n` numbers equal to `items` */
+void
+vec_check(vec *v, long *items, size_t n)
+{
+  assert(vec_count(v) == n);
+  for (size_t i = 0; i < n; i++) { assert(get_num(vec_nth(v, i)) == items[i]); }
+}
+
+void
+test_vector(void)
+{
+  // Random concats and slices leave relaxed nodes at every level
+  srand(7);
+  long *items = malloc(40000 * sizeof(long)), *scratch = malloc(40000 * sizeof(long));
+  size_t n = 0;
+  vec *v = vec_new();
+  for (int step = 0; step < 400; step++) {
+    size_t a = n ? rand() % n : 0, b = n ? rand() % n : 0;
+    if (a > b) { size_t t = a; a = b; b = t; }
+    vec *piece = vec_slice(v, a, b);
+    vec *fresh = vec_new();
+    int k = rand() % 70;
+    for (int i = 0; i < k; i++) { fresh = vec_conj(fresh, lval_num(step * 100 + i)); }
+    if (n + (b - a) + k > 40000) { // Start over from a slice
+      v = piece;
+      memmove(items, items + a, (b - a) * sizeof(long));
+      n = b - a;
+      continue;
+    }
+    memcpy(scratch, items + a, (b - a) * sizeof(long));
+    for (int i = 0; i < k; i++) { scratch[b - a + i] = step * 100 + i; }
+    vec *old = v;
+    v = vec_concat(rand() % 2 ? v : vec_slice(v, 0, n), vec_concat(piece, fresh));
+    vec_check(old, items, n); // Unchanged
+    memcpy(items + n, scratch, (b - a + k) * sizeof(long));
+    n += b - a + k;
+    if (n) {
+      size_t i = rand() % n;
+      v = vec_assoc(v, i, lval_num(-1));
+      items[i] = -1;
+    }
+    vec_check(v, items, n);
+  }
+  free(scratch);
+
+  // A transient writes in place and leaves the vector it came from alone
+  vec *t = vec_transient(v);
+  for (long i = 0; i < 1000; i++) { vec_conj(t, lval_num(i)); }
+  vec_assoc(t, 0, lval_num(42));
+  vec_persistent(t);
+  assert(vec_count(t) == n + 1000 && get_num(vec_nth(t, 0)) == 42);
+  vec_check(v, items, n);
+  free(items);
+
+  lenv *e = lenv_new(NULL);
+  env_add_builtins(e);
+  lval_eval(e, read_line("(def v (vec 1 2 3))"));
+  lval *w = lval_eval(e, read_line("(vec-concat v (vec-assoc v 1 20) (vec-conj v 4))"));
+  assert(get_num(lval_eval(e, read_line("(vec-count v)"))) == 3);
+  port *out = port_string();
+  lval_write(out, w);
+  assert(strcmp(port_contents(out, NULL), "#[1 2 3 1 20 3 1 2 3 4]") == 0);
+  port_delete(out);
+  lval *s = lval_eval(e, read_line("(vec-slice (vec 1 2 3 4) 1 3)"));
+  assert(lval_equal(s, lval_eval(e, read_line("(vec 2 3)"))));
+  assert(lval_hash(s) == lval_hash(lval_eval(e, read_line("(vec 2 3)"))));
+  assert(get_count(lval_eval(e, read_line("(vec-list v)"))) == 3);
+  lval_eval(e, read_line("(def t (vec-transient v))"));
+  assert(get_type(lval_eval(e, read_line("(vec-conj t 1)"))) == LVAL_ERR);
+  lval_eval(e, read_line("(vec-persistent! (vec-conj! t 4))"));
+  assert(get_type(lval_eval(e, read_line("(vec-conj! t 5)"))) == LVAL_ERR);
+  assert(get_num(lval_eval(e, read_line("(vec-count t)"))) == 4);
+  assert(get_type(lval_eval(e, read_line("(vec-nth v 3)"))) == LVAL_ERR);
+  // Bad arguments leave the vector passed alone
+  assert(get_type(lval_eval(e, read_line("(vec-count v 1)"))) == LVAL_ERR);
+  assert(get_type(lval_eval(e, read_line("(vec-list v v)"))) == LVAL_ERR);
+  assert(get_num(lval_eval(e, read_line("(vec-count v)"))) == 3);
+
+  size_t len;
+  char *buf = fasl_encode(w, &len);
+  assert(lval_equal(fasl_decode(e, buf, len), w));
+  free(buf);
+  lval_eval(e, read_line("(def big (vec-concat v (vec-slice t 1)))"));
+  assert(image_save("test.img", e) == 0);
+  lenv *loaded = image_load("test.img");
+  assert(get_num(lval_eval(loaded, read_line("(vec-nth big 5)"))) == 4);
+  assert(get_num(lval_eval(loaded, read_line("(vec-nth (vec-conj big 9) 6)"))) == 9);
+  remove("test.img");
+}
+
+void
+test_mem_stats(void)
+{
+  long nums = mem_live(LVAL_NUM), nodes = mem_live(MEM_LIST);
+  long bytes = mem_live(MEM_BYTES);
+  lval *s = lval_string("twelve bytes");
+  lval *l = lval_sexp();
+  lval_cons(l, lval_num(1));
+  lval_cons(l, lval_num(2));
+  assert(mem_live(LVAL_NUM) == nums + 2 && mem_live(MEM_LIST) == nodes + 2);
+  assert(mem_live(MEM_BYTES) == bytes + 13);
+  assert(mem_peak(LVAL_NUM) >= nums + 2);
+  lval_del(s);
+  lval_del(l);
+  assert(mem_live(LVAL_NUM) == nums && mem_live(MEM_LIST) == nodes);
+  assert(mem_live(MEM_BYTES) == bytes);
+
+  lval *stats = mem_stats();
+  lval *strings = lval_get(stats, lval_sym("string"));
+  assert(get_num(lval_get(strings, lval_sym("total"))) >= 1);
+}
+
+/* Profile `fact` in a thread of its own, writing the stacks to `fname` */
+void *
+profile_worker(void *fname)
+{
+  interp *in = interp_new("stdlib.byol");
+  lval *call = read_line("(fact 20)");
+  long n = -1;
+  if (profile_start(10000) == 0) {
+    for (int i = 0; i < 2000; i++) { lval_eval(interp_env(in), call); }
+    n = profile_stop(fname);
+  }
+  interp_delete(in);
+  return (void *)n;
+}
+
+void
+test_profile(void)
+{
+  lenv *e = lenv_new(NULL);
+  env_add_builtins(e);
+  reader *r = reader_open("stdlib.byol");
+  lval *form;
+  while ((form = read_next(r))) { lval_eval(e, form); }
+  reader_close(r);
+
+  port *p = port_string();
+  frame_label(p, lval_eval(e, read_line("fact")));
+  assert(strcmp(port_contents(p, NULL), "fact@stdlib.byol:2") == 0);
+  port_delete(p);
+
+  // A function keeps its own copy of its name
+  char name[] = "square";
+  lval *sq = lval_eval(e, read_line("(\\ (x) (* x x))"));
+  lval_set_name(sq, name);
+  strcpy(name, "other");
+  assert(strcmp(get_name(sq), "square") == 0 && strcmp(get_name(lval_copy(sq)), "square") == 0);
+  assert(get_string(read_line("(1 2)")) == NULL);
+
+  assert(profile_start(10000) == 0);
+  assert(profile_start(10000) != 0);
+  lval *call = read_line("(fact 20)");
+  for (int i = 0; i < 2000; i++) { lval_eval(e, call); }
+  assert(call_depth == 0);
+  assert(profile_stop("test.folded") > 0);
+  FILE *f = fopen("test.folded", "r");
+  char line[256];
+  assert(fgets(line, sizeof(line), f) && strncmp(line, "fact@stdlib.byol:2;", 19) == 0);
+  fclose(f);
+  remove("test.folded");
+  assert(profile_stop("test.folded") == -1);
+
+  // Threads profile themselves, at the same time
+  pthread_t threads[2];
+  char *files[] = {"test1.folded", "test2.folded"};
+  for (int i = 0; i < 2; i++) { pthread_create(&threads[i], NULL, profile_worker, files[i]); }
+  for (int i = 0; i < 2; i++) {
+    void *n;
+    pthread_join(threads[i], &n);
+    assert((long)n > 0);
+    f = fopen(files[i], "r");
+    assert(fgets(line, sizeof(line), f) && strncmp(line, "fact@stdlib.byol:2", 18) == 0);
+    fclose(f);
+    remove(files[i]);
+  }
+
+  assert(trace_start() == 0);
+  assert(get_num(lval_eval(e, read_line("(fact 10)"))) == 3628800);
+  p = port_string();
+  trace_stop(p);
+  assert(!tracing);
+  char *table = port_contents(p, NULL);
+  char *row = strstr(table, "fact@stdlib.byol:2");
+  assert(row);
+  while (row > table && row[-1] != '\n') { row--; }
+  assert(strtol(row, NULL, 10) == 11); // Calls
+  port_delete(p);
+}
+
+void *
+interp_worker(void *arg) // Sums (fact 10) many times in its own interpreter
+{
+  interp *in = arg;
+  long sum = 0;
+  for (int i = 0; i < 200; i++) { sum += get_num(interp_eval_string(in, "(fact 10)")); }
+  assert(call_depth == 0);
+  return (void *)sum;
+}
+
+void
+test_interp(void)
+{
+  interp *in = interp_new("stdlib.byol");
+  assert(in);
+  assert(!interp_new("no-such-stdlib.byol"));
+  lval *v = interp_eval_string(in, "(def sq (\\ (x) (* x x))) (sq 12)");
+  assert(get_num(v) == 144);
+  assert(get_type(interp_eval_string(in, "(sq")) == LVAL_ERR);
+
+  lval *args = lval_sexp();
+  lval_cons(args, lval_num(5));
+  assert(get_num(interp_call(in, "fact", args)) == 120);
+  assert(get_type(interp_call(in, "missing", args)) == LVAL_ERR);
+
+  interp *copy = interp_clone(in);
+  interp_eval_string(copy, "(def sq (\\ (x) 0)) (def only-copy 1)");
+  assert(get_num(interp_eval_string(in, "(sq 3)")) == 9);
+  assert(get_num(interp_eval_string(copy, "(sq 3)")) == 0);
+  assert(get_type(interp_eval_string(in, "only-copy")) == LVAL_ERR);
+  assert(get_num(interp_eval_string(copy, "(fact 4)")) == 24);
+
+  pthread_t threads[2];
+  interp *workers[2] = {interp_clone(in), interp_clone(in)};
+  for (int i = 0; i < 2; i++) { pthread_create(&threads[i], NULL, interp_worker, workers[i]); }
+  for (int i = 0; i < 2; i++) {
+    void *sum;
+    pthread_join(threads[i], &sum);
+    assert((long)sum == 200 * 3628800l);
+    interp_delete(workers[i]);
+  }
+  interp_delete(copy);
+  interp_delete(in);
+}
+
+/* The printed result of evaluating `src` in `in` */
+char *
+eval_printed(interp *in, char *src)
+{
+  port *p = port_string();
+  lval_write(p, interp_eval_string(in, src));
+  char *s = strdup(port_contents(p, NULL));
+  port_delete(p);
+  return s;
+}
+
+void
+test_list_builtins(void)
+{
+  interp *in = interp_new("stdlib.byol");
+  char *cases[][2] = {
+    {"(map (\\ (x) (* x x)) (list 1 2 3))", "(1 4 9)"},
+    {"(map head (list (list 1) (list 2)))", "(1 2)"},
+    {"(map (\\ (x) x) ())", "()"},
+    {"(filter (\\ (x) (> x 1)) (list 1 2 3 0 5))", "(2 3 5)"},
+    {"(foldl - 0 (list 1 2 3))", "-6"},
+    {"(foldr - 0 (list 1 2 3))", "2"},
+    {"(foldl (\\ (acc x) (cons x acc)) () (list 1 2 3))", "(3 2 1)"},
+    {"(length (list 1 2 3))", "3"},
+    {"(reverse (list 1 (list 2) 3))", "(3 (2) 1)"},
+    {"(append (list 1 2) () (list 3) (list 4 5))", "(1 2 3 4 5)"},
+    {"(append)", "()"},
+    {"(((\\ (a b c) (+ a b c)) 1) 2 3)", "6"},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    char *got = eval_printed(in, cases[i][0]);
+    assert(strcmp(got, cases[i][1]) == 0);
+    free(got);
+  }
+
+  // A lambda taking fewer or more arguments goes the slow way, and curries
+  lval *curried = interp_eval_string(in, "(map (\\ (x y) (+ x y)) (list 1 2))");
+  assert(get_count(curried) == 2 && get_type(lval_first(curried)) == LVAL_FN);
+  assert(get_num(interp_eval_string(in, "((head (map (\\ (x y) (* x y)) (list 3))) 4)")) == 12);
+
+  // append shares its last list, and leaves its arguments alone
+  interp_eval_string(in, "(def a (list 1 2)) (def b (list 3))");
+  lval *ab = interp_eval_string(in, "(append a b)");
+  assert(list_rest(list_rest(get_cell(ab))) == get_cell(interp_eval_string(in, "b")));
+  assert(get_count(interp_eval_string(in, "a")) == 2);
+
+  char *errors[] = {
+    "(map 1 (list 1))", "(map (\\ (x) x) 1)", "(filter (\\ (x) x) (list 1))",
+    "(foldl (\\ (a x) (head x)) 0 (list 1))", "(append (list 1) 2)", "(length 1)",
+    "(map (\\ (x) x) (list 1) (list 2))",
+  };
+  for (size_t i = 0; i < sizeof(errors) / sizeof(errors[0]); i++) {
+    assert(get_type(interp_eval_string(in, errors[i])) == LVAL_ERR);
+  }
+
+  // Long lists don't recurse
+  lval *big = lval_sexp();
+  for (int i = 0; i < 100000; i++) { lval_cons(big, lval_num(i)); }
+  lenv_set(interp_env(in), lval_sym("big"), big);
+  assert(get_num(interp_eval_string(in, "(foldl + 0 (map (\\ (x) (* 2 x)) big))")) == 99999l * 100000);
+  assert(get_num(interp_eval_string(in, "(length (filter (\\ (x) (< x 10)) (reverse big)))")) == 10);
+  interp_delete(in);
+}
+
+bool
+resume_twice(budget *b, void *data) // Doubles the step limit, twice
+{
+  int *resumes = data;
+  if (*resumes == 2) { return false; }
+  (*resumes)++;
+  b->steps *= 2;
+  return true;
+}
+
+void
+test_budget(void)
+{
+  interp *in = interp_new("stdlib.byol");
+  interp_eval_string(in, "(def loop (\\ (n) (if (= n 0) 0 (loop (- n 1)))))");
+  budget b = {.steps = 5000};
+  interp_set_budget(in, &b);
+  lval *v = interp_eval_string(in, "(loop 100000)");
+  assert(get_type(v) == LVAL_ERR && strstr(get_err(v), "(steps)"));
+  assert(budget_used(&b) == 5000);
+  // The error is recoverable, and each eval gets the whole budget again
+  assert(get_num(interp_eval_string(in, "(loop 100)")) == 0);
+  assert(budget_used(&b) < 5000);
+
+  int resumes = 0;
+  b.exhausted = resume_twice;
+  b.data = &resumes;
+  assert(get_num(interp_eval_string(in, "(loop 3000)")) == 0);
+  assert(resumes == 2 && b.steps == 20000);
+  resumes = 0;
+  b.steps = 5000;
+  assert(get_type(interp_eval_string(in, "(loop 100000)")) == LVAL_ERR);
+  assert(resumes == 2 && budget_used(&b) == 20000);
+
+  interp_eval_string(in, "(def fib (\\ (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))");
+  lval *args = lval_sexp();
+  lval_cons(args, lval_num(40));
+  b = (budget){.ms = 20};
+  assert(strstr(get_err(interp_call(in, "fib", args)), "(time)"));
+  interp_set_budget(in, NULL);
+  assert(get_num(interp_eval_string(in, "(loop 1000)")) == 0);
+  interp_delete(in);
+}
+
+void
+test_hashcons(void)
+{
+  interp *in = interp_new("stdlib.byol");
+  hashcons_enable(true);
+  lval *v = read_line("(a (1 \"s\") (1 \"s\") a)");
+  assert(lval_nth(v, 1) == lval_nth(v, 2) && lval_first(v) == lval_nth(v, 3));
+  assert(lval_num(7) == lval_num(7) && lval_sym("a") == lval_first(v));
+  assert(lval_copy(v) == v);
+  assert(lval_nth(read_line("(x (1 \"s\"))"), 1) == lval_nth(v, 1));
+  long shared = hashcons_shared();
+  assert(shared > 4);
+
+  // Interned lists are never changed: cons makes a new one
+  lval *l = interp_eval_string(in, "(def l (list 1 2)) (def l2 (cons 0 l)) l");
+  assert(get_count(l) == 2 && get_count(interp_eval_string(in, "l2")) == 3);
+  lval_del(v); // Left alone, since it is shared
+
+  // Values reachable from the environment survive a collection
+  interp_eval_string(in, "(def kept (list \"kept\" 99))");
+  for (int i = 0; i < 1000; i++) {
+    char src[64];
+    snprintf(src, sizeof(src), "(garbage %d \"%d\")", i, i);
+    read_line(src);
+  }
+  long before = hashcons_count();
+  assert(hashcons_collect(interp_env(in), NULL) >= 2000);
+  assert(hashcons_count() < before - 2000);
+  lval *kept = interp_eval_string(in, "kept");
+  assert(strcmp(get_string(lval_first(kept)), "kept") == 0 && get_num(lval_nth(kept, 1)) == 99);
+  assert(get_num(interp_eval_string(in, "(fact 5)")) == 120);
+  assert(lval_string("kept") == lval_first(kept));
+
+  // So does a root bound nowhere, such as a result the repl has yet to print
+  lval *unbound = read_line("(\"unbound\" (42))");
+  hashcons_collect(interp_env(in), unbound);
+  assert(read_line("(\"unbound\" (42))") == unbound);
+  assert(strcmp(get_string(lval_first(unbound)), "unbound") == 0);
+  assert(get_num(lval_first(lval_nth(unbound, 1))) == 42);
+  hashcons_enable(false);
+  assert(lval_num(7) != lval_num(7));
+  interp_delete(in);
+}
+
+lval *
+memo_stat(interp *in, char *fn, char *stat)
+{
+  char src[64];
+  snprintf(src, sizeof(src), "(memo-stats %s)", fn);
+  return lval_get(interp_eval_string(in, src), lval_sym(stat));
+}
+
+void
+test_memo(void)
+{
+  interp *in = interp_new("stdlib.byol");
+  interp_eval_string(in, "(def fib (memo (\\ (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))))");
+  assert(get_num(interp_eval_string(in, "(fib 60)")) == 1548008755920l);
+  assert(get_num(memo_stat(in, "fib", "misses")) == 61);
+  assert(get_num(memo_stat(in, "fib", "hits")) == 58);
+
+  // Two entries: a third distinct argument evicts one
+  interp_eval_string(in, "(def sq (memo (\\ (l) (* (head l) (head l))) 2))");
+  assert(get_num(interp_eval_string(in, "(sq (list 3)) (sq (list 3)) (sq (list 4))")) == 16);
+  assert(get_num(memo_stat(in, "sq", "misses")) == 2);
+  interp_eval_string(in, "(sq (list 5)) (sq (list 3)) (sq (list 4)) (sq (list 5))");
+  assert(get_num(memo_stat(in, "sq", "count")) == 2);
+  assert(get_num(memo_stat(in, "sq", "hits")) + get_num(memo_stat(in, "sq", "misses")) == 7);
+  assert(get_num(memo_stat(in, "sq", "misses")) > 3);
+
+  assert(get_type(interp_eval_string(in, "(memo +)")) == LVAL_ERR);
+  assert(get_type(interp_eval_string(in, "(memo-stats (\\ (x) x))")) == LVAL_ERR);
+  interp_delete(in);
+}
+
+void
+test_record(void)
+{
+  interp *in = interp_new("stdlib.byol");
+  interp_eval_string(in, "(defstruct point x y) (def p (make-point 1 (list 2 3)))");
+  assert(get_num(interp_eval_string(in, "(point-x p)")) == 1);
+  assert(get_count(interp_eval_string(in, "(point-y p)")) == 2);
+  assert(get_bool(interp_eval_string(in, "(point? p)")));
+  assert(!get_bool(interp_eval_string(in, "(point? 3)")));
+  assert(get_bool(interp_eval_string(in, "(= p (make-point 1 (list 2 3)))")));
+  assert(!get_bool(interp_eval_string(in, "(= p (make-point 1 2))")));
+  lval *p = interp_eval_string(in, "p");
+  assert(lval_hash(p) == lval_hash(interp_eval_string(in, "(make-point 1 (list 2 3))")));
+  port *out = port_string();
+  lval_write(out, p);
+  assert(strcmp(port_contents(out, NULL), "#point{x : 1, y : (2 3)}") == 0);
+  port_delete(out);
+
+  // A record read back still belongs to its struct
+  assert(get_bool(interp_eval_string(in, "(point? (deserialize (serialize p)))")));
+  assert(get_bool(interp_eval_string(in, "(= p (deserialize (serialize p)))")));
+  interp_eval_string(in, "(defstruct other x y)");
+  assert(!get_bool(interp_eval_string(in, "(= (make-point 1 2) (make-other 1 2))")));
+  assert(get_type(interp_eval_string(in, "(point-x (make-other 1 2))")) == LVAL_ERR);
+  assert(get_type(interp_eval_string(in, "(make-point 1 2 3)")) == LVAL_ERR);
+  assert(get_type(interp_eval_string(in, "(defstruct bad x x)")) == LVAL_ERR);
+  assert(get_type(interp_eval_string(in, "(defstruct bad 1)")) == LVAL_ERR);
+
+  assert(image_save("test.img", interp_env(in)) == 0);
+  lenv *loaded = image_load("test.img");
+  lval *y = lval_eval(loaded, read_line("(point-y p)"));
+  assert(get_num(lval_first(y)) == 2);
+  assert(get_bool(lval_eval(loaded, read_line("(point? (make-point 5 6))"))));
+  remove("test.img");
+  interp_delete(in);
+}
+
+long
+cell_stat(interp *in, char *name)
+{
+  return get_num(map_get(get_dict(interp_eval_string(in, "(cell-stats)")), lval_sym(name)));
+}
+
+void
+test_cell(void)
+{
+  interp *in = interp_new("stdlib.byol");
+  interp_eval_string(in, "(defcell a 1) (defcell b (+ a 1)) (defcell c (+ a 2)) (defcell d (+ b c))");
+  assert(get_num(interp_eval_string(in, "d")) == 5);
+  // d is reached along two paths but recomputed once, after both
+  assert(get_num(interp_eval_string(in, "(set-cell! a 5) d")) == 13);
+  assert(cell_stat(in, "last") == 3);
+
+  // An unchanged value stops the update
+  interp_eval_string(in, "(defcell pos (> a 0)) (defcell sign (if pos 1 -1))");
+  interp_eval_string(in, "(set-cell! a 6)");
+  assert(cell_stat(in, "last") == 4);
+  assert(get_num(interp_eval_string(in, "(set-cell! a -1) sign")) == -1);
+
+  // Edges follow the branch taken
+  interp_eval_string(in, "(defcell x 10) (defcell y 20) (defcell pick (if pos x y))");
+  assert(get_num(interp_eval_string(in, "(set-cell! x 11) pick")) == 20);
+  assert(cell_stat(in, "last") == 0);
+  assert(get_num(interp_eval_string(in, "(set-cell! a 1) pick")) == 11);
+
+  assert(get_num(interp_eval_string(in, "(cell-batch (set-cell! b 10) (set-cell! c 20)) d")) == 30);
+  assert(cell_stat(in, "last") == 1);
+
+  interp_eval_string(in, "(defcell p 1) (defcell q (+ p 1))");
+  assert(get_type(interp_eval_string(in, "(defcell p (+ q 1))")) == LVAL_ERR);
+  assert(get_type(interp_eval_string(in, "(set-cell! nope 1)")) == LVAL_ERR);
+
+  // 100 inputs with 100 cells each: a change reaches only its own 100
+  char src[64];
+  for (int i = 0; i < 100; i++) {
+    snprintf(src, sizeof(src), "(defcell in%d %d)", i, i);
+    interp_eval_string(in, src);
+  }
+  for (int i = 0; i < 10000; i++) {
+    snprintf(src, sizeof(src), "(defcell n%d (+ in%d %d))", i, i % 100, i);
+    interp_eval_string(in, src);
+  }
+  assert(get_num(interp_eval_string(in, "(set-cell! in7 1000) n107")) == 1107);
+  assert(cell_stat(in, "last") == 100);
+  interp_delete(in);
+}
+
+lval *native_twice(lenv *e, lval *args) { return lval_num(2 * get_num(lval_first(args))); }
+
+void
+test_native(void)
+{
+  interp *in = interp_new("stdlib.byol");
+  interp_eval_string(in, "(def labs (load-native \"libc.so.6\" \"labs\" \"long(long)\"))"
+		     "(def strlen (load-native \"libc.so.6\" \"strlen\" \"long(string)\"))"
+		     "(def memset (load-native \"libc.so.6\" \"memset\" \"void(buffer, int, long)\"))"
+		     "(def pow (load-native \"libm.so.6\" \"pow\" \"double(double, double)\"))");
+  assert(get_num(interp_eval_string(in, "(labs -7)")) == 7);
+  assert(get_num(interp_eval_string(in, "(strlen \"four\")")) == 4);
+  assert(get_num(interp_eval_string(in, "(pow 2 10)")) == 1024);
+  assert(get_num(interp_eval_string(in, "((pow 3) 2)")) == 9);
+  // A buffer is written in place
+  lval *s = interp_eval_string(in, "(def s \"hello\") (memset s 120 2) s");
+  assert(strcmp(get_string(s), "xxllo") == 0);
+
+  assert(get_type(interp_eval_string(in, "(labs \"x\")")) == LVAL_ERR);
+  assert(get_type(interp_eval_string(in, "(load-native \"libc.so.6\" \"no_such_fn\" \"int()\")")) == LVAL_ERR);
+  assert(get_type(interp_eval_string(in, "(load-native \"libc.so.6\" \"labs\" \"long(long\")")) == LVAL_ERR);
+  assert(get_type(interp_eval_string(in, "(load-native \"no-such-lib.so\")")) == LVAL_ERR);
+
+  // Clones get the function through fasl; registered builtins keep their names
+  builtin_register(interp_env(in), "twice", native_twice);
+  assert(strcmp(builtin_name(native_twice), "twice") == 0);
+  assert(builtin_lookup("twice") == native_twice);
+  interp *copy = interp_clone(in);
+  assert(get_num(interp_eval_string(copy, "(labs (twice -4))")) == 8);
+  interp_delete(copy);
+  interp_delete(in);
+}
+
+/* Send `src` to the server at `path` and return everything it writes back */
+char *
+server_request(char *path, char *src)
+{
+  struct sockaddr_un addr = {AF_UNIX};
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  for (int tries = 0; connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0; tries++) {
+    assert(tries < 100); // Wait for the server to start listening
+    usleep(10000);
+  }
+  assert(write(fd, src, strlen(src)) == (ssize_t)strlen(src));
+  shutdown(fd, SHUT_WR);
+  static char buf[1024];
+  size_t len = 0;
+  ssize_t n;
+  while ((n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) { len += n; }
+  buf[len] = '\0';
+  close(fd);
+  return buf;
+}
+
+void
+test_region(void)
+{
+  interp *in = interp_new("stdlib.byol");
+  size_t before = region_released();
+  interp_eval_string(in, "(def sq (\\ (x) (* x x))) (def big (map sq (list 1 2 3 4 5 6 7 8 9 10)))");
+  assert(region_released() > before);
+  assert(get_num(interp_eval_string(in, "(foldl + 0 big)")) == 385);
+
+  // Closures keep their frames, and what they share stays shared
+  interp_eval_string(in, "(def adder (\\ (n) (\\ (x) (+ x n))))");
+  interp_eval_string(in, "(def add5 (adder 5)) (def fns (list add5 add5))");
+  assert(get_num(interp_eval_string(in, "(add5 1)")) == 6);
+  lval *fns = interp_eval_string(in, "fns");
+  assert(lval_first(fns) == lval_nth(fns, 1));
+  assert(lval_first(fns) == interp_eval_string(in, "add5"));
+
+  // A global set twice in one form keeps its last value
+  interp_eval_string(in, "(progn (def c (list 1)) (def c (list c 2)))");
+  assert(get_num(interp_eval_string(in, "(head (head c))")) == 1);
+
+  // Records, sorted maps and vectors, and the holders outside the region
+  interp_eval_string(in, "(defstruct point x y) (def p (make-point 1 (list 2 3)))");
+  assert(get_bool(interp_eval_string(in, "(point? p)")));
+  assert(get_num(interp_eval_string(in, "(head (point-y p))")) == 2);
+  interp_eval_string(in, "(def s (sorted-map 1 (list 1)))");
+  interp_eval_string(in, "(sorted-put s 2 (list 2))");
+  assert(get_num(interp_eval_string(in, "(head (sorted-get s 2))")) == 2);
+  interp_eval_string(in, "(def v (vec (list 1) 2)) (def t (vec-transient (vec)))");
+  interp_eval_string(in, "(vec-conj! t (list 3)) (vec-assoc! t 0 (list 4))");
+  assert(get_num(interp_eval_string(in, "(head (vec-nth v 0))")) == 1);
+  assert(get_num(interp_eval_string(in, "(head (vec-nth t 0))")) == 4);
+  interp_eval_string(in, "(def m (memo (\\ (l) (list (head l)))))");
+  interp_eval_string(in, "(m (list 7))");
+  assert(get_num(interp_eval_string(in, "(head (m (list 7)))")) == 7);
+  assert(get_num(memo_stat(in, "m", "hits")) == 1);
+  interp_eval_string(in, "(defcell a (list 1)) (defcell b (list (head a) 2))");
+  interp_eval_string(in, "(set-cell! a (list 5))");
+  assert(get_num(interp_eval_string(in, "(head b)")) == 5);
+
+  // Macros called from a function don't keep its frame
+  interp_eval_string(in, "(def twice (macro (x) (list + x x))) (def f (\\ (y) (eval (twice y))))");
+  assert(get_num(interp_eval_string(in, "(eval (twice 3))")) == 6);
+  assert(get_num(interp_eval_string(in, "(f 4)")) == 8);
+
+  // Many small forms, each released when it is done
+  before = region_released();
+  for (int i = 0; i < 10000; i++) { interp_eval_string(in, "(foldl + 0 (map sq big))"); }
+  assert(region_released() - before > 10000 * 20 * lval_sizeof());
+
+  // What they released is no longer counted as live, and what is kept is
+  long nums = mem_live(LVAL_NUM);
+  interp_eval_string(in, "(progn (map sq big) true)");
+  assert(mem_live(LVAL_NUM) == nums);
+  interp_eval_string(in, "(def go (\\ (v n) (if (= n 0) v (go (vec-conj v n) (- n 1)))))");
+  interp_eval_string(in, "(def w (go (vec) 1000))");
+  assert(mem_live(LVAL_NUM) >= nums + 1000);
+
+  // Conjoining to a vector on the heap copies only its tail and path
+  nums = mem_live(LVAL_NUM);
+  interp_eval_string(in, "(def w (vec-conj w 0))");
+  assert(mem_live(LVAL_NUM) - nums < 100);
+  assert(get_num(interp_eval_string(in, "(vec-count w)")) == 1001);
+
+  // Forms loaded inside another form get regions of their own
+  FILE *f = fopen("test-region.lsp", "w");
+  fputs("(def l1 (list 1 2))\n(map sq big)\n(def l2 (list l1 3))\n(head l2)\n", f);
+  fclose(f);
+  lval *l = interp_eval_string(in, "(progn (def l0 (list 0)) (load \"test-region.lsp\"))");
+  assert(get_num(lval_first(l)) == 1);
+  assert(get_num(interp_eval_string(in, "(head (head l2))")) == 1);
+  assert(get_num(interp_eval_string(in, "(head l0)")) == 0);
+  remove("test-region.lsp");
+
+  // What is left is on the heap, so it can be saved and read back
+  assert(image_save("test.image", interp_env(in)) == 0);
+  lenv *e = image_load("test.image");
+  assert(get_num(lval_call(e, lenv_get(e, lval_sym("add5")), lval_cons(lval_sexp(), lval_num(2)))) == 7);
+  remove("test.image");
+  interp_delete(in);
+}
+
+void
+test_server(void)
+{
+  interp *in = interp_new("stdlib.byol");
+  char *path = "test.sock";
+  server_options opt = {2, 10, 0};
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) { exit(serve(interp_env(in), path, &opt)); }
+
+  assert(strcmp(server_request(path, "(fact 5) (def x 3) x"), "120\ntrue\n3\n") == 0);
+  // Each request starts from the warm environment, without earlier definitions
+  char *out = server_request(path, "x (+ 1");
+  assert(strncmp(out, "ERROR: Variable `x` not found!\nERROR: Syntax error", 50) == 0);
+  for (int i = 0; i < 5; i++) { assert(strcmp(server_request(path, "(+ 1 2)"), "3\n") == 0); }
+
+  int status;
+  kill(pid, SIGTERM);
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert(access(path, F_OK) != 0);
 }
 
 void
 test_read(void)
 {
-  read_initialize();
   char *line = "(+ 1 a)";
   // construct value
   lval *exp = lval_sexp();
@@ -64,7 +839,57 @@ test_read(void)
   lval_cons(exp, lval_sym("+"));
   lval *result = read_line(line);
   assert(lval_equal(exp, result));
-  read_cleanup();
+
+  result = read_line("(list \"a \\\" b\" (-5 -) true)");
+  assert(get_count(result) == 4);
+  assert(strcmp(get_string(lval_nth(result, 1)), "a \\\" b") == 0);
+  lval *inner = lval_nth(result, 2);
+  assert(get_type(lval_first(inner)) == LVAL_NUM && get_num(lval_first(inner)) == -5);
+  assert(get_type(lval_nth(inner, 1)) == LVAL_SYM);
+  assert(get_type(lval_nth(result, 3)) == LVAL_BOOL);
+
+  result = read_line("(+ 1\n  (2 3)");
+  assert(get_type(result) == LVAL_ERR);
+  result = read_line("(+ 1\n  ))");
+  assert(get_type(result) == LVAL_ERR);
+}
+
+void
+test_read_stream(void)
+{
+  // One form larger than the reader's chunk size, spanning several reads
+  char *fname = "test_stream.byol";
+  FILE *f = fopen(fname, "w");
+  fprintf(f, "(def a 1)\n\"");
+  for (int i = 0; i < 200000; i++) { fputc('x', f); }
+  fprintf(f, "\"\n  (+ a 2)\n");
+  fclose(f);
+
+  reader *r = reader_open(fname);
+  lval *form = read_next(r);
+  assert(get_type(form) == LVAL_SEXP && get_count(form) == 3);
+  form = read_next(r);
+  assert(get_type(form) == LVAL_STRING && strlen(get_string(form)) == 200000);
+  form = read_next(r);
+  assert(get_type(form) == LVAL_SEXP);
+  assert(read_next(r) == NULL);
+  reader_close(r);
+
+  lenv *e = lenv_new(NULL);
+  env_add_builtins(e);
+  lval *args = lval_sexp();
+  lval_cons(args, lval_string(fname));
+  lval *result = builtin_load(e, args);
+  assert(get_type(result) == LVAL_NUM && get_num(result) == 3);
+  remove(fname);
+
+  // A read that fails is an error, not the end of the file
+  r = reader_open(".");
+  assert(get_type(read_next(r)) == LVAL_ERR);
+  reader_close(r);
+  assert(get_type(read_file(".")) == LVAL_ERR);
+  args = lval_cons(lval_sexp(), lval_string("."));
+  assert(get_type(builtin_load(e, args)) == LVAL_ERR);
 }
 
 void
@@ -82,6 +907,38 @@ test_lval(void)
   assert(get_num(result) == 8);
 }
 
+void
+test_long_list(void)
+{
+  int n = 10000000;
+  hashcons_enable(true); // Share the elements, so only the nodes take memory
+  list *l = NULL, *m = list_cons(lval_num(-1), NULL);
+  for (int i = n - 1; i >= 0; i--) {
+    l = list_cons(lval_num(i % 100), l);
+    if (i < n - 1) { m = list_cons(lval_num(i % 100), m); }
+  }
+  hashcons_enable(false);
+  lval *x = lval_sexp_of(l), *differs = lval_sexp_of(m);
+  assert(get_count(x) == n && get_num(lval_nth(x, n - 1)) == 99);
+  assert(get_count(differs) == n && get_num(lval_nth(differs, n - 2)) == 98);
+
+  lval *y = lval_copy(x);
+  assert(get_count(y) == n && lval_equal(x, y));
+  assert(!lval_equal(x, differs)); // Only the last element differs
+  lval_cons(y, lval_num(0));
+  assert(!lval_equal(x, y));
+
+  port *p = port_string();
+  lval_write(p, x);
+  size_t len;
+  char *s = port_contents(p, &len);
+  assert(len > 2 * (size_t)n && strncmp(s, "(0 1 2 ", 7) == 0 && strcmp(s + len - 4, " 99)") == 0);
+  port_delete(p);
+  lval_del(x);
+  lval_del(y);
+  lval_del(differs);
+}
+
 void
 test_environment(void)
 {
@@ -105,12 +962,211 @@ test_environment(void)
   lenv_delete(e1);
 }
 
+void
+test_image(void)
+{
+  lenv *e = lenv_new(NULL);
+  env_add_builtins(e);
+  lval_eval(e, read_line("(def sq (\\ (x) (* x x)))"));
+  lval_eval(e, read_line("(def name \"byol\")"));
+  lval_eval(e, read_line("(def m (sorted-map 2 \"b\" 1 \"a\"))"));
+  assert(image_save("test.img", e) == 0);
+
+  lenv *loaded = image_load("test.img");
+  assert(loaded);
+  assert(image_contains(loaded) && !image_contains(e));
+  lval *result = lval_eval(loaded, read_line("(sq 7)"));
+  assert(get_type(result) == LVAL_NUM && get_num(result) == 49);
+  result = lval_eval(loaded, read_line("name"));
+  assert(strcmp(get_string(result), "byol") == 0);
+  result = lval_eval(loaded, read_line("(floor m 5)"));
+  assert(get_num(lval_first(result)) == 2);
+  remove("test.img");
+}
+
+void
+test_fasl(void)
+{
+  lenv *e = lenv_new(NULL);
+  env_add_builtins(e);
+  lval *shared = read_line("(a \"b\" -123456789012 true)");
+  lval *v = lval_sexp();
+  lval_cons(v, shared);
+  lval_cons(v, shared);
+  lval *d = lval_dict();
+  lval_put(d, lval_sym("k"), lval_num(5));
+  lval_cons(v, d);
+  lval_cons(v, lval_eval(e, read_line("(\\ (x y) (+ x y))")));
+
+  size_t len;
+  char *buf = fasl_encode(v, &len);
+  lval *copy = fasl_decode(e, buf, len);
+  assert(get_count(copy) == 4);
+  assert(lval_equal(lval_nth(copy, 2), shared));
+  assert(lval_nth(copy, 2) == lval_nth(copy, 3)); // Sharing survives
+  assert(get_num(lval_get(lval_nth(copy, 1), lval_sym("k"))) == 5);
+  lval *call = lval_sexp();
+  lval_cons(call, lval_num(2));
+  lval_cons(call, lval_num(40));
+  lval_cons(call, lval_first(copy));
+  assert(get_num(lval_eval(e, call)) == 42);
+
+  assert(get_type(fasl_decode(e, buf, len - 1)) == LVAL_ERR);
+  char *str = fasl_to_string(buf, len);
+  size_t len2;
+  char *buf2 = fasl_from_string(str, &len2);
+  assert(len2 == len && memcmp(buf, buf2, len) == 0);
+  free(buf);
+  free(buf2);
+  free(str);
+}
+
+void
+test_json(void)
+{
+  char *doc = " {\"name\": \"a \\\"q\\\" \\u00e9 {x}\", \"n\": [1, -20, true, null, []],"
+    " \"nested\": {\"k\": false}} ";
+  lval *v = json_read(doc, strlen(doc));
+  assert(get_type(v) == LVAL_DICT);
+  assert(strcmp(get_string(lval_get(v, lval_sym("name"))), "a \"q\" \xc3\xa9 {x}") == 0);
+  lval *n = lval_get(v, lval_sym("n"));
+  assert(get_count(n) == 5 && get_num(lval_nth(n, 1)) == -20);
+  assert(get_type(lval_nth(n, 3)) == LVAL_SEXP && is_empty(lval_nth(n, 3)));
+  assert(get_bool(lval_get(lval_get(v, lval_sym("nested")), lval_sym("k"))) == false);
+
+  lval *out = json_write(v);
+  assert(strcmp(get_string(out),
+		"{\"name\":\"a \\\"q\\\" \xc3\xa9 {x}\",\"n\":[1,-20,true,[],[]],"
+		"\"nested\":{\"k\":false}}") == 0);
+
+  char *bad[] = {"[1,]", "{\"a\" 1}", "[1 2]", "\"open", "[1.5]", "{} x", "", "[[1]",
+    "[\"a\" xyz]", "{\"a\": [1] garbage}", "[{} 1]", "{\"a\": \"b\" c, \"d\": 1}"};
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    assert(get_type(json_read(bad[i], strlen(bad[i]))) == LVAL_ERR);
+  }
+  assert(get_num(json_read(" 42 ", 4)) == 42);
+}
+
+void
+test_port(void)
+{
+  port *p = port_string();
+  lval_write(p, read_line("(\\ (x) (f \"s\" (x true) ()))"));
+  assert(strcmp(port_contents(p, NULL), "(\\ (x) (f \"s\" (x true) ()))") == 0);
+
+  // Deep and long values don't recurse on the C stack
+  lval *deep = lval_sexp();
+  for (int i = 0; i < 100000; i++) {
+    lval *outer = lval_sexp();
+    deep = lval_cons(outer, deep);
+  }
+  lval *wide = lval_sexp();
+  for (int i = 0; i < 100000; i++) { lval_cons(wide, lval_num(i % 10)); }
+  port_clear(p);
+  lval_write(p, deep);
+  size_t len;
+  port_contents(p, &len);
+  assert(len == 2 * 100001);
+  port_clear(p);
+  lval_write(p, wide);
+  port_contents(p, &len);
+  assert(len == 2 * 100000 + 1);
+  port_delete(p);
+}
+
+/* Records from a file holding `data` */
+lval *
+stream_file(interp *in, char *fn, char *data, size_t len, char delim, port *out)
+{
+  FILE *f = fopen("test.records", "w");
+  fwrite(data, 1, len, f);
+  fclose(f);
+  int fd = open("test.records", O_RDONLY);
+  lval *result = stream_records(in, interp_eval_string(in, fn), fd, delim, out);
+  close(fd);
+  remove("test.records");
+  return result;
+}
+
+void
+test_stream(void)
+{
+  interp *in = interp_new("stdlib.byol");
+  port *out = port_string();
+  char *data = "one\n\nthree\nlast";
+  lval *n = stream_file(in, "(\\ (line) (if (= line \"\") () line))", data, strlen(data), '\n', out);
+  assert(get_num(n) == 4);
+  assert(strcmp(port_contents(out, NULL), "one\nthree\nlast\n") == 0);
+
+  // Other delimiters, and results that aren't strings
+  port_clear(out);
+  data = "a\0b\0";
+  n = stream_file(in, "(\\ (x) (list x 1))", data, 4, '\0', out);
+  assert(get_num(n) == 2 && strcmp(port_contents(out, NULL), "(\"a\" 1)\n(\"b\" 1)\n") == 0);
+
+  // A record longer than the buffer, and one spanning a refill
+  size_t len = 3 * STREAMBUF;
+  char *big = malloc(len);
+  memset(big, 'y', len);
+  big[STREAMBUF + 10] = ',';
+  big[len - 1] = ',';
+  port_clear(out);
+  n = stream_file(in, "(\\ (x) x)", big, len, ',', out);
+  size_t got;
+  char *s = port_contents(out, &got);
+  assert(get_num(n) == 2 && got == len && s[STREAMBUF + 10] == '\n' && s[STREAMBUF + 11] == 'y');
+  free(big);
+
+  // An error stops the stream
+  port_clear(out);
+  data = "x\ny\n";
+  n = stream_file(in, "(\\ (x) (head x))", data, strlen(data), '\n', out);
+  assert(get_type(n) == LVAL_ERR && strlen(port_contents(out, NULL)) == 0);
+  assert(get_type(stream_file(in, "1", data, strlen(data), '\n', out)) == LVAL_ERR);
+
+  // Records kept past their call have their own bytes once the buffer is gone
+  interp_eval_string(in, "(defstruct entry text) (def seen (sorted-map)) (def echo (memo (\\ (s) s)))");
+  data = "first\nsecond\nthird\n";
+  n = stream_file(in, "(\\ (line) (progn (echo line) (sorted-put seen line (make-entry line)) ()))",
+		  data, strlen(data), '\n', out);
+  assert(get_num(n) == 3);
+  lval *kept = interp_eval_string(in, "(sorted-keys seen)");
+  assert(get_count(kept) == 3 && strcmp(get_string(lval_first(kept)), "first") == 0);
+  assert(strcmp(get_string(interp_eval_string(in, "(entry-text (sorted-get seen \"second\"))")), "second") == 0);
+  assert(strcmp(get_string(interp_eval_string(in, "(echo \"third\")")), "third") == 0);
+  port_delete(out);
+  interp_delete(in);
+}
+
 int
 main() {
   test_list();
   test_map();
+  test_sorted();
+  test_vector();
+#ifndef NMEMSTATS
+  test_mem_stats();
+#endif
   test_lval();
+  test_long_list();
   test_read();
+  test_read_stream();
   test_environment();
+  test_image();
+  test_fasl();
+  test_json();
+  test_port();
+  test_profile();
+  test_interp();
+  test_list_builtins();
+  test_memo();
+  test_record();
+  test_cell();
+  test_hashcons();
+  test_native();
+  test_budget();
+  test_stream();
+  test_region();
+  test_server();
   printf("Success! All tests passed.\n");
 }
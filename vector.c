@@ -0,0 +1,468 @@
+/*
+  Persistent vectors, as 32-way RRB trees
+
+  Items live in leaves of up to WIDTH lvals, under inner nodes of up to
+  WIDTH children. A node whose children are all full but the last is
+  indexed by radix, five bits of the index per level. Concatenation and
+  slicing leave some nodes part full, and those carry a table of their
+  children's cumulative sizes to search instead ("relaxed" nodes).
+
+  Updates copy the path from the root to the changed leaf and share the
+  rest, so every old version stays valid and costs only the nodes it
+  doesn't share. Concatenation merges the two trees down their facing
+  edges, redistributing nodes so each level has at most EXTRA more than
+  the fewest it could, which keeps the tree O(log n) deep.
+
+  A transient vector changes in place the nodes it made itself, so
+  building one item at a time copies nothing after the first write to
+  a node. Nodes record the transient that made them; once it is made
+  persistent no one else owns them, so they are never changed again.
+  Nodes are shared, so they are never freed.
+
+  Nodes come from the open region, or for a transient from wherever the
+  transient lives, so a vector on the heap never points to a node in a
+  region. Promoting a vector out of the region copies only the nodes
+  in it, which are the paths changed during the form, and shares the
+  rest.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "vector.h"
+#include "lval.h"
+#include "image.h"
+#include "region.h"
+
+#define BITS 5
+#define WIDTH (1 << BITS)
+#define EXTRA 2 // Nodes a level may have beyond the fewest possible
+
+typedef struct vnode vnode;
+
+struct vnode {
+  void *edit; // The transient that may change it in place, or NULL
+  int len;
+  size_t *sizes; // Cumulative sizes of the children, or NULL if indexed by radix
+  void *slot[WIDTH]; // Children, or lvals in a leaf
+};
+
+struct vec {
+  size_t count;
+  int shift; // Index bits below the root's; 0 when the root is a leaf
+  vnode *root;
+  void *edit; // Its own address while transient, otherwise NULL
+};
+
+vnode *
+vnode_new(void *edit)
+{
+  vnode *n = edit ? region_alloc_near(edit, sizeof(vnode)) : region_alloc(sizeof(vnode));
+  memset(n, 0, sizeof(vnode));
+  n->edit = edit;
+  return n;
+}
+
+/* A size table for `n`, which lives as long as it does */
+size_t *
+sizes_new(vnode *n)
+{
+  return region_alloc_near(n, WIDTH * sizeof(size_t));
+}
+
+/* `n` if the transient `edit` made it, or else a copy that it owns */
+vnode *
+editable(vnode *n, void *edit)
+{
+  if (edit && n->edit == edit) { return n; }
+  vnode *m = vnode_new(edit);
+  m->len = n->len;
+  memcpy(m->slot, n->slot, n->len * sizeof(void *));
+  if (n->sizes) {
+    m->sizes = sizes_new(m);
+    memcpy(m->sizes, n->sizes, n->len * sizeof(size_t));
+  }
+  return m;
+}
+
+/* Items under `n`, a node at `shift` */
+size_t
+node_size(vnode *n, int shift)
+{
+  if (shift == 0) { return n->len; }
+  if (n->sizes) { return n->sizes[n->len - 1]; }
+  return ((size_t)(n->len - 1) << shift) + node_size(n->slot[n->len - 1], shift - BITS);
+}
+
+/* Give `n` a size table unless every child but the last is full */
+void
+set_sizes(vnode *n, int shift)
+{
+  size_t sizes[WIDTH], total = 0;
+  bool radix = true;
+  for (int i = 0; i < n->len; i++) {
+    size_t size = node_size(n->slot[i], shift - BITS);
+    if (i < n->len - 1 && size != (size_t)1 << shift) { radix = false; }
+    sizes[i] = total += size;
+  }
+  if (radix) {
+    image_free(n->sizes);
+    n->sizes = NULL;
+    return;
+  }
+  if (!n->sizes) { n->sizes = sizes_new(n); }
+  memcpy(n->sizes, sizes, n->len * sizeof(size_t));
+}
+
+/* The child of `n` holding item `*i`, with `*i` made relative to it */
+int
+child_index(vnode *n, int shift, size_t *i)
+{
+  int idx = *i >> shift; // Children hold at most 1 << shift, so never past it
+  if (!n->sizes) {
+    *i -= (size_t)idx << shift;
+    return idx;
+  }
+  while (n->sizes[idx] <= *i) { idx++; }
+  if (idx) { *i -= n->sizes[idx - 1]; }
+  return idx;
+}
+
+vec *
+vec_make(vec *v, size_t count, int shift, vnode *root)
+{
+  if (v && v->edit) { // A transient changes in place
+    v->count = count;
+    v->shift = shift;
+    v->root = root;
+    return v;
+  }
+  vec *w = region_alloc(sizeof(vec));
+  *w = (vec){count, shift, root, NULL};
+  return w;
+}
+
+vec *vec_new(void) { return vec_make(NULL, 0, 0, vnode_new(NULL)); }
+size_t vec_count(vec *v) { return v->count; }
+bool vec_is_transient(vec *v) { return v->edit != NULL; }
+
+lval *
+vec_nth(vec *v, size_t i)
+{
+  vnode *n = v->root;
+  for (int shift = v->shift; shift > 0; shift -= BITS) { n = n->slot[child_index(n, shift, &i)]; }
+  return n->slot[i];
+}
+
+vnode *
+assoc(vnode *n, int shift, size_t i, lval *x, void *edit)
+{
+  vnode *m = editable(n, edit);
+  if (shift == 0) {
+    m->slot[i] = x;
+    return m;
+  }
+  int idx = child_index(n, shift, &i);
+  m->slot[idx] = assoc(n->slot[idx], shift - BITS, i, x, edit);
+  return m;
+}
+
+/* `v` with item `i` replaced by `x`; `i` may be the count, to add it */
+vec *
+vec_assoc(vec *v, size_t i, lval *x)
+{
+  if (i == v->count) { return vec_conj(v, x); }
+  return vec_make(v, v->count, v->shift, assoc(v->root, v->shift, i, x, v->edit));
+}
+
+/* A path of nodes from `shift` down to a leaf holding only `x` */
+vnode *
+new_path(int shift, lval *x, void *edit)
+{
+  vnode *n = vnode_new(edit);
+  n->len = 1;
+  n->slot[0] = shift ? (void *)new_path(shift - BITS, x, edit) : (void *)x;
+  return n;
+}
+
+/* `n` with `x` added after its last item, or NULL if it has no room */
+vnode *
+push(vnode *n, int shift, lval *x, void *edit)
+{
+  if (shift == 0) {
+    if (n->len == WIDTH) { return NULL; }
+    vnode *m = editable(n, edit);
+    m->slot[m->len++] = x;
+    return m;
+  }
+  vnode *child = push(n->slot[n->len - 1], shift - BITS, x, edit);
+  if (!child && n->len == WIDTH) { return NULL; }
+  vnode *m = editable(n, edit);
+  if (child) {
+    m->slot[m->len - 1] = child;
+    if (m->sizes) { m->sizes[m->len - 1]++; }
+    return m;
+  }
+  m->slot[m->len++] = new_path(shift - BITS, x, edit);
+  if (m->sizes) {
+    m->sizes[m->len - 1] = m->sizes[m->len - 2] + 1;
+  } else if (node_size(m->slot[m->len - 2], shift - BITS) != (size_t)1 << shift) {
+    set_sizes(m, shift); // The child it passed over wasn't full
+  }
+  return m;
+}
+
+vec *
+vec_conj(vec *v, lval *x)
+{
+  vnode *root = push(v->root, v->shift, x, v->edit);
+  if (root) { return vec_make(v, v->count + 1, v->shift, root); }
+  root = vnode_new(v->edit); // No room, so the tree grows a level
+  root->len = 2;
+  root->slot[0] = v->root;
+  root->slot[1] = new_path(v->shift, x, v->edit);
+  set_sizes(root, v->shift + BITS);
+  return vec_make(v, v->count + 1, v->shift + BITS, root);
+}
+
+/*
+   Merge the children of `l` but its last, `center`, and of `r` but
+   its first: nodes at `shift` - BITS. They are repacked until there
+   are at most EXTRA more than their items need, and returned under a
+   node at `shift` + BITS holding one or two nodes at `shift`.
+*/
+vnode *
+rebalance(vnode *l, vnode *center, vnode *r, int shift)
+{
+  vnode *all[3 * WIDTH];
+  int plan[3 * WIDTH + 1] = {0};
+  int n = 0, total = 0;
+  for (int i = 0; l && i < l->len - 1; i++) { all[n++] = l->slot[i]; }
+  for (int i = 0; i < center->len; i++) { all[n++] = center->slot[i]; }
+  for (int i = 1; r && i < r->len; i++) { all[n++] = r->slot[i]; }
+  for (int i = 0; i < n; i++) { total += plan[i] = all[i]->len; }
+
+  // Pour each short node into the ones after it, until few enough are left
+  int count = n, optimal = (total + WIDTH - 1) / WIDTH;
+  for (int i = 0; count > optimal + EXTRA; count--, i--) {
+    while (plan[i] > WIDTH - EXTRA / 2) { i++; }
+    for (int rest = plan[i]; rest > 0; i++) {
+      int size = rest + plan[i + 1] < WIDTH ? rest + plan[i + 1] : WIDTH;
+      rest += plan[i + 1] - size;
+      plan[i] = size;
+    }
+    memmove(plan + i, plan + i + 1, (count - i - 1) * sizeof(int));
+  }
+
+  vnode *out[3 * WIDTH];
+  int src = 0, off = 0;
+  for (int k = 0; k < count; k++) {
+    if (off == 0 && all[src]->len == plan[k]) { // Unchanged, so shared
+      out[k] = all[src++];
+      continue;
+    }
+    vnode *m = vnode_new(NULL);
+    while (m->len < plan[k]) {
+      int take = all[src]->len - off < plan[k] - m->len ? all[src]->len - off : plan[k] - m->len;
+      memcpy(m->slot + m->len, all[src]->slot + off, take * sizeof(void *));
+      m->len += take;
+      if ((off += take) == all[src]->len) {
+	src++;
+	off = 0;
+      }
+    }
+    if (shift > BITS) { set_sizes(m, shift - BITS); }
+    out[k] = m;
+  }
+
+  vnode *top = vnode_new(NULL);
+  for (int k = 0; k < count; k += WIDTH) {
+    vnode *m = vnode_new(NULL);
+    m->len = count - k < WIDTH ? count - k : WIDTH;
+    memcpy(m->slot, out + k, m->len * sizeof(vnode *));
+    set_sizes(m, shift);
+    top->slot[top->len++] = m;
+  }
+  set_sizes(top, shift + BITS);
+  return top;
+}
+
+/* `l` followed by `r`, under a node one level above the taller, holding one or two nodes */
+vnode *
+concat(vnode *l, int lshift, vnode *r, int rshift)
+{
+  if (lshift > rshift) {
+    return rebalance(l, concat(l->slot[l->len - 1], lshift - BITS, r, rshift), NULL, lshift);
+  }
+  if (lshift < rshift) {
+    return rebalance(NULL, concat(l, lshift, r->slot[0], rshift - BITS), r, rshift);
+  }
+  if (lshift > 0) {
+    return rebalance(l, concat(l->slot[l->len - 1], lshift - BITS, r->slot[0], rshift - BITS),
+		     r, lshift);
+  }
+  vnode *top = vnode_new(NULL); // Two leaves
+  if (l->len + r->len <= WIDTH) {
+    vnode *leaf = vnode_new(NULL);
+    memcpy(leaf->slot, l->slot, l->len * sizeof(void *));
+    memcpy(leaf->slot + l->len, r->slot, r->len * sizeof(void *));
+    leaf->len = l->len + r->len;
+    top->slot[top->len++] = leaf;
+  } else {
+    top->slot[top->len++] = l;
+    top->slot[top->len++] = r;
+  }
+  set_sizes(top, BITS);
+  return top;
+}
+
+/* Drop roots with a single child */
+vec *
+vec_trim(size_t count, int shift, vnode *root)
+{
+  while (shift > 0 && root->len == 1) {
+    root = root->slot[0];
+    shift -= BITS;
+  }
+  return vec_make(NULL, count, shift, root);
+}
+
+vec *
+vec_concat(vec *a, vec *b)
+{
+  if (!b->count) { return a; }
+  if (!a->count) { return b; }
+  int shift = (a->shift > b->shift ? a->shift : b->shift) + BITS;
+  return vec_trim(a->count + b->count, shift, concat(a->root, a->shift, b->root, b->shift));
+}
+
+/* The first `n` items under `node`, where 0 < `n` */
+vnode *
+take(vnode *node, int shift, size_t n)
+{
+  if (shift == 0 && n == node->len) { return node; }
+  vnode *m = editable(node, NULL);
+  if (shift == 0) {
+    m->len = n;
+    return m;
+  }
+  size_t i = n - 1;
+  int idx = child_index(node, shift, &i);
+  m->len = idx + 1;
+  m->slot[idx] = take(node->slot[idx], shift - BITS, i + 1);
+  set_sizes(m, shift);
+  return m;
+}
+
+/* The items under `node` after the first `n` */
+vnode *
+drop(vnode *node, int shift, size_t n)
+{
+  if (n == 0) { return node; }
+  vnode *m = vnode_new(NULL);
+  if (shift == 0) {
+    m->len = node->len - n;
+    memcpy(m->slot, node->slot + n, m->len * sizeof(void *));
+    return m;
+  }
+  int idx = child_index(node, shift, &n);
+  m->len = node->len - idx;
+  m->slot[0] = drop(node->slot[idx], shift - BITS, n);
+  memcpy(m->slot + 1, node->slot + idx + 1, (m->len - 1) * sizeof(void *));
+  set_sizes(m, shift);
+  return m;
+}
+
+/* Items `start` up to but not including `end` */
+vec *
+vec_slice(vec *v, size_t start, size_t end)
+{
+  if (start == end) { return vec_new(); }
+  if (start == 0 && end == v->count) { return v; }
+  vnode *root = drop(take(v->root, v->shift, end), v->shift, start);
+  return vec_trim(end - start, v->shift, root);
+}
+
+/* A transient copy of `v`, to be changed in place */
+vec *
+vec_transient(vec *v)
+{
+  vec *t = vec_make(NULL, v->count, v->shift, v->root);
+  t->edit = t;
+  return t;
+}
+
+/* Make the transient `t` persistent. It must not be changed after this */
+vec *
+vec_persistent(vec *t)
+{
+  t->edit = NULL;
+  return t;
+}
+
+/* `n` at `shift`, or its copy if it is being promoted; `edit` is the transient's new address */
+vnode *
+vnode_promote(vnode *n, int shift, void *old, void *edit)
+{
+  void *copy;
+  if (!region_moving(n)) { return n; } // Nothing outside the region points into it
+  if (region_seen(n, &copy)) { return copy; }
+  vnode *m = region_alloc(sizeof(vnode));
+  memcpy(m, n, sizeof(vnode));
+  region_forward(n, m);
+  if (n->edit && n->edit == old) { m->edit = edit; }
+  if (n->sizes) {
+    m->sizes = sizes_new(m);
+    memcpy(m->sizes, n->sizes, n->len * sizeof(size_t));
+  }
+  for (int i = 0; i < n->len; i++) {
+    m->slot[i] = shift ? (void *)vnode_promote(n->slot[i], shift - BITS, old, edit)
+      : (void *)lval_promote(n->slot[i]);
+  }
+  return m;
+}
+
+/* A copy of `v` out of the region if it is being promoted, sharing the nodes that aren't */
+vec *
+vec_promote(vec *v)
+{
+  void *copy;
+  if (!region_moving(v)) { return v; }
+  if (region_seen(v, &copy)) { return copy; }
+  vec *w = region_alloc(sizeof(vec));
+  *w = *v;
+  region_forward(v, w);
+  if (v->edit) { w->edit = w; }
+  w->root = vnode_promote(v->root, v->shift, v, w->edit);
+  return w;
+}
+
+size_t
+vnode_image_dump(image *im, vnode *n, int shift)
+{
+  size_t off;
+  if (image_seen(im, n, &off)) { return off; }
+  off = image_alloc(im, n, sizeof(vnode));
+  image_ptr(im, off + offsetof(vnode, edit), 0); // Loaded nodes belong to no transient
+  if (n->sizes) {
+    image_ptr(im, off + offsetof(vnode, sizes), image_alloc(im, n->sizes, WIDTH * sizeof(size_t)));
+  }
+  for (int i = 0; i < n->len; i++) {
+    image_ptr(im, off + offsetof(vnode, slot) + i * sizeof(void *),
+	      shift ? vnode_image_dump(im, n->slot[i], shift - BITS) : lval_image_dump(im, n->slot[i]));
+  }
+  return off;
+}
+
+/* Copy `v` and its nodes into an image */
+size_t
+vec_image_dump(image *im, vec *v)
+{
+  size_t off;
+  if (image_seen(im, v, &off)) { return off; }
+  off = image_alloc(im, v, sizeof(vec));
+  image_ptr(im, off + offsetof(vec, root), vnode_image_dump(im, v->root, v->shift));
+  image_ptr(im, off + offsetof(vec, edit), 0);
+  return off;
+}
@@ -0,0 +1,27 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "structs.h"
+
+vec *vec_new(void);
+size_t vec_count(vec *v);
+lval *vec_nth(vec *v, size_t i);
+vec *vec_assoc(vec *v, size_t i, lval *x);
+vec *vec_conj(vec *v, lval *x);
+vec *vec_concat(vec *a, vec *b);
+vec *vec_slice(vec *v, size_t start, size_t end);
+
+// Transients change in place, and return the vector they were passed
+
+vec *vec_transient(vec *v);
+vec *vec_persistent(vec *t);
+bool vec_is_transient(vec *v);
+
+vec *vec_promote(vec *v);
+
+size_t vec_image_dump(image *im, vec *v);
+
+#endif